@@ -11,19 +11,55 @@
  *      File: FS.c
  */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include "FS.h"
 
-const int VERSION = 2;
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stddef.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#if defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+#include <pthread.h>
+#define PARALLEL_COPY
+#endif
+
+const int VERSION = 18;
 
 #define ORG_SIZE_FILENAME      256
 #define ORG_SIZE_BLOCK         1024 * 4
 #define ORG_LIMIT_FILES        512
 #define ORG_LIMIT_BLOCKS       1024 * 8
 
+/* bounds of the geometry chosen when a disk is created */
+#define MIN_SIZE_FILENAME      16
+#define MAX_SIZE_FILENAME      1024
+#define MIN_SIZE_BLOCK         512
+#define MAX_SIZE_BLOCK         (1024 * 1024 * 64)
+#define MAX_LIMIT_FILES        (1024 * 1024 * 256)
+
+#define DESC_EXTENTS           8
+#define COPY_BUFFER            (1024 * 1024)
+#define TABLE_PAGE             4096
+#define SIZE_BATCH_LINE        4096
+
 int SIZE_FILENAME           = ORG_SIZE_FILENAME;
 int SIZE_BLOCK              = ORG_SIZE_BLOCK;
 int LIMIT_FILES             = ORG_LIMIT_FILES;
 int LIMIT_BLOCKS            = ORG_LIMIT_BLOCKS;
+int MAP_BLOCKS              = ORG_LIMIT_BLOCKS;
+int BASE_FILES              = ORG_LIMIT_FILES;
+int BASE_MAP_BLOCKS         = ORG_LIMIT_BLOCKS;
 
 struct Header
 {
@@ -31,572 +67,9484 @@ struct Header
     int usedFiles;
     int usedBlocks;
     
-    int usedMemory;
+    long long usedMemory;
     
     int blockSize;
     int blocksLimit;
+    int mapBlocks;      /* blocks the map was made for; blocksLimit is lower if the disk was shrunk */
     int filesLimit;
     int nameSize;
+    
+    int hashSize;
+    int freeDescriptor;
+    int descriptorWatermark;    /* descriptors from here on have never been used */
+    
+    int generation;     /* changed by every sync, so other processes see the disk has changed */
+    
+    int journalSize;
+    int journalTail;
+    int journalSequence;
+    int journalStart;   /* checkpoint: the first transaction which may not be on the disk in place yet */
+    int startSequence;  /* and its sequence number */
+    
+    int openPack;       /* pack small files are appended to, or -1 */
+    int freePack;
+    int packWatermark;
+    
+    int dedupSize;
+    long long sharedBlocks;     /* blocks saved by deduplication */
+    
+    long long compressedMemory; /* size of the compressed files */
+    int compressedBlocks;       /* blocks they are stored in */
+    
+    int rootFirst;      /* first entry of the root directory, or -1 */
+    int directories;    /* descriptors of directories, counted in usedFiles */
+    int reservedFiles;  /* descriptors taken by inserts which have not ended (DESC_RESERVED) */
+    
+    int baseFiles;      /* descriptors and map of blocks laid out when the disk was created; */
+    int baseMapBlocks;  /* filesLimit and mapBlocks also count the ones added by resizing */
+    int segments;       /* table segments added by resizing */
+    int lastSegment;    /* block of the last one, or -1 */
+    int segmentBlocks;  /* blocks they and a journal moved to them take, counted in usedBlocks */
+    int journalBlock;   /* -1 - the journal is in its own region, otherwise in the blocks of a segment */
+    int journalBlocks;
 };
 
-struct DiskHandler
+/*
+ *  A file is stored as a list of extents - runs of contiguous blocks.
+ *  The first DESC_EXTENTS of them are kept in the descriptor; the rest
+ *  go to overflow blocks taken from the blocks region, each one holding
+ *  an ExtentBlock header followed by as many extents as fit in a block.
+ */
+struct Extent
 {
-    FILE *file;
-    struct Header header;
-    int status;
+    int start;
+    int length;
 };
 
-struct Node
+struct ExtentBlock
 {
-    int isUsed;
-    int nextNode;
+    int next;
+    int count;
 };
 
+/*
+ *  The name is kept last: on the disk only nameSize bytes of it are
+ *  stored (see GetDescriptorSize), so a descriptor record is a prefix
+ *  of this structure and is read into it directly.
+ *
+ *  Small files do not take whole blocks. A DESC_INLINE file keeps its
+ *  data in the descriptor itself - in the space of the extents and in
+ *  the unused bytes after its name. A DESC_PACKED file keeps its tail
+ *  (fileSize % blockSize bytes, the whole file if it is smaller than a
+ *  block) at packOffset in the block of a pack shared with other files.
+ *  A DESC_COMPRESSED file keeps its data compressed in whole blocks (see
+ *  CompressFile) and has no tail.
+ *
+ *  A DESC_DIRECTORY entry holds no data. The name of an entry is a single
+ *  component of its path; the entries of a directory are chained through
+ *  nextSibling and prevSibling from its firstChild (from rootFirst of the
+ *  header for the root), so a directory is listed in time proportional
+ *  to its number of entries.
+ *
+ *  A DESC_RESERVED descriptor is not used yet: it holds the blocks and
+ *  the tail of a file being inserted (see ReserveFile), so they are given
+ *  back if the insert never ends.
+ */
+#define DESC_INLINE      1
+#define DESC_PACKED      2
+#define DESC_COMPRESSED  4
+#define DESC_DIRECTORY   8
+#define DESC_RESERVED    16
+
 struct Descriptor
 {
-    char name[ORG_SIZE_FILENAME];
-    int firstNode;
     int isUsed;
-    int fileSize;
+    long long fileSize;
     time_t timeAdded;
+    
+    int flags;
+    int pack;
+    int packOffset;
+    
+    int extentCount;
+    int overflow;       /* for freed descriptors: next free descriptor or -1 */
+    struct Extent extents[DESC_EXTENTS];
+    
+    int parent;         /* directory holding the entry, -1 - the root */
+    int firstChild;     /* for directories: first entry, or -1 */
+    int nextSibling;
+    int prevSibling;
+    
+    char name[MAX_SIZE_FILENAME];
 };
 
-struct Header GetHeader(FILE *disk)
+/*
+ *  Name index stored right after the descriptor table. It is an open
+ *  addressing hash table with linear probing; every slot keeps the index
+ *  of the descriptor + 1 (0 - empty slot, -1 - deleted slot) and the full
+ *  hash of its name, so most mismatches are rejected without reading
+ *  the descriptor itself.
+ */
+#define SLOT_EMPTY     0
+#define SLOT_DELETED  -1
+
+struct HashSlot
 {
-    struct Header header;
-    fseek(disk, 0, SEEK_SET);
-    fread(&header, sizeof(struct Header), 1, disk);
-    return header;
-}
+    int descriptor;
+    unsigned int hash;
+};
 
-void SetHeader(FILE *disk, struct Header header)
+/*
+ *  Pack: a block holding the tails of several files, stored in a table
+ *  after the name index. Tails are appended at used and live counts the
+ *  files still stored in it; the block is released with its last file.
+ *  Every file has at most one tail, so the table has one pack more than
+ *  there are descriptors.
+ */
+struct Pack
 {
-    fseek(disk, 0, SEEK_SET);
-    fwrite(&header, sizeof(struct Header), 1, disk);
-}
+    int block;          /* for freed packs: next free pack or -1 */
+    int used;
+    int live;
+};
+
+/*
+ *  Deduplication: every block of file data has a reference count in a
+ *  table after the packs (0 - not a block of a stored file) and full
+ *  blocks are indexed by a hash of their content in a table after it.
+ *  A new block whose hash is found there is compared with the indexed
+ *  block and, if it is the same, the file refers to that block instead
+ *  of getting its own. The index is lossy: a slot is looked for only
+ *  among DEDUP_PROBES slots and the first one is overwritten if all are
+ *  taken; entries of freed blocks are left behind and rejected by their
+ *  reference count or by the comparison.
+ */
+#define REFS_MAX       65535
+#define DEDUP_PROBES   8
+#define DEDUP_RATIO    4        /* blocks per index slot */
 
-struct DiskHandler OpenDisk(const char *diskName, const char *attr)
+struct DedupSlot
 {
-    struct DiskHandler disk;
-    struct Header header;
+    unsigned int hash;
+    int block;          /* block + 1, 0 - empty slot */
+};
 
-    FILE *file = fopen(diskName, attr);
-    if (!file)
-    {
-        printf("Cannot open the disk %s\n", diskName);
-        disk.status = 1;
-        return disk;
-    }
+/*
+ *  Resizing: the tables laid out when the disk was created stay where
+ *  they are, and every resize chains a segment holding the records they
+ *  gain - descriptors, packs, reference counts and words of the map for
+ *  the new blocks - taken from the first blocks added to the disk, so
+ *  nothing which is already stored is moved. A table is a list of parts,
+ *  the first records of each of which are given by the segments.
+ *
+ *  The name index is not rehashed: a segment adding descriptors brings a
+ *  new level of the index, large enough for all descriptors of the disk,
+ *  into which new entries go; names are looked for in all the levels,
+ *  the newest first. If the metadata outgrows the journal, the segment
+ *  also brings a larger journal.
+ */
+struct Segment
+{
+    int previous;       /* block of the previous segment, or -1 */
+    int block;
+    int blocks;
     
-    disk.status = 0;
-    header = GetHeader(file);
-    if (header.version != VERSION)
-    {
-        printf("Disk was configurated for a different version of file system (%d vs %d)\n", header.version, VERSION);
-        fclose(file);
-        disk.status = 2;
-        return disk;
-    }
+    int firstFile;      /* descriptors and packs from firstFile (+1 for packs) */
+    int files;
+    int firstSlot;      /* slots of its level of the name index */
+    int hashSize;
+    int firstMapBlock;  /* reference counts and map of blocks from firstMapBlock */
+    int mapBlocks;
     
-    SIZE_FILENAME = header.nameSize;
-    SIZE_BLOCK = header.blockSize;
-    LIMIT_FILES = header.filesLimit;
-    LIMIT_BLOCKS = header.blocksLimit;
+    long long descriptors;
+    long long packs;
+    long long slots;
+    long long refs;
+    long long words;
+    long long summary;
+};
+
+int TABLE_CACHE_PAGES = 1024;
+int HASH_SIZE = ORG_LIMIT_FILES * 2;
+int DEDUP_SIZE = 1;
+int JOURNAL_SIZE = 0;
+int JOURNAL_REGION = 0;
+int JOURNAL_BLOCK = -1;
+
+/*
+ *  Cached on-disk table of fixed size records (descriptors, index slots,
+ *  words of the map of blocks). Records are read from the disk a page at
+ *  a time on first access and dirty pages are written back by SyncDisk.
+ *  Records from parts[i].first on are stored at parts[i].addr, the ones
+ *  before the first part at addr.
+ *  If limit is set, at most limit pages are cached: the cached pages are
+ *  kept in a ring in which a clock hand looks for one to evict, skipping
+ *  the dirty ones and giving the ones used since it last passed them
+ *  another turn. Only if all of them are dirty the ring grows.
+ */
+struct TablePart
+{
+    int first;
+    long long addr;
+};
+
+struct Table
+{
+    long long addr;
+    int recordSize;
+    int count;
+    int perPage;
+    struct TablePart *parts;
+    int partCount;
+    char **pages;
+    char *dirty;
+    char *referenced;
     
-    disk.file = file;
-    disk.header = header;
+    int *ring;
+    int cached;
+    int ringSize;
+    int hand;
+    int limit;
     
-    return disk;
-}
+    long long hits;
+    long long misses;
+};
+
+/*
+ *  Free space map stored after the name index, the packs, the reference
+ *  counts of the blocks and the slots of the deduplication index (the
+ *  parts added by resizing are in the segments): one bit per block
+ *  (1 - used), packed into 32-bit words. Bits past the last block are
+ *  always set, so they are never handed out. It is followed by a summary
+ *  holding the number of used blocks in every page of the map, so whole
+ *  pages which are full or empty are skipped without being read. Only
+ *  MAP_CACHE_PAGES clean pages of the map are kept in memory, so the
+ *  memory needed does not grow with the number of blocks.
+ */
+#define BITS_WORD        32
+#define MAP_PAGE_WORDS   (TABLE_PAGE / 4)
+#define MAP_PAGE_BLOCKS  (MAP_PAGE_WORDS * BITS_WORD)
+#define MAP_CACHE_PAGES  (TABLE_CACHE_PAGES / 4)
 
-int CreateDisk(const char *diskName, int diskSize)
+struct BlockMap
 {
-    FILE *file;
-    struct Header header;
-    struct Descriptor desc;
-    struct Node node;
-    
-    char emptyData[ORG_SIZE_BLOCK];
-    int i;
+    struct DiskHandler *disk;
+    struct Table words;
+    struct Table summary;
+    int count;
+};
 
-    header.version = VERSION;
-    header.usedFiles = 0;
-    header.usedBlocks = 0;
-    header.usedMemory = 0;
-    header.blockSize = ORG_SIZE_BLOCK;
-    header.blocksLimit = ORG_LIMIT_BLOCKS;
-    header.filesLimit = ORG_LIMIT_FILES;
-    header.nameSize = ORG_SIZE_FILENAME;
-    
-    header.blocksLimit = diskSize / header.blockSize;
-    if (diskSize % header.blockSize != 0) header.blocksLimit++;
+/*
+ *  Cache of data blocks of a mounted disk: the entries are found by the
+ *  number of the block through a hash table and evicted by a clock hand,
+ *  like the pages of the tables. Reads of files go through it and read
+ *  ahead while the file is read sequentially; writes of files update the
+ *  cached blocks, which are written back when they are evicted or when
+ *  the operation ends (so other processes see them), in the order of the
+ *  blocks. It is not used with the mmap backend, where the kernel caches
+ *  the image anyway.
+ */
+#define READ_AHEAD_LIMIT (256 * 1024)
+
+struct CachedBlock
+{
+    int block;          /* -1 - free entry */
+    int next;           /* next entry in the same bucket, -1 - none */
+    char referenced;
+    char dirty;
+};
+
+struct BlockCache
+{
+    struct CachedBlock *entries;
+    char *data;
+    char *scratch;
+    int *buckets;
+    int capacity;
+    int bucketMask;
+    int used;
+    int hand;
+    int dirty;
     
-    file = fopen(diskName, "wb");
+    int nextBlock;
+    int window;
     
-    if (!file)
-    {
-        printf("Cannot create a file for the disk\n");
-        return 1;
-    }
+    long long hits;
+    long long misses;
+    long long readAhead;
+    long long writeBacks;
+    long long evictions;
+};
+
+/*
+ *  Cache of resolved directories: a path of a directory is looked up
+ *  before its components are resolved one by one in the name index.
+ *  Entries are replaced on collision and the whole cache is dropped when
+ *  a directory is removed or renamed, or another process changed the
+ *  disk.
+ */
+#define PATH_CACHE_SIZE 256
+
+struct CachedPath
+{
+    char *path;         /* NULL - free entry */
+    int length;
+    int index;
+};
+
+/*
+ *  Cache of extent lists: the whole extent list of a file read or
+ *  changed lately and its index of starts (see IndexExtents) are kept,
+ *  so an access in the middle of a fragmented file does not walk its
+ *  overflow blocks again. An entry is found by the descriptor index,
+ *  checked against the descriptor and dropped when the descriptor is
+ *  written; the whole cache is dropped when another process changed the
+ *  disk.
+ */
+#define EXTENT_CACHE_SIZE 64
+
+struct CachedExtents
+{
+    struct Extent *extents; /* NULL - free entry */
+    int *starts;
+    int index;
+    int count;
+    int overflow;
+};
+
+/*
+ *  Mounted disk. With the mmap backend the whole image is mapped and map
+ *  points at its first byte, otherwise map is NULL. Metadata is cached
+ *  in both cases until the disk is synced, so it reaches the image only
+ *  after it has been committed to the journal.
+ */
+struct DiskHandler
+{
+    FILE *file;
+    char *map;
+    long long mapSize;
+    char *name;
+    int writable;
     
-    fwrite(&header, sizeof(struct Header), 1, file);
+    struct Header header;
+    int headerDirty;
+    int locks;
+    int reclaimed;      /* reservations left by crashed processes were looked for (ReclaimFiles) */
     
-    desc.isUsed = 0;
-
-    for (i = 0; i < header.filesLimit; ++i)
-        fwrite(&desc, sizeof(struct Descriptor), 1, file);
+    struct Table descriptors;
+    struct Table slots;
+    struct Table packs;
+    struct Table refs;
+    struct Table dedup;
+    struct BlockMap blocks;
+    struct BlockCache cache;
     
-    node.isUsed = 0;
-    for (i = 0; i < header.blocksLimit; ++i)
-        fwrite(&node, sizeof(struct Node), 1, file);
+    struct CachedPath paths[PATH_CACHE_SIZE];
+    long long pathHits;
+    long long pathMisses;
     
-    for (i = 0; i < header.blocksLimit; ++i)
-        fwrite(emptyData, sizeof(char), header.blockSize, file);
+    struct CachedExtents lists[EXTENT_CACHE_SIZE];
+    long long extentHits;
+    long long extentMisses;
     
-    fclose(file);
-    return 0;
+    struct Segment *segments;
+    int segmentCount;
+};
+
+int DISK_BACKEND = DISK_STDIO;
+int KERNEL_COPY = 1;
+int COPY_THREADS = 1;
+int PREALLOCATE = 0;
+int DEDUPLICATE = 1;
+int COMPRESSION = 0;
+long long BLOCK_CACHE = 16 * 1024 * 1024;
+int CACHE_REPORT = 0;
+int CRASH_POINT = CRASH_NONE;
+int CRASH_COMMIT = 1;
+
+void SetDiskBackend(int backend)
+{
+    DISK_BACKEND = backend;
 }
 
-void RemoveDisk(const char *diskName)
+void SetCopyThreads(int threads)
 {
-    remove(diskName);
+    COPY_THREADS = threads > 0 ? threads : 1;
 }
 
-int GetFileSize(FILE *file)
+void SetDeduplicate(int deduplicate)
 {
-    int fileSize;
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    return fileSize;
+    DEDUPLICATE = deduplicate;
 }
 
-int GetDescriptorAddr(int index)
+void SetCompression(int compression)
 {
-    return sizeof(struct Header) + sizeof(struct Descriptor) * index;
+    COMPRESSION = compression;
 }
 
-int GetNodeAddr(int index)
+void SetPreallocate(int preallocate)
 {
-    return sizeof(struct Header) + sizeof(struct Descriptor) * LIMIT_FILES + sizeof(struct Node) * index;
+    PREALLOCATE = preallocate;
 }
 
-int GetBlockAddr(int index)
+void SetBlockCache(long long size)
 {
-    return sizeof(struct Header) + sizeof(struct Descriptor) * LIMIT_FILES + sizeof(struct Node) * LIMIT_BLOCKS + SIZE_BLOCK * index;
+    BLOCK_CACHE = size > 0 ? size : 0;
 }
 
-struct Descriptor GetDescriptor(FILE *disk, int index)
+void SetMetadataCache(long long size)
 {
-    struct Descriptor result;
-    fseek(disk, GetDescriptorAddr(index), SEEK_SET);
-    fread(&result, sizeof(struct Descriptor), 1, disk);
-    return result;
+    TABLE_CACHE_PAGES = size / TABLE_PAGE > 4 ? (int) (size / TABLE_PAGE) : 4;
 }
 
-struct Node GetNode(FILE *disk, int index)
+/*
+ *  Parses a size given in bytes, optionally with a K, M or G suffix, for
+ *  the setters above. Returns -1 if str is not such a size.
+ */
+long long ParseSize(const char *str)
 {
-    struct Node result;
-    fseek(disk, GetNodeAddr(index), SEEK_SET);
-    fread(&result, sizeof(struct Node), 1, disk);
-    return result;
+    char *end;
+    long long size;
+    long long unit = 1;
+    
+    errno = 0;
+    size = strtoll(str, &end, 10);
+    if (end == str || errno != 0 || size < 0) return -1;
+    
+    if (*end == 'K' || *end == 'k') unit = 1024;
+    else if (*end == 'M' || *end == 'm') unit = 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') unit = 1024 * 1024 * 1024;
+    if (unit > 1) end++;
+    
+    if (*end != '\0' || size > LLONG_MAX / unit) return -1;
+    return size * unit;
 }
 
-void SetDescriptor(FILE *disk, int index, struct Descriptor desc)
+void SetCacheReport(int report)
 {
-    fseek(disk, GetDescriptorAddr(index), SEEK_SET);
-    fwrite(&desc, sizeof(struct Descriptor), 1, disk);
+    CACHE_REPORT = report;
 }
 
-void SetNode(FILE *disk, int index, struct Node node)
+void SetCrashPoint(int point, int commit)
 {
-    fseek(disk, GetNodeAddr(index), SEEK_SET);
-    fwrite(&node, sizeof(struct Node), 1, disk);
+    CRASH_POINT = point;
+    CRASH_COMMIT = commit > 0 ? commit : 1;
 }
 
-int NextFreeBlock(FILE *disk, int cur)
+/*
+ *  Ends the process at the crash point set for tests, if it is reached
+ *  at the commit it is set for; what was written stays in the image.
+ */
+void CheckCrashPoint(struct DiskHandler *disk, int point)
 {
-    struct Node node;
-    int i = cur+1;
+    if (CRASH_POINT != point || --CRASH_COMMIT > 0) return;
     
-    fseek(disk, GetNodeAddr(i), SEEK_SET);
-    for (; i < LIMIT_BLOCKS; ++i)
-    {
-        fread(&node, sizeof(struct Node), 1, disk);
-        if (!node.isUsed) break;
-    }
-    return i;
+    if (!disk->map) fflush(disk->file);
+    _exit(3);
 }
 
-int InsertFile(const char *diskName, const char *path, const char *newName)
-{   
-    FILE *file, *src;
-    struct DiskHandler dh;
-    struct Header header;
-    struct Descriptor desc;
-    struct Descriptor newDescriptor;
+/*
+ *  Instrumentation: every thread counts its I/O in its own ThreadStats,
+ *  so the requests a FUSE daemon serves at once, each thread on its own
+ *  handle of the disk, are measured apart. An operation takes a copy of
+ *  the counters of its thread when it begins and adds the difference to
+ *  the statistics of its kind when it ends. The copy workers count in
+ *  their own, which the caller adds to its ones when it joins them. The
+ *  counters of the process are the sum over the threads.
+ */
+#define MAX_OPERATION_KINDS 32
+
+#define IO_READ        0
+#define IO_WRITE       1
+#define IO_COPY        2
+#define IO_MAP_READ    3
+#define IO_MAP_WRITE   4
+#define IO_SYNC        5
+
+const char *IO_CALLS[] = { "read", "write", "copy", "map-read", "map-write", "sync" };
+
+struct ThreadStats
+{
+    struct IoStats io;
     
-    int remainingMemory;
-    int fileSize;
-    int freeIndex;
-    int curBlock;
-    int i;
-    int copiedBytes = 0;
+    const char *name;       /* of the operation running, NULL - none */
+    int depth;
+    double start;
+    struct IoStats begin;
     
-    char data[ORG_SIZE_BLOCK];
+    struct ThreadStats *next;
+};
+
+/* counters of the threads which have ended and of the ones which could not get their own (of the process without threads) */
+struct IoStats ENDED_IO;
+struct ThreadStats SHARED_STATS;
+struct ThreadStats *THREAD_STATS = NULL;
+
+struct OperationStats OPERATIONS[MAX_OPERATION_KINDS];
+struct OperationStats LAST_OPERATION;
+int OPERATION_KINDS = 0;
+
+FILE *IO_TRACE = NULL;
+
+#ifdef PARALLEL_COPY
+pthread_mutex_t IO_STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t IO_STATS_KEY;
+pthread_once_t IO_STATS_ONCE = PTHREAD_ONCE_INIT;
+#endif
+
+double GetTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double StartIo(void)
+{
+    return GetTime();
+}
+
+/*
+ *  Adds (sign 1) or subtracts (sign -1) the counters of from; all fields
+ *  of IoStats are long long.
+ */
+void AddIoStats(struct IoStats *to, const struct IoStats *from, int sign)
+{
+    long long *a = (long long *) to;
+    const long long *b = (const long long *) from;
+    int i;
     
-    dh = OpenDisk(diskName, "r+b");
-    if (dh.status) return dh.status;
+    for (i = 0; i < (int) (sizeof(struct IoStats) / sizeof(long long)); ++i) a[i] += sign * b[i];
+}
+
+#ifdef PARALLEL_COPY
+void DropThreadStats(void *arg)
+{
+    struct ThreadStats *stats = arg;
+    struct ThreadStats **link;
     
-    file = dh.file;
-    header = dh.header;
+    pthread_mutex_lock(&IO_STATS_LOCK);
+    AddIoStats(&ENDED_IO, &stats->io, 1);
+    for (link = &THREAD_STATS; *link != stats; link = &(*link)->next);
+    *link = stats->next;
+    pthread_mutex_unlock(&IO_STATS_LOCK);
     
-    remainingMemory = LIMIT_BLOCKS - header.usedBlocks;
-    remainingMemory *= SIZE_BLOCK;
+    free(stats);
+}
+
+void CreateStatsKey(void)
+{
+    pthread_key_create(&IO_STATS_KEY, DropThreadStats);
+}
+#endif
+
+/*
+ *  Counters of the calling thread, made on its first call and added to
+ *  the ended ones when the thread ends.
+ */
+struct ThreadStats *GetThreadStats(void)
+{
+#ifdef PARALLEL_COPY
+    struct ThreadStats *stats;
     
-    src = fopen(path, "rb");
+    pthread_once(&IO_STATS_ONCE, CreateStatsKey);
+    stats = pthread_getspecific(IO_STATS_KEY);
+    if (stats) return stats;
     
-    if (!src)
+    stats = calloc(1, sizeof(struct ThreadStats));
+    if (!stats || pthread_setspecific(IO_STATS_KEY, stats) != 0)
     {
-        printf("Could not open the file %s\n", path);
-        fclose(file);
-        return 2;
+        free(stats);
+        return &SHARED_STATS;
     }
     
-    fileSize = GetFileSize(src);
-    
-    if (fileSize > remainingMemory)
-    {
-        printf("No enough space for the file %s\n", path);
-        fclose(file);
-        fclose(src);
-        return 3;
-    }
+    pthread_mutex_lock(&IO_STATS_LOCK);
+    stats->next = THREAD_STATS;
+    THREAD_STATS = stats;
+    pthread_mutex_unlock(&IO_STATS_LOCK);
+    return stats;
+#else
+    return &SHARED_STATS;
+#endif
+}
+
+/*
+ *  Bucket of the histograms of latency: the first one past the time.
+ */
+int GetLatencyBucket(double seconds)
+{
+    int bucket = 0;
     
-    freeIndex = 0;
+    while (bucket < STATS_BUCKETS - 1 && seconds * 1e6 >= (double) (1L << bucket)) bucket++;
+    return bucket;
+}
 
-    fseek(file, GetDescriptorAddr(0), SEEK_SET);
+/*
+ *  Counts a call of the given kind which moved bytes at addr.
+ */
+void CountIo(int call, long long addr, long long bytes, double start)
+{
+    struct ThreadStats *stats = GetThreadStats();
+    struct IoStats *io = &stats->io;
+    double seconds = GetTime() - start;
     
-    for (i = 0; i < LIMIT_FILES; ++i)
+    switch (call)
     {
-        fread(&desc, sizeof(struct Descriptor), 1, file);
-        
-        if (desc.isUsed && strcmp(desc.name, newName) == 0)
-        {
-            printf("File %s already exists in the disc %s\n", newName, diskName);
-            fclose(file);
-            fclose(src);
-            return 4;
-        }
-        
-        if (!desc.isUsed) freeIndex = i;
+        case IO_READ:      io->reads++; io->readBytes += bytes; break;
+        case IO_WRITE:     io->writes++; io->writtenBytes += bytes; break;
+        case IO_COPY:      io->copies++; io->copiedBytes += bytes; break;
+        case IO_MAP_READ:  io->mappedReads++; io->mappedBytes += bytes; break;
+        case IO_MAP_WRITE: io->mappedWrites++; io->mappedBytes += bytes; break;
+        case IO_SYNC:      io->syncs++; break;
     }
+    io->callLatency[GetLatencyBucket(seconds)]++;
     
-    curBlock = NextFreeBlock(file, -1);
-    
-    newDescriptor.isUsed = 1;
-    newDescriptor.fileSize = fileSize;
-    newDescriptor.firstNode = curBlock;
-    time(&newDescriptor.timeAdded);
-    strcpy(newDescriptor.name, newName);
-    
-    SetDescriptor(file, freeIndex, newDescriptor);
-    
-    while (copiedBytes < fileSize)
+    if (IO_TRACE)
+        fprintf(IO_TRACE, "%s %s %lld %lld %.1f\n", stats->name ? stats->name : "-", IO_CALLS[call], addr, bytes, seconds * 1e6);
+}
+
+void SetIoTrace(FILE *trace)
+{
+    IO_TRACE = trace;
+}
+
+void ResetIoStats(void)
+{
+    struct ThreadStats *stats;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_lock(&IO_STATS_LOCK);
+#endif
+    memset(&ENDED_IO, 0, sizeof(struct IoStats));
+    memset(&SHARED_STATS.io, 0, sizeof(struct IoStats));
+    memset(&SHARED_STATS.begin, 0, sizeof(struct IoStats));
+    for (stats = THREAD_STATS; stats; stats = stats->next)
     {
-        int toRead;
-        int got;
-        int prev;
-        
-        struct Node node = GetNode(file, curBlock);
-        node.isUsed = 1;
-        node.nextNode = -1;
-        
-        toRead = fileSize - copiedBytes;
-        if (toRead > SIZE_BLOCK) toRead = SIZE_BLOCK;
-        got = fread(data, sizeof(char), toRead, src);
-        
-        fseek(file, GetBlockAddr(curBlock), SEEK_SET);
-        fwrite(data, sizeof(char), got, file);
-        copiedBytes += got;
-        
-        prev = curBlock;
-        curBlock = NextFreeBlock(file, curBlock);
-        if (copiedBytes < fileSize) node.nextNode = curBlock;
-        
-        SetNode(file, prev, node);
-        header.usedBlocks++;
+        memset(&stats->io, 0, sizeof(struct IoStats));
+        memset(&stats->begin, 0, sizeof(struct IoStats));
     }
     
-    header.usedMemory += fileSize;
-    header.usedFiles++;
-    SetHeader(file, header);
-    
-    fclose(file);
-    fclose(src);
-    return 0;
+    memset(OPERATIONS, 0, sizeof(OPERATIONS));
+    memset(&LAST_OPERATION, 0, sizeof(struct OperationStats));
+    OPERATION_KINDS = 0;
+#ifdef PARALLEL_COPY
+    pthread_mutex_unlock(&IO_STATS_LOCK);
+#endif
 }
 
-int DisplayMap(const char *diskName)
+void BeginOperation(const char *name)
 {
-    FILE *file;
-    struct Header header;
-    struct Node node;
+    struct ThreadStats *stats = GetThreadStats();
     
-    int isUsed;
-    int begPointer;
-    int begIndex;
-    int pointer;
-    int i;
-
-    struct DiskHandler dh = OpenDisk(diskName, "rb");
-    if (dh.status) return dh.status;
+    if (stats->depth++ > 0) return;
     
-    file = dh.file;
-    header = dh.header;
+    stats->name = name;
+    stats->begin = stats->io;
+    stats->start = GetTime();
+}
+
+/*
+ *  Ends the operation the thread begun last and adds it to the
+ *  statistics of its kind; returns result.
+ */
+int EndOperation(int result)
+{
+    struct ThreadStats *stats = GetThreadStats();
+    struct OperationStats *kind = NULL;
+    struct OperationStats last;
+    double seconds;
+    int bucket;
+    int i;
     
-    printf("\n     USED MEMORY IN THE DISK %s\n\n", diskName);
+    if (stats->depth == 0 || --stats->depth > 0) return result;
     
-    printf("%9d - %9lu     %9luB: FS header\n", 0, sizeof(struct Header)-1, sizeof(struct Header));
-    printf("%9lu - %9d     %9luB: %d File descriptors\n", sizeof(struct Header), GetNodeAddr(0)-1, GetNodeAddr(0) - sizeof(struct Header), LIMIT_FILES);
-    printf("%9d - %9d     %9dB: %d Nodes\n", GetNodeAddr(0), GetBlockAddr(0)-1, GetBlockAddr(0)-GetNodeAddr(0), LIMIT_BLOCKS);
-    printf("%9d - %9d     %9dB: %d Blocks\n", GetBlockAddr(0), SIZE_BLOCK * (LIMIT_BLOCKS-1)-1, SIZE_BLOCK * (LIMIT_BLOCKS-1) - GetBlockAddr(0), LIMIT_BLOCKS);
-    printf("\n\nBLOCKS MEMORY MAP:\n\n");
+    seconds = GetTime() - stats->start;
+    bucket = GetLatencyBucket(seconds);
     
-    fseek(file, GetNodeAddr(0), SEEK_SET);
+    memset(&last, 0, sizeof(struct OperationStats));
+    last.name = stats->name;
+    last.count = 1;
+    last.errors = result != 0;
+    last.seconds = seconds;
+    last.maxSeconds = seconds;
+    last.latency[bucket] = 1;
+    last.io = stats->io;
+    AddIoStats(&last.io, &stats->begin, -1);
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_lock(&IO_STATS_LOCK);
+#endif
+    LAST_OPERATION = last;
     
-    fread(&node, sizeof(struct Node), 1, file);
-    isUsed = node.isUsed;
-    begPointer = GetBlockAddr(0);
-    begIndex = 0;
-    pointer = GetBlockAddr(0);
+    for (i = 0; i < OPERATION_KINDS && !kind; ++i)
+        if (strcmp(OPERATIONS[i].name, last.name) == 0) kind = &OPERATIONS[i];
     
-    for (i = 1; i < LIMIT_BLOCKS; ++i)
+    /* kinds past the limit only show as the last operation */
+    if (!kind && OPERATION_KINDS < MAX_OPERATION_KINDS)
     {
-        fread(&node, sizeof(struct Node), 1, file);
-        pointer += SIZE_BLOCK;
-        
-        if (isUsed != node.isUsed)
-        {
-            if (isUsed) printf("%7d - %7d     %9d - %9d     %9dB: USED\n", begIndex, i-1, begPointer, pointer-1, pointer-begPointer);
-            else        printf("%7d - %7d     %9d - %9d     %9dB: FREE\n", begIndex, i-1, begPointer, pointer-1, pointer-begPointer);
-            
-            begPointer = pointer;
-            begIndex = i;
-            isUsed = node.isUsed;
-        }
+        kind = &OPERATIONS[OPERATION_KINDS++];
+        kind->name = last.name;
     }
     
-    if (node.isUsed) printf("%7d - %7d     %9d - %9d     %9dB: USED\n", begIndex, LIMIT_BLOCKS-1, begPointer, pointer-1, pointer-begPointer);
-    else             printf("%7d - %7d     %9d - %9d     %9dB: FREE\n", begIndex, LIMIT_BLOCKS-1, begPointer, pointer-1, pointer-begPointer);
+    if (kind)
+    {
+        kind->count++;
+        kind->errors += result != 0;
+        kind->seconds += seconds;
+        if (seconds > kind->maxSeconds) kind->maxSeconds = seconds;
+        kind->latency[bucket]++;
+        AddIoStats(&kind->io, &last.io, 1);
+    }
+#ifdef PARALLEL_COPY
+    pthread_mutex_unlock(&IO_STATS_LOCK);
+#endif
+
+    if (IO_TRACE) fprintf(IO_TRACE, "%s total %d - %.1f\n", last.name, result, seconds * 1e6);
     
-    fclose(file);
-    return 0;
+    stats->name = NULL;
+    return result;
 }
 
-int DisplayFiles(const char *diskName)
+/*
+ *  Gives the counters of the process and the statistics of the last
+ *  operation (its name is NULL if none has ended yet). The counters of
+ *  the threads still running are read as they are, so they are exact
+ *  when no operation runs.
+ */
+int GetIoStats(struct IoStats *total, struct OperationStats *last)
+{
+    struct ThreadStats *stats;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_lock(&IO_STATS_LOCK);
+#endif
+    if (total)
+    {
+        *total = ENDED_IO;
+        AddIoStats(total, &SHARED_STATS.io, 1);
+        for (stats = THREAD_STATS; stats; stats = stats->next) AddIoStats(total, &stats->io, 1);
+    }
+    if (last) *last = LAST_OPERATION;
+#ifdef PARALLEL_COPY
+    pthread_mutex_unlock(&IO_STATS_LOCK);
+#endif
+    return 0;
+}
+
+void DisplayLatency(const char *title, const long long *latency)
 {
-    FILE *file;
-    struct Header header;
-    struct Descriptor desc;
-    
-    int counter = 0;
     int i;
+    
+    printf("    %s:", title);
+    for (i = 0; i < STATS_BUCKETS; ++i)
+    {
+        if (!latency[i]) continue;
+        if (i < STATS_BUCKETS - 1) printf(" <%ldus: %lld", 1L << i, latency[i]);
+        else                       printf(" >=%ldus: %lld", 1L << (i - 1), latency[i]);
+    }
+    printf("\n");
+}
+
+void DisplayIoCounters(const struct IoStats *io)
+{
+    printf("    %lld reads (%lldB), %lld writes (%lldB), %lld seeks, %lld syncs\n",
+           io->reads, io->readBytes, io->writes, io->writtenBytes, io->seeks, io->syncs);
+    printf("    %lld kernel copies (%lldB), %lld mapped reads and %lld mapped writes (%lldB)\n",
+           io->copies, io->copiedBytes, io->mappedReads, io->mappedWrites, io->mappedBytes);
+    printf("    %lld metadata records read, %lld written\n", io->recordReads, io->recordWrites);
+    DisplayLatency("latency of the calls", io->callLatency);
+}
 
-    struct DiskHandler dh = OpenDisk(diskName, "rb");
-    if (dh.status) return dh.status;
+/*
+ *  Prints the last operation; after more than one operation also the
+ *  counters of the process and of every kind of operation.
+ */
+void DisplayIoStats(void)
+{
+    struct IoStats total;
+    int i;
     
-    file = dh.file;
-    header = dh.header;
+    GetIoStats(&total, NULL);
+    
+    if (LAST_OPERATION.name)
+    {
+        printf("Last operation: %s in %.1fus%s\n", LAST_OPERATION.name, LAST_OPERATION.seconds * 1e6, LAST_OPERATION.errors ? ", failed" : "");
+        DisplayIoCounters(&LAST_OPERATION.io);
+    }
     
-    fseek(file, GetDescriptorAddr(0), SEEK_SET);
+    if (OPERATION_KINDS == 1 && OPERATIONS[0].count == 1) return;
     
-    printf("\n\tLIST OF FILES ON THE DISK %s\n\n", diskName);
+    printf("I/O of the process:\n");
+    DisplayIoCounters(&total);
     
-    for (i = 0; i < LIMIT_FILES; ++i)
+    for (i = 0; i < OPERATION_KINDS; ++i)
     {
-        fread(&desc, sizeof(struct Descriptor), 1, file);
-        if (desc.isUsed == 1)
-        {
-            char strDate[30];
-            struct tm * timeinfo = localtime (&desc.timeAdded);
-            strcpy(strDate, asctime(timeinfo));
-            strDate[strlen(strDate)-1] = '\0';
-            
-            printf(" %3d %9dB  %30s - %s\n", ++counter, desc.fileSize, strDate, desc.name);
-        }
+        struct OperationStats *kind = &OPERATIONS[i];
+        
+        printf("Operation %s: %lld calls, %lld failed, %.1fus on average, %.1fus at most\n", kind->name, kind->count, kind->errors,
+               kind->seconds * 1e6 / kind->count, kind->maxSeconds * 1e6);
+        DisplayLatency("latency", kind->latency);
+        DisplayIoCounters(&kind->io);
     }
+}
+
+void ReadDisk(struct DiskHandler *disk, long long addr, void *buffer, int size)
+{
+    double start = StartIo();
     
-    printf("%d files in total\n", header.usedFiles);
+    if (disk->map)
+    {
+        memcpy(buffer, disk->map + addr, size);
+        CountIo(IO_MAP_READ, addr, size, start);
+        return;
+    }
     
-    fclose(file);
-    return 0;
+    fseeko(disk->file, addr, SEEK_SET);
+    fread(buffer, sizeof(char), size, disk->file);
+    GetThreadStats()->io.seeks++;
+    CountIo(IO_READ, addr, size, start);
 }
 
-int ExportFile(const char *diskName, const char *fileToExport, const char *newName)
+void WriteDisk(struct DiskHandler *disk, long long addr, const void *buffer, int size)
 {
-    FILE *file, *dst;
-    struct Header header;
-    struct Descriptor desc;
-    struct Node node;
+    double start = StartIo();
     
-    int fileIndex = -1;
-    int i;
-    int curBlock;
-    int copiedBytes = 0;
+    if (disk->map)
+    {
+        memcpy(disk->map + addr, buffer, size);
+        CountIo(IO_MAP_WRITE, addr, size, start);
+        return;
+    }
+    
+    fseeko(disk->file, addr, SEEK_SET);
+    fwrite(buffer, sizeof(char), size, disk->file);
+    GetThreadStats()->io.seeks++;
+    CountIo(IO_WRITE, addr, size, start);
+}
+
+/*
+ *  Copies size bytes between two files inside the kernel, without
+ *  passing the data through user space. copy_file_range is tried first,
+ *  then sendfile. Returns the number of bytes copied; the rest has to be
+ *  copied by hand. Once the kernel refuses both calls they are not tried
+ *  again.
+ */
+long long KernelCopy(FILE *in, long long inAddr, FILE *out, long long outAddr, long long size)
+{
+    long long done = 0;
+#ifdef __linux__
+    off_t inPos = inAddr;
+    off_t outPos = outAddr;
+    ssize_t got = 0;
+    double start = StartIo();
     
-    char data[ORG_SIZE_BLOCK];
+    if (!KERNEL_COPY) return 0;
     
-    struct DiskHandler dh = OpenDisk(diskName, "rb");
-    if (dh.status) return dh.status;
+    fflush(in);
+    fflush(out);
     
-    file = dh.file;
-    header = dh.header;
+    while (done < size)
+    {
+        got = copy_file_range(fileno(in), &inPos, fileno(out), &outPos, size - done, 0);
+        if (got <= 0) break;
+        done += got;
+    }
     
-    for (i = 0; i < LIMIT_FILES; ++i)
+    if (done < size && lseek(fileno(out), outAddr + done, SEEK_SET) >= 0)
     {
-        fread(&desc, sizeof(struct Descriptor), 1, file);
-        if (desc.isUsed && strcmp(desc.name, fileToExport) == 0)
+        inPos = inAddr + done;
+        while (done < size)
         {
-            fileIndex = i;
-            break;
+            got = sendfile(fileno(out), fileno(in), &inPos, size - done);
+            if (got <= 0) break;
+            done += got;
         }
     }
     
-    if (fileIndex < 0)
+    if (done == 0 && got < 0 && errno != EINTR && errno != EIO && errno != ENOSPC) KERNEL_COPY = 0;
+    
+    /* the streams still think they are where they were before */
+    fseeko(in, inAddr + done, SEEK_SET);
+    fseeko(out, outAddr + done, SEEK_SET);
+    GetThreadStats()->io.seeks += 2;
+    if (done > 0) CountIo(IO_COPY, outAddr, done, start);
+#endif
+    return done;
+}
+
+/*
+ *  Copies size bytes between the disk at addr and an external file at
+ *  its current position. A mapped disk is read or written in place;
+ *  otherwise the kernel copies the data if it can, and the rest goes
+ *  through buffer, which must hold COPY_BUFFER bytes.
+ */
+void CopyToDisk(struct DiskHandler *disk, long long addr, FILE *src, long long size, char *buffer)
+{
+    long long done;
+    double start = StartIo();
+    
+    if (disk->map)
     {
-        printf("Could not find file %s\n", fileToExport);
-        fclose(file);
-        return 3;
+        fread(disk->map + addr, sizeof(char), size, src);
+        CountIo(IO_READ, addr, size, start);
+        return;
     }
     
-    dst = fopen(newName, "wb");
-    if (!dst)
+    done = KernelCopy(src, ftello(src), disk->file, addr, size);
+    addr += done;
+    size -= done;
+    
+    fseeko(disk->file, addr, SEEK_SET);
+    GetThreadStats()->io.seeks++;
+    while (size > 0)
     {
-        printf("Cannot create destination file %s\n", newName);
-        fclose(file);
-        return 4;
+        int chunk = size < COPY_BUFFER ? size : COPY_BUFFER;
+        
+        start = StartIo();
+        fread(buffer, sizeof(char), chunk, src);
+        CountIo(IO_READ, -1, chunk, start);
+        
+        start = StartIo();
+        fwrite(buffer, sizeof(char), chunk, disk->file);
+        CountIo(IO_WRITE, addr, chunk, start);
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+void CopyFromDisk(struct DiskHandler *disk, long long addr, FILE *dst, long long size, char *buffer)
+{
+    long long done;
+    double start = StartIo();
+    
+    if (disk->map)
+    {
+        fwrite(disk->map + addr, sizeof(char), size, dst);
+        CountIo(IO_WRITE, addr, size, start);
+        return;
     }
     
-    curBlock = desc.firstNode;
-    node = GetNode(file, curBlock);
-    copiedBytes = 0;
+    done = KernelCopy(disk->file, addr, dst, ftello(dst), size);
+    addr += done;
+    size -= done;
     
-    while (copiedBytes < desc.fileSize)
+    fseeko(disk->file, addr, SEEK_SET);
+    GetThreadStats()->io.seeks++;
+    while (size > 0)
     {
-        int got;
-        int toRead = desc.fileSize - copiedBytes;
-        if (toRead > SIZE_BLOCK) toRead = SIZE_BLOCK;
+        int chunk = size < COPY_BUFFER ? size : COPY_BUFFER;
+        
+        start = StartIo();
+        fread(buffer, sizeof(char), chunk, disk->file);
+        CountIo(IO_READ, addr, chunk, start);
         
-        fseek(file, GetBlockAddr(curBlock), SEEK_SET);
-        got = fread(data, sizeof(char), toRead, file);
-        fwrite(data, sizeof(char), got, dst);
-        copiedBytes += got;
+        start = StartIo();
+        fwrite(buffer, sizeof(char), chunk, dst);
+        CountIo(IO_WRITE, -1, chunk, start);
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+/*
+ *  Copies size bytes inside the disk, between regions which do not
+ *  overlap. buffer must hold COPY_BUFFER bytes.
+ */
+void MoveData(struct DiskHandler *disk, long long from, long long to, long long size, char *buffer)
+{
+    long long done;
+    double start = StartIo();
+    
+    if (disk->map)
+    {
+        memcpy(disk->map + to, disk->map + from, size);
+        CountIo(IO_MAP_WRITE, to, size, start);
+        return;
+    }
+    
+    done = KernelCopy(disk->file, from, disk->file, to, size);
+    
+    while (done < size)
+    {
+        int chunk = size - done < COPY_BUFFER ? size - done : COPY_BUFFER;
         
-        curBlock = node.nextNode;
-        node = GetNode(file, curBlock);
+        ReadDisk(disk, from + done, buffer, chunk);
+        WriteDisk(disk, to + done, buffer, chunk);
+        done += chunk;
     }
+}
+
+char *AllocCopyBuffer(struct DiskHandler *disk)
+{
+    static char none;
+    
+    if (disk->map) return &none;
+    return malloc(COPY_BUFFER);
+}
+
+void FreeCopyBuffer(struct DiskHandler *disk, char *buffer)
+{
+    if (!disk->map) free(buffer);
+}
+
+/*
+ *  Parallel copy: the data of a file is split into chunks of at most
+ *  COPY_BUFFER bytes, each one with its own offset in the
+ *  source and in the destination, and a pool of workers copies them with
+ *  pread and pwrite, so the threads never share a file position. When a
+ *  side of the copy is a mapped disk, the chunk is read or written in
+ *  the mapping directly.
+ */
+struct CopyChunk
+{
+    long long from;
+    long long to;
+    int size;
+};
+
+struct CopyJob
+{
+    int in;
+    int out;
+    char *inMap;
+    char *outMap;
+    int bufferSize;
     
-    fclose(dst);
-    fclose(file);
+    struct CopyChunk *chunks;
+    int count;
+    int next;
+    int failed;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_t lock;
+#endif
+};
+
+int ReadAt(int fd, char *buffer, int size, long long addr)
+{
+    while (size > 0)
+    {
+        double start = StartIo();
+        ssize_t got = pread(fd, buffer, size, addr);
+        
+        CountIo(IO_READ, addr, got > 0 ? got : 0, start);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        buffer += got;
+        addr += got;
+        size -= got;
+    }
     return 0;
 }
 
-int DeleteFile(const char *diskName, const char *fileName)
+int WriteAt(int fd, const char *buffer, int size, long long addr)
 {
-    FILE *file;
-    struct Header header;
-    struct Descriptor desc;
-    struct Node curNode;
+    while (size > 0)
+    {
+        double start = StartIo();
+        ssize_t put = pwrite(fd, buffer, size, addr);
+        
+        CountIo(IO_WRITE, addr, put > 0 ? put : 0, start);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return 1;
+        buffer += put;
+        addr += put;
+        size -= put;
+    }
+    return 0;
+}
+
+int CopyChunk(struct CopyJob *job, struct CopyChunk *chunk, char *buffer)
+{
+    if (job->inMap) return WriteAt(job->out, job->inMap + chunk->from, chunk->size, chunk->to);
+    if (job->outMap) return ReadAt(job->in, job->outMap + chunk->to, chunk->size, chunk->from);
     
-    int nodeIndex = -1;
+    if (ReadAt(job->in, buffer, chunk->size, chunk->from)) return 1;
+    return WriteAt(job->out, buffer, chunk->size, chunk->to);
+}
+
+#ifdef PARALLEL_COPY
+void *CopyWorker(void *arg)
+{
+    struct CopyJob *job = arg;
+    char *buffer = NULL;
+    int failed = 0;
     int i;
+    
+    if (!job->inMap && !job->outMap)
+    {
+        buffer = malloc(job->bufferSize);
+        if (!buffer) failed = 1;
+    }
+    
+    while (!failed)
+    {
+        pthread_mutex_lock(&job->lock);
+        i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        
+        if (i >= job->count) break;
+        failed = CopyChunk(job, &job->chunks[i], buffer);
+    }
+    
+    if (failed)
+    {
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        job->next = job->count;
+        pthread_mutex_unlock(&job->lock);
+    }
+    
+    free(buffer);
+    return NULL;
+}
+#endif
+
+#ifdef PARALLEL_COPY
+/*
+ *  A started worker: its I/O is handed to the thread which started it,
+ *  so it counts in the operation of that thread.
+ */
+struct WorkerStart
+{
+    pthread_t thread;
+    void *(*worker)(void *);
+    void *job;
+    const char *name;
+    struct IoStats io;
+};
 
-    struct DiskHandler dh = OpenDisk(diskName, "r+b");
-    if (dh.status) return dh.status;
+void *StartWorker(void *arg)
+{
+    struct WorkerStart *start = arg;
+    struct ThreadStats *stats = GetThreadStats();
     
-    file = dh.file;
-    header = dh.header;
+    stats->name = start->name;
+    start->worker(start->job);
     
-    for (i = 0; i < LIMIT_FILES; ++i)
+    memset(&start->io, 0, sizeof(struct IoStats));
+    if (stats != &SHARED_STATS)
     {
-        desc = GetDescriptor(file, i);
-        if (desc.isUsed && strcmp(desc.name, fileName) == 0)
-        {
-            desc.isUsed = 0;
-            SetDescriptor(file, i, desc);
-            nodeIndex = desc.firstNode;
-            break;
-        }
+        start->io = stats->io;
+        memset(&stats->io, 0, sizeof(struct IoStats));
     }
+    return NULL;
+}
+
+/*
+ *  Runs worker on the job in the given number of threads. The calling
+ *  thread is one of them, so the job still completes if no thread can
+ *  be started.
+ */
+void RunWorkers(void *(*worker)(void *), void *job, int workers)
+{
+    struct ThreadStats *stats = GetThreadStats();
+    struct WorkerStart *starts;
+    int started = 0;
     
-    if (nodeIndex < 0)
+    starts = malloc(sizeof(struct WorkerStart) * (workers > 1 ? workers - 1 : 1));
+    while (starts && started < workers - 1)
     {
-        printf("File %s does not exist in the disk %s\n", fileName, diskName);
-        fclose(file);
-        return 3;
+        starts[started].worker = worker;
+        starts[started].job = job;
+        starts[started].name = stats->name;
+        if (pthread_create(&starts[started].thread, NULL, StartWorker, &starts[started]) != 0) break;
+        started++;
     }
     
-    curNode = GetNode(file, nodeIndex);
+    worker(job);
     
-    do
+    while (started > 0)
     {
-        curNode.isUsed = 0;
-        SetNode(file, nodeIndex, curNode);
-        
-        nodeIndex = curNode.nextNode;
-        curNode = GetNode(file, nodeIndex);
-        
-        header.usedBlocks--;
-    } while (nodeIndex >= 0);
+        pthread_join(starts[--started].thread, NULL);
+        AddIoStats(&stats->io, &starts[started].io, 1);
+    }
+    free(starts);
+}
+#endif
+
+/*
+ *  Runs the job on COPY_THREADS workers. Returns 0 if all chunks were
+ *  copied.
+ */
+int RunCopyJob(struct CopyJob *job)
+{
+#ifdef PARALLEL_COPY
+    job->next = 0;
+    job->failed = 0;
+    pthread_mutex_init(&job->lock, NULL);
     
-    header.usedFiles--;
-    header.usedMemory -= desc.fileSize;
-    SetHeader(file, header);
+    RunWorkers(CopyWorker, job, COPY_THREADS < job->count ? COPY_THREADS : job->count);
     
-    fclose(file);
-    return 0;
+    pthread_mutex_destroy(&job->lock);
+    return job->failed;
+#else
+    char *buffer = NULL;
+    int i;
+    
+    if (!job->inMap && !job->outMap)
+    {
+        buffer = malloc(job->bufferSize);
+        if (!buffer) return 1;
+    }
+    
+    for (i = 0; i < job->count; ++i)
+        if (CopyChunk(job, &job->chunks[i], buffer)) break;
+    
+    free(buffer);
+    return i < job->count;
+#endif
 }
 
-int DisplayInfo(const char *diskName)
+/*
+ *  Size of a descriptor record on the disk: the fixed part followed by
+ *  nameSize bytes of the name.
+ */
+int GetDescriptorSize(int nameSize)
+{
+    return (int) offsetof(struct Descriptor, name) + nameSize;
+}
+
+/*
+ *  Creates the disk as a sparse file: only the header and the last word
+ *  of the map of blocks are written, the rest of the image is left to
+ *  ftruncate, so creating a disk takes the same time whatever its size.
+ *  Zero bytes mean "unused" in every table - descriptors above the
+ *  descriptorWatermark have never been used, index slots are empty, blocks
+ *  are free and the journal holds no transaction. With preallocation on,
+ *  the space of the image is also reserved up front.
+ *  
+ *  The size of blocks, the number of files and the length of names are
+ *  chosen here and kept in the header, so every disk can be tuned for
+ *  its workload: large blocks for big media files, many small
+ *  descriptors for millions of small objects.
+ */
+int CreateCustomDisk(const char *diskName, long long diskSize, int blockSize, int filesLimit, int nameSize)
 {
     FILE *file;
     struct Header header;
     
-    int totalMemory;
-    int notAvailable;
-    double frag;
+    unsigned int word;
+    int words;
+    long long bitmapAddr;
+    long long metadataSize;
+    long long totalSize;
+    double start;
     
-    struct DiskHandler dh = OpenDisk(diskName, "rb");
-    if (dh.status) return dh.status;
+    header.version = VERSION;
+    header.usedFiles = 0;
+    header.usedBlocks = 0;
+    header.usedMemory = 0;
+    header.blockSize = blockSize;
+    header.blocksLimit = 0;
+    header.filesLimit = filesLimit;
+    header.nameSize = nameSize;
+    header.freeDescriptor = -1;
+    header.descriptorWatermark = 0;
+    header.generation = 0;
+    header.journalTail = 0;
+    header.journalSequence = 1;
+    header.journalStart = 0;
+    header.startSequence = 1;
+    header.openPack = -1;
+    header.freePack = -1;
+    header.packWatermark = 0;
+    header.rootFirst = -1;
+    header.directories = 0;
+    header.reservedFiles = 0;
+    header.baseFiles = filesLimit;
+    header.segments = 0;
+    header.lastSegment = -1;
+    header.segmentBlocks = 0;
+    header.journalBlock = -1;
+    header.journalBlocks = 0;
     
-    file = dh.file;
-    header = dh.header;
+    if (blockSize < MIN_SIZE_BLOCK || blockSize > MAX_SIZE_BLOCK)
+    {
+        printf("The size of blocks must be between %dB and %dB\n", MIN_SIZE_BLOCK, MAX_SIZE_BLOCK);
+        return 1;
+    }
     
-    totalMemory = header.blocksLimit * header.blockSize;
-    notAvailable = header.usedBlocks * header.blockSize;
-    if (notAvailable > 0) frag = 100.0 - (double)header.usedMemory / (double)notAvailable * 100.0;
-    else frag = 0;
+    if (filesLimit < 1 || filesLimit > MAX_LIMIT_FILES)
+    {
+        printf("The number of files must be between 1 and %d\n", MAX_LIMIT_FILES);
+        return 1;
+    }
     
-    printf("\n\n      INFORMATION ABOUT DISK %s\n\n", diskName);
-    printf(" Total memory:          %9dB\n", totalMemory);
-    printf(" Available memory:      %9dB\n", totalMemory - notAvailable);
-    printf(" Used memory:           %9dB\n", header.usedMemory);
-    printf(" Not available:         %9dB\n", notAvailable);
-    printf(" Int fragmentation:     %.3f%%\n", frag);
+    if (nameSize < MIN_SIZE_FILENAME || nameSize > MAX_SIZE_FILENAME)
+    {
+        printf("The length of names must be between %d and %d characters\n", MIN_SIZE_FILENAME - 1, MAX_SIZE_FILENAME - 1);
+        return 1;
+    }
     
-    printf("\n");
-    printf(" Files:                 %d\n", header.usedFiles);
-    printf(" Max number of files:   %d\n", header.filesLimit);
+    header.hashSize = 1;
+    while (header.hashSize < header.filesLimit * 2) header.hashSize *= 2;
     
-    printf("\n");
-    printf(" Version:               %d\n", header.version);
-    printf(" Block size:            %dB\n", header.blockSize);
-    printf(" Blocks:                %d\n", header.blocksLimit);
-    printf(" Used blocks:           %d\n", header.usedBlocks);
+    if (diskSize <= 0 || (diskSize + header.blockSize - 1) / header.blockSize > INT_MAX - BITS_WORD)
+    {
+        printf("Cannot create a disk of %lldB\n", diskSize);
+        return 1;
+    }
     
-    printf("\n");
+    header.blocksLimit = diskSize / header.blockSize;
+    if (diskSize % header.blockSize != 0) header.blocksLimit++;
+    header.mapBlocks = header.blocksLimit;
+    header.baseMapBlocks = header.mapBlocks;
+    header.sharedBlocks = 0;
+    header.compressedMemory = 0;
+    header.compressedBlocks = 0;
+    
+    header.dedupSize = 1;
+    while (header.dedupSize < header.blocksLimit / DEDUP_RATIO) header.dedupSize *= 2;
+    
+    words = (header.blocksLimit + BITS_WORD - 1) / BITS_WORD;
+    bitmapAddr = sizeof(struct Header) + GetDescriptorSize(nameSize) * (long long) header.filesLimit;
+    bitmapAddr += sizeof(struct HashSlot) * (long long) header.hashSize;
+    bitmapAddr += sizeof(struct Pack) * ((long long) header.filesLimit + 1);
+    bitmapAddr += sizeof(unsigned short) * (long long) header.mapBlocks;
+    bitmapAddr += sizeof(struct DedupSlot) * (long long) header.dedupSize;
+    metadataSize = bitmapAddr + sizeof(unsigned int) * (long long) words;
+    metadataSize += sizeof(int) * (long long) ((words + MAP_PAGE_WORDS - 1) / MAP_PAGE_WORDS);
+    
+    /* twice the metadata, so that even a transaction changing all of it fits */
+    header.journalSize = (metadataSize / header.blockSize + 2) * 2 * header.blockSize;
+    totalSize = metadataSize + header.journalSize + header.blockSize * (long long) header.blocksLimit;
+    
+    file = fopen(diskName, "wb");
+    
+    if (!file)
+    {
+        printf("Cannot create a file for the disk\n");
+        return 1;
+    }
+    
+    if (ftruncate(fileno(file), totalSize) != 0 || (PREALLOCATE && posix_fallocate(fileno(file), 0, totalSize) != 0))
+    {
+        printf("Cannot reserve %lldB for the disk %s\n", totalSize, diskName);
+        fclose(file);
+        remove(diskName);
+        return 1;
+    }
+    
+    start = StartIo();
+    fwrite(&header, sizeof(struct Header), 1, file);
+    CountIo(IO_WRITE, 0, sizeof(struct Header), start);
+    
+    /* bits past the last block are marked as used */
+    if (header.blocksLimit % BITS_WORD)
+    {
+        word = ~0u << (header.blocksLimit % BITS_WORD);
+        start = StartIo();
+        fseeko(file, bitmapAddr + sizeof(unsigned int) * (long long) (words - 1), SEEK_SET);
+        fwrite(&word, sizeof(unsigned int), 1, file);
+        GetThreadStats()->io.seeks++;
+        CountIo(IO_WRITE, bitmapAddr + sizeof(unsigned int) * (long long) (words - 1), sizeof(unsigned int), start);
+    }
     
-    fclose(file);
+    if (fclose(file))
+    {
+        printf("Cannot write the disk %s\n", diskName);
+        return 1;
+    }
     return 0;
 }
+
+int CreateDisk(const char *diskName, long long diskSize)
+{
+    return CreateCustomDisk(diskName, diskSize, ORG_SIZE_BLOCK, ORG_LIMIT_FILES, ORG_SIZE_FILENAME);
+}
+
+void RemoveDisk(const char *diskName)
+{
+    remove(diskName);
+}
+
+long long GetFileSize(FILE *file)
+{
+    long long fileSize;
+    fseeko(file, 0, SEEK_END);
+    fileSize = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+    return fileSize;
+}
+
+int GetMapWords(int blocks)
+{
+    return (blocks + BITS_WORD - 1) / BITS_WORD;
+}
+
+int GetMapPages(int blocks)
+{
+    return (GetMapWords(blocks) + MAP_PAGE_WORDS - 1) / MAP_PAGE_WORDS;
+}
+
+/*
+ *  Addresses of the regions laid out when the disk was created; records
+ *  added by resizing are in the segments.
+ */
+long long GetDescriptorAddr(int index)
+{
+    return sizeof(struct Header) + GetDescriptorSize(SIZE_FILENAME) * (long long) index;
+}
+
+long long GetHashSlotAddr(int index)
+{
+    return GetDescriptorAddr(BASE_FILES) + sizeof(struct HashSlot) * (long long) index;
+}
+
+int GetPacksLimit(void)
+{
+    return LIMIT_FILES + 1;
+}
+
+long long GetPackAddr(int index)
+{
+    return GetHashSlotAddr(HASH_SIZE) + sizeof(struct Pack) * (long long) index;
+}
+
+long long GetRefsAddr(int block)
+{
+    return GetPackAddr(BASE_FILES + 1) + sizeof(unsigned short) * (long long) block;
+}
+
+long long GetDedupAddr(int index)
+{
+    return GetRefsAddr(BASE_MAP_BLOCKS) + sizeof(struct DedupSlot) * (long long) index;
+}
+
+long long GetBitmapAddr(int word)
+{
+    return GetDedupAddr(DEDUP_SIZE) + sizeof(unsigned int) * (long long) word;
+}
+
+long long GetSummaryAddr(int page)
+{
+    return GetBitmapAddr(GetMapWords(BASE_MAP_BLOCKS)) + sizeof(int) * (long long) page;
+}
+
+long long GetMetadataEnd(void)
+{
+    return GetSummaryAddr(GetMapPages(BASE_MAP_BLOCKS));
+}
+
+long long GetBlockAddr(int index)
+{
+    return GetMetadataEnd() + JOURNAL_REGION + SIZE_BLOCK * (long long) index;
+}
+
+long long GetJournalAddr(int offset)
+{
+    if (JOURNAL_BLOCK >= 0) return GetBlockAddr(JOURNAL_BLOCK) + offset;
+    return GetMetadataEnd() + offset;
+}
+
+void InitTable(struct Table *table, long long addr, int recordSize, int count, int limit)
+{
+    table->addr = addr;
+    table->recordSize = recordSize;
+    table->count = count;
+    table->perPage = TABLE_PAGE / recordSize > 0 ? TABLE_PAGE / recordSize : 1;
+    table->parts = NULL;
+    table->partCount = 0;
+    table->pages = NULL;
+    table->dirty = NULL;
+    table->referenced = NULL;
+    table->ring = NULL;
+    table->cached = 0;
+    table->ringSize = 0;
+    table->hand = 0;
+    table->limit = limit;
+    table->hits = 0;
+    table->misses = 0;
+}
+
+int GetTablePages(struct Table *table)
+{
+    return (table->count + table->perPage - 1) / table->perPage;
+}
+
+/*
+ *  Address of the record and, in run, the number of records stored
+ *  contiguously from it.
+ */
+long long GetRecordAddr(struct Table *table, int index, int *run)
+{
+    long long addr = table->addr + (long long) index * table->recordSize;
+    int end = table->count;
+    int i;
+    
+    for (i = table->partCount - 1; i >= 0; --i)
+    {
+        if (index >= table->parts[i].first)
+        {
+            addr = table->parts[i].addr + (long long) (index - table->parts[i].first) * table->recordSize;
+            break;
+        }
+        end = table->parts[i].first;
+    }
+    
+    *run = end - index;
+    return addr;
+}
+
+void AccessRecords(struct DiskHandler *disk, struct Table *table, int first, int count, char *buffer, int toDisk)
+{
+    long long addr;
+    int run;
+    
+    while (count > 0)
+    {
+        addr = GetRecordAddr(table, first, &run);
+        if (run > count) run = count;
+        
+        if (toDisk) WriteDisk(disk, addr, buffer, run * table->recordSize);
+        else        ReadDisk(disk, addr, buffer, run * table->recordSize);
+        
+        first += run;
+        count -= run;
+        buffer += run * table->recordSize;
+    }
+}
+
+/*
+ *  Moves the clock hand over the ring of cached pages until it finds a
+ *  clean page that was not used since the hand last passed it, frees
+ *  that page and returns its place in the ring. Returns -1 if all the
+ *  cached pages are dirty.
+ */
+int EvictTablePage(struct Table *table)
+{
+    int steps;
+    
+    for (steps = 0; steps < 2 * table->cached; ++steps)
+    {
+        int slot = table->hand;
+        int page = table->ring[slot];
+        
+        table->hand = (table->hand + 1) % table->cached;
+        
+        if (table->dirty[page]) continue;
+        if (table->referenced[page])
+        {
+            table->referenced[page] = 0;
+            continue;
+        }
+        
+        free(table->pages[page]);
+        table->pages[page] = NULL;
+        return slot;
+    }
+    
+    return -1;
+}
+
+/*
+ *  Places a newly cached page in the ring, in the place of an evicted
+ *  one if the table is at its limit. Returns the place in the ring or -1
+ *  if there is no memory.
+ */
+int AddTablePage(struct Table *table, int page)
+{
+    int slot = -1;
+    
+    if (table->limit && table->cached >= table->limit) slot = EvictTablePage(table);
+    
+    if (slot < 0)
+    {
+        if (table->cached == table->ringSize)
+        {
+            int size = table->ringSize ? table->ringSize * 2 : 16;
+            int *ring = realloc(table->ring, size * sizeof(int));
+            
+            if (!ring) return -1;
+            
+            table->ring = ring;
+            table->ringSize = size;
+        }
+        
+        slot = table->cached++;
+    }
+    
+    table->ring[slot] = page;
+    table->referenced[page] = 0;
+    return slot;
+}
+
+/*
+ *  Returns the cached page of the table, reading it from the disk on
+ *  first use, or NULL if there is no memory for it.
+ */
+char *GetTablePage(struct DiskHandler *disk, struct Table *table, int page)
+{
+    int first = page * table->perPage;
+    int records = table->count - first < table->perPage ? table->count - first : table->perPage;
+    int slot;
+    
+    if (!table->pages)
+    {
+        table->pages = calloc(GetTablePages(table), sizeof(char *));
+        table->dirty = calloc(GetTablePages(table), sizeof(char));
+        table->referenced = calloc(GetTablePages(table), sizeof(char));
+        if (!table->pages || !table->dirty || !table->referenced)
+        {
+            free(table->pages);
+            free(table->dirty);
+            free(table->referenced);
+            table->pages = NULL;
+            table->dirty = NULL;
+            table->referenced = NULL;
+            return NULL;
+        }
+    }
+    
+    if (table->pages[page])
+    {
+        table->referenced[page] = 1;
+        table->hits++;
+        return table->pages[page];
+    }
+    
+    table->misses++;
+    slot = AddTablePage(table, page);
+    if (slot < 0) return NULL;
+    
+    /* the last page is whole too, so the table can grow */
+    table->pages[page] = malloc(table->perPage * table->recordSize);
+    if (!table->pages[page])
+    {
+        table->ring[slot] = table->ring[--table->cached];
+        table->hand = 0;
+        return NULL;
+    }
+    
+    AccessRecords(disk, table, first, records, table->pages[page], 0);
+    return table->pages[page];
+}
+
+/*
+ *  Records are always copied in and out of the cache; if a page cannot be
+ *  cached the record is read or written on the disk directly instead.
+ */
+void GetRecord(struct DiskHandler *disk, struct Table *table, int index, void *record)
+{
+    char *page;
+    int run;
+    
+    GetThreadStats()->io.recordReads++;
+    page = GetTablePage(disk, table, index / table->perPage);
+    if (page) memcpy(record, page + (index % table->perPage) * table->recordSize, table->recordSize);
+    else      ReadDisk(disk, GetRecordAddr(table, index, &run), record, table->recordSize);
+}
+
+void SetRecord(struct DiskHandler *disk, struct Table *table, int index, const void *record)
+{
+    char *page;
+    int run;
+    
+    GetThreadStats()->io.recordWrites++;
+    page = GetTablePage(disk, table, index / table->perPage);
+    if (page)
+    {
+        memcpy(page + (index % table->perPage) * table->recordSize, record, table->recordSize);
+        table->dirty[index / table->perPage] = 1;
+    }
+    else
+    {
+        WriteDisk(disk, GetRecordAddr(table, index, &run), record, table->recordSize);
+    }
+}
+
+void SaveTable(struct DiskHandler *disk, struct Table *table)
+{
+    int i;
+    
+    if (!table->pages) return;
+    
+    for (i = 0; i < GetTablePages(table); ++i)
+    {
+        int first = i * table->perPage;
+        int records = table->count - first < table->perPage ? table->count - first : table->perPage;
+        
+        if (!table->dirty[i]) continue;
+        
+        AccessRecords(disk, table, first, records, table->pages[i], 1);
+        table->dirty[i] = 0;
+    }
+}
+
+void FreeTable(struct Table *table)
+{
+    int i;
+    
+    if (!table->pages) return;
+    
+    for (i = 0; i < GetTablePages(table); ++i)
+        free(table->pages[i]);
+    
+    free(table->pages);
+    free(table->dirty);
+    free(table->referenced);
+    free(table->ring);
+    table->pages = NULL;
+    table->dirty = NULL;
+    table->referenced = NULL;
+    table->ring = NULL;
+    table->cached = 0;
+    table->ringSize = 0;
+    table->hand = 0;
+}
+
+/*
+ *  Adds records from count on, stored at addr, to the end of the table.
+ *  Returns 1 if there is no memory for them.
+ */
+int GrowTable(struct DiskHandler *disk, struct Table *table, int count, long long addr)
+{
+    struct TablePart *parts;
+    int oldCount = table->count;
+    int oldPages = GetTablePages(table);
+    int pages = (count + table->perPage - 1) / table->perPage;
+    int last;
+    
+    parts = realloc(table->parts, (table->partCount + 1) * sizeof(struct TablePart));
+    if (!parts) return 1;
+    table->parts = parts;
+    
+    if (table->pages)
+    {
+        char **pageList = realloc(table->pages, pages * sizeof(char *));
+        char *dirty;
+        char *referenced;
+        
+        if (pageList) table->pages = pageList;
+        dirty = pageList ? realloc(table->dirty, pages) : NULL;
+        if (dirty) table->dirty = dirty;
+        referenced = dirty ? realloc(table->referenced, pages) : NULL;
+        if (!referenced) return 1;
+        table->referenced = referenced;
+        
+        memset(table->pages + oldPages, 0, (pages - oldPages) * sizeof(char *));
+        memset(table->dirty + oldPages, 0, pages - oldPages);
+        memset(table->referenced + oldPages, 0, pages - oldPages);
+    }
+    
+    table->parts[table->partCount].first = oldCount;
+    table->parts[table->partCount].addr = addr;
+    table->partCount++;
+    table->count = count;
+    
+    /* a cached last page gets the records which now follow on it */
+    if (table->pages && oldCount % table->perPage && table->pages[oldPages - 1])
+    {
+        last = oldPages * table->perPage < count ? oldPages * table->perPage : count;
+        AccessRecords(disk, table, oldCount, last - oldCount, table->pages[oldPages - 1] + (oldCount % table->perPage) * table->recordSize, 0);
+    }
+    return 0;
+}
+
+void FreeTableParts(struct Table *table)
+{
+    free(table->parts);
+    table->parts = NULL;
+    table->partCount = 0;
+}
+
+/*
+ *  Allocates the cache of blocks on first use. Returns 0 if the disk has
+ *  no cache of blocks.
+ */
+int InitBlockCache(struct DiskHandler *disk)
+{
+    struct BlockCache *cache = &disk->cache;
+    int buckets = 1;
+    int i;
+    
+    if (cache->entries) return 1;
+    if (disk->map || BLOCK_CACHE / SIZE_BLOCK < 4) return 0;
+    
+    cache->capacity = BLOCK_CACHE / SIZE_BLOCK < INT_MAX / 2 ? (int) (BLOCK_CACHE / SIZE_BLOCK) : INT_MAX / 2;
+    while (buckets < cache->capacity) buckets *= 2;
+    
+    cache->entries = malloc(cache->capacity * sizeof(struct CachedBlock));
+    cache->buckets = malloc(buckets * sizeof(int));
+    cache->data = malloc((size_t) cache->capacity * SIZE_BLOCK);
+    cache->scratch = malloc((size_t) (cache->capacity / 4) * SIZE_BLOCK);
+    if (!cache->entries || !cache->buckets || !cache->data || !cache->scratch)
+    {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->data);
+        free(cache->scratch);
+        cache->entries = NULL;
+        return 0;
+    }
+    
+    for (i = 0; i < buckets; ++i) cache->buckets[i] = -1;
+    cache->bucketMask = buckets - 1;
+    cache->used = 0;
+    cache->hand = 0;
+    cache->dirty = 0;
+    cache->nextBlock = -1;
+    cache->window = 1;
+    return 1;
+}
+
+char *GetCachedData(struct BlockCache *cache, int entry)
+{
+    return cache->data + (size_t) entry * SIZE_BLOCK;
+}
+
+int FindCached(struct BlockCache *cache, int block)
+{
+    int entry;
+    
+    if (!cache->entries) return -1;
+    
+    for (entry = cache->buckets[block & cache->bucketMask]; entry >= 0; entry = cache->entries[entry].next)
+        if (cache->entries[entry].block == block) return entry;
+    return -1;
+}
+
+void UnlinkCached(struct BlockCache *cache, int entry)
+{
+    int *link = &cache->buckets[cache->entries[entry].block & cache->bucketMask];
+    
+    while (*link != entry) link = &cache->entries[*link].next;
+    *link = cache->entries[entry].next;
+    cache->entries[entry].block = -1;
+}
+
+void WriteBackCached(struct DiskHandler *disk, int entry)
+{
+    struct BlockCache *cache = &disk->cache;
+    
+    WriteDisk(disk, GetBlockAddr(cache->entries[entry].block), GetCachedData(cache, entry), SIZE_BLOCK);
+    cache->entries[entry].dirty = 0;
+    cache->dirty--;
+    cache->writeBacks++;
+}
+
+/*
+ *  Returns a free entry for the block, evicting the first entry the clock
+ *  hand finds unused since it last passed it; a dirty victim is written
+ *  back first. Entries of dropped blocks are taken as they are found.
+ */
+int TakeCached(struct DiskHandler *disk, int block)
+{
+    struct BlockCache *cache = &disk->cache;
+    struct CachedBlock *victim;
+    int entry;
+    
+    if (cache->used < cache->capacity)
+    {
+        entry = cache->used++;
+    }
+    else
+    {
+        for (;;)
+        {
+            victim = &cache->entries[cache->hand];
+            entry = cache->hand;
+            cache->hand = (cache->hand + 1) % cache->capacity;
+            
+            if (!victim->referenced) break;
+            victim->referenced = 0;
+        }
+        
+        if (victim->dirty)
+        {
+            WriteBackCached(disk, entry);
+            
+            /* the block may be read past the stream next */
+            fflush(disk->file);
+        }
+        if (victim->block >= 0)
+        {
+            UnlinkCached(cache, entry);
+            cache->evictions++;
+        }
+    }
+    
+    cache->entries[entry].block = block;
+    cache->entries[entry].next = cache->buckets[block & cache->bucketMask];
+    cache->entries[entry].referenced = 1;
+    cache->entries[entry].dirty = 0;
+    cache->buckets[block & cache->bucketMask] = entry;
+    return entry;
+}
+
+/*
+ *  Reads length blocks from start, none of them cached, into the cache
+ *  with a single read.
+ */
+int LoadCached(struct DiskHandler *disk, int start, int length)
+{
+    struct BlockCache *cache = &disk->cache;
+    int i;
+    
+    if (ReadAt(fileno(disk->file), cache->scratch, length * SIZE_BLOCK, GetBlockAddr(start))) return 1;
+    
+    for (i = 0; i < length; ++i)
+        memcpy(GetCachedData(cache, TakeCached(disk, start + i)), cache->scratch + (size_t) i * SIZE_BLOCK, SIZE_BLOCK);
+    
+    cache->misses++;
+    return 0;
+}
+
+int CompareCached(const void *a, const void *b)
+{
+    return *(const int *) a < *(const int *) b ? -1 : *(const int *) a > *(const int *) b;
+}
+
+/*
+ *  Writes all dirty blocks back to the disk, in the order of the blocks.
+ */
+void FlushBlockCache(struct DiskHandler *disk)
+{
+    struct BlockCache *cache = &disk->cache;
+    int *blocks;
+    int count = 0;
+    int i;
+    
+    if (!cache->dirty) return;
+    
+    blocks = malloc(cache->dirty * sizeof(int));
+    for (i = 0; i < cache->used; ++i)
+    {
+        if (!cache->entries[i].dirty) continue;
+        
+        if (blocks) blocks[count++] = cache->entries[i].block;
+        else WriteBackCached(disk, i);
+    }
+    
+    if (blocks)
+    {
+        qsort(blocks, count, sizeof(int), CompareCached);
+        for (i = 0; i < count; ++i) WriteBackCached(disk, FindCached(cache, blocks[i]));
+        free(blocks);
+    }
+    
+    fflush(disk->file);
+}
+
+/*
+ *  Forgets the cached copies of freed blocks, dirty or not.
+ */
+void DropCachedBlocks(struct DiskHandler *disk, int start, int length)
+{
+    struct BlockCache *cache = &disk->cache;
+    int entry;
+    int i;
+    
+    if (!cache->entries || !cache->used) return;
+    
+    for (i = 0; i < length; ++i)
+    {
+        entry = FindCached(cache, start + i);
+        if (entry < 0) continue;
+        
+        if (cache->entries[entry].dirty) cache->dirty--;
+        cache->entries[entry].dirty = 0;
+        cache->entries[entry].referenced = 0;
+        UnlinkCached(cache, entry);
+    }
+}
+
+/*
+ *  Drops all cached blocks, e.g. when another process changed the disk.
+ */
+void ClearBlockCache(struct DiskHandler *disk)
+{
+    struct BlockCache *cache = &disk->cache;
+    int i;
+    
+    if (!cache->entries) return;
+    
+    for (i = 0; i <= cache->bucketMask; ++i) cache->buckets[i] = -1;
+    cache->used = 0;
+    cache->hand = 0;
+    cache->dirty = 0;
+    cache->nextBlock = -1;
+}
+
+void FreeBlockCache(struct DiskHandler *disk)
+{
+    struct BlockCache *cache = &disk->cache;
+    
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->scratch);
+    cache->entries = NULL;
+}
+
+struct Descriptor GetDescriptor(struct DiskHandler *disk, int index)
+{
+    struct Descriptor result;
+    GetRecord(disk, &disk->descriptors, index, &result);
+    return result;
+}
+
+void DropExtents(struct CachedExtents *cached)
+{
+    free(cached->extents);
+    free(cached->starts);
+    cached->extents = NULL;
+    cached->starts = NULL;
+}
+
+void ClearExtentCache(struct DiskHandler *disk)
+{
+    int i;
+    
+    for (i = 0; i < EXTENT_CACHE_SIZE; ++i) DropExtents(&disk->lists[i]);
+}
+
+void SetDescriptor(struct DiskHandler *disk, int index, struct Descriptor desc)
+{
+    struct CachedExtents *cached = &disk->lists[index & (EXTENT_CACHE_SIZE - 1)];
+    
+    /* every change of the extents of a file is written here */
+    if (cached->extents && cached->index == index) DropExtents(cached);
+    
+    SetRecord(disk, &disk->descriptors, index, &desc);
+}
+
+struct HashSlot GetHashSlot(struct DiskHandler *disk, int index)
+{
+    struct HashSlot result;
+    GetRecord(disk, &disk->slots, index, &result);
+    return result;
+}
+
+void SetHashSlot(struct DiskHandler *disk, int index, struct HashSlot slot)
+{
+    SetRecord(disk, &disk->slots, index, &slot);
+}
+
+struct Pack GetPack(struct DiskHandler *disk, int index)
+{
+    struct Pack result;
+    GetRecord(disk, &disk->packs, index, &result);
+    return result;
+}
+
+void SetPack(struct DiskHandler *disk, int index, struct Pack pack)
+{
+    SetRecord(disk, &disk->packs, index, &pack);
+}
+
+int GetRefs(struct DiskHandler *disk, int block)
+{
+    unsigned short refs;
+    GetRecord(disk, &disk->refs, block, &refs);
+    return refs;
+}
+
+void SetRefs(struct DiskHandler *disk, int block, int refs)
+{
+    unsigned short value = (unsigned short) refs;
+    SetRecord(disk, &disk->refs, block, &value);
+}
+
+struct DedupSlot GetDedupSlot(struct DiskHandler *disk, int index)
+{
+    struct DedupSlot result;
+    GetRecord(disk, &disk->dedup, index, &result);
+    return result;
+}
+
+void SetDedupSlot(struct DiskHandler *disk, int index, struct DedupSlot slot)
+{
+    SetRecord(disk, &disk->dedup, index, &slot);
+}
+
+/*
+ *  All cached tables of the metadata, in the order they are stored.
+ */
+#define METADATA_TABLES  7
+
+int GetMetadataTables(struct DiskHandler *disk, struct Table **tables)
+{
+    tables[0] = &disk->descriptors;
+    tables[1] = &disk->slots;
+    tables[2] = &disk->packs;
+    tables[3] = &disk->refs;
+    tables[4] = &disk->dedup;
+    tables[5] = &disk->blocks.words;
+    tables[6] = &disk->blocks.summary;
+    return METADATA_TABLES;
+}
+
+/*
+ *  Drops all cached metadata, dirty or not.
+ */
+void FreeMetadata(struct DiskHandler *disk)
+{
+    struct Table *tables[METADATA_TABLES];
+    int i;
+    
+    for (i = 0; i < GetMetadataTables(disk, tables); ++i) FreeTable(tables[i]);
+}
+
+void SetHeader(struct DiskHandler *disk, struct Header header)
+{
+    disk->header = header;
+    disk->headerDirty = 1;
+}
+
+void SelectJournal(struct Header *header)
+{
+    int size = header->journalBlock < 0 ? header->journalSize : header->journalBlocks * header->blockSize;
+    
+    if (JOURNAL_BLOCK != header->journalBlock) JOURNAL_BLOCK = header->journalBlock;
+    if (JOURNAL_SIZE != size) JOURNAL_SIZE = size;
+}
+
+/*
+ *  Makes the geometry of the disk current. Every operation on a mounted
+ *  disk starts with it, so several disks can be mounted at once. Threads
+ *  using their own handles of one disk find the geometry current already
+ *  and do not write it, as long as nobody resizes the disk meanwhile.
+ */
+void SelectDisk(struct DiskHandler *disk)
+{
+    if (SIZE_FILENAME == disk->header.nameSize && SIZE_BLOCK == disk->header.blockSize &&
+        LIMIT_FILES == disk->header.filesLimit && LIMIT_BLOCKS == disk->header.blocksLimit &&
+        MAP_BLOCKS == disk->header.mapBlocks && BASE_FILES == disk->header.baseFiles &&
+        BASE_MAP_BLOCKS == disk->header.baseMapBlocks && HASH_SIZE == disk->header.hashSize &&
+        DEDUP_SIZE == disk->header.dedupSize && JOURNAL_REGION == disk->header.journalSize)
+    {
+        SelectJournal(&disk->header);
+        return;
+    }
+    
+    SIZE_FILENAME = disk->header.nameSize;
+    SIZE_BLOCK = disk->header.blockSize;
+    LIMIT_FILES = disk->header.filesLimit;
+    LIMIT_BLOCKS = disk->header.blocksLimit;
+    MAP_BLOCKS = disk->header.mapBlocks;
+    BASE_FILES = disk->header.baseFiles;
+    BASE_MAP_BLOCKS = disk->header.baseMapBlocks;
+    HASH_SIZE = disk->header.hashSize;
+    DEDUP_SIZE = disk->header.dedupSize;
+    JOURNAL_REGION = disk->header.journalSize;
+    SelectJournal(&disk->header);
+}
+
+unsigned int HashPath(const char *path, int length)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+    
+    for (i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ *  Entries are indexed by their directory and name, so the same name can
+ *  be used in different directories.
+ */
+unsigned int HashName(int parent, const char *name)
+{
+    return HashPath(name, (int) strlen(name)) ^ (unsigned int) (parent + 1) * 2654435761u;
+}
+
+/*
+ *  First slot and size of a level of the name index: 0 is the index laid
+ *  out with the disk, the next ones come with the segments (size 0 for a
+ *  segment which added no descriptors).
+ */
+int GetHashLevel(struct DiskHandler *disk, int level, int *size)
+{
+    if (level == 0)
+    {
+        *size = HASH_SIZE;
+        return 0;
+    }
+    
+    *size = disk->segments[level - 1].hashSize;
+    return disk->segments[level - 1].firstSlot;
+}
+
+/*
+ *  Looks for the entry of the directory parent in the name index. Returns
+ *  the descriptor index (and fills desc) or -1 if there is no such entry;
+ *  slot is set to the slot holding the entry or, if it was not found, to
+ *  the slot of the newest level where it should be inserted.
+ */
+int FindEntry(struct DiskHandler *disk, int parent, const char *name, struct Descriptor *desc, int *slot)
+{
+    struct HashSlot cur;
+    unsigned int hash = HashName(parent, name);
+    int insert = -1;
+    int firstDeleted;
+    int first;
+    int size;
+    int level;
+    int probes;
+    int i;
+    
+    for (level = disk->segmentCount; level >= 0; --level)
+    {
+        first = GetHashLevel(disk, level, &size);
+        if (size == 0) continue;
+        
+        firstDeleted = -1;
+        i = hash & (size - 1);
+        
+        for (probes = 0; probes < size; ++probes)
+        {
+            cur = GetHashSlot(disk, first + i);
+            
+            if (cur.descriptor == SLOT_EMPTY) break;
+            
+            if (cur.descriptor == SLOT_DELETED)
+            {
+                if (firstDeleted < 0) firstDeleted = i;
+            }
+            else if (cur.hash == hash)
+            {
+                *desc = GetDescriptor(disk, cur.descriptor - 1);
+                if (desc->isUsed && desc->parent == parent && strcmp(desc->name, name) == 0)
+                {
+                    *slot = first + i;
+                    return cur.descriptor - 1;
+                }
+            }
+            
+            i = (i + 1) & (size - 1);
+        }
+        
+        if (insert < 0) insert = first + (firstDeleted >= 0 ? firstDeleted : i);
+    }
+    
+    *slot = insert;
+    return -1;
+}
+
+void ClearPathCache(struct DiskHandler *disk)
+{
+    int i;
+    
+    for (i = 0; i < PATH_CACHE_SIZE; ++i)
+    {
+        free(disk->paths[i].path);
+        disk->paths[i].path = NULL;
+    }
+}
+
+/*
+ *  Resolves the directory of the first length characters of path, going
+ *  through the cache of paths. Returns its descriptor index, -1 for the
+ *  root or -2 if a component does not exist or is not a directory.
+ */
+int FindDirectory(struct DiskHandler *disk, const char *path, int length)
+{
+    struct CachedPath *cached = &disk->paths[HashPath(path, length) & (PATH_CACHE_SIZE - 1)];
+    struct Descriptor desc;
+    char name[MAX_SIZE_FILENAME];
+    int parent = -1;
+    int slot;
+    int start;
+    int end;
+    
+    if (cached->path && cached->length == length && memcmp(cached->path, path, length) == 0)
+    {
+        disk->pathHits++;
+        return cached->index;
+    }
+    disk->pathMisses++;
+    
+    for (start = 0; start < length; start = end)
+    {
+        while (start < length && path[start] == '/') start++;
+        for (end = start; end < length && path[end] != '/'; ++end);
+        if (end == start) break;
+        if (end - start >= MAX_SIZE_FILENAME) return -2;
+        
+        memcpy(name, path + start, end - start);
+        name[end - start] = '\0';
+        
+        parent = FindEntry(disk, parent, name, &desc, &slot);
+        if (parent < 0 || !(desc.flags & DESC_DIRECTORY)) return -2;
+    }
+    
+    free(cached->path);
+    cached->path = malloc(length > 0 ? length : 1);
+    if (cached->path)
+    {
+        memcpy(cached->path, path, length);
+        cached->length = length;
+        cached->index = parent;
+    }
+    return parent;
+}
+
+/*
+ *  Copies the last component of the path to leaf (it is empty for the
+ *  root). Slashes at the start, at the end and repeated ones are ignored.
+ *  Returns the length of the path of its directory, or -1 if the
+ *  component is too long for any name.
+ */
+int GetLeafName(const char *path, char *leaf)
+{
+    int end = (int) strlen(path);
+    int last;
+    
+    while (end > 0 && path[end - 1] == '/') end--;
+    for (last = end; last > 0 && path[last - 1] != '/'; --last);
+    
+    leaf[0] = '\0';
+    if (end - last >= MAX_SIZE_FILENAME) return -1;
+    memcpy(leaf, path + last, end - last);
+    leaf[end - last] = '\0';
+    
+    while (last > 0 && path[last - 1] == '/') last--;
+    return last;
+}
+
+/*
+ *  Splits the path into its directory, which is resolved, and its last
+ *  component, like GetLeafName. Returns like FindDirectory.
+ */
+int FindParent(struct DiskHandler *disk, const char *path, char *leaf)
+{
+    int length = GetLeafName(path, leaf);
+    
+    if (length < 0) return -2;
+    return length > 0 ? FindDirectory(disk, path, length) : -1;
+}
+
+/*
+ *  Looks for the entry at the path, like FindEntry; if its directory does
+ *  not exist slot is set to -1.
+ */
+int FindDescriptor(struct DiskHandler *disk, const char *path, struct Descriptor *desc, int *slot)
+{
+    char leaf[MAX_SIZE_FILENAME];
+    int parent = FindParent(disk, path, leaf);
+    
+    *slot = -1;
+    if (parent < -1 || leaf[0] == '\0') return -1;
+    return FindEntry(disk, parent, leaf, desc, slot);
+}
+
+/*
+ *  Checks the path given to a new entry and copies its last component,
+ *  the name of the entry, to leaf. Returns 0 if it can be used.
+ */
+int CheckPath(const char *path, char *leaf)
+{
+    if (GetLeafName(path, leaf) < 0 || (int) strlen(leaf) >= SIZE_FILENAME)
+    {
+        printf("Name %s is too long\n", path);
+        return 5;
+    }
+    
+    if (leaf[0] == '\0' || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0)
+    {
+        printf("Name %s is not valid\n", path);
+        return 5;
+    }
+    return 0;
+}
+
+/*
+ *  Adds the entry at the front of the entries of its parent; desc is
+ *  written by the caller.
+ */
+void LinkEntry(struct DiskHandler *disk, struct Header *header, int index, struct Descriptor *desc)
+{
+    struct Descriptor other;
+    
+    desc->prevSibling = -1;
+    
+    if (desc->parent < 0)
+    {
+        desc->nextSibling = header->rootFirst;
+        header->rootFirst = index;
+    }
+    else
+    {
+        other = GetDescriptor(disk, desc->parent);
+        desc->nextSibling = other.firstChild;
+        other.firstChild = index;
+        SetDescriptor(disk, desc->parent, other);
+    }
+    
+    if (desc->nextSibling >= 0)
+    {
+        other = GetDescriptor(disk, desc->nextSibling);
+        other.prevSibling = index;
+        SetDescriptor(disk, desc->nextSibling, other);
+    }
+}
+
+void UnlinkEntry(struct DiskHandler *disk, struct Header *header, struct Descriptor *desc)
+{
+    struct Descriptor other;
+    
+    if (desc->prevSibling >= 0)
+    {
+        other = GetDescriptor(disk, desc->prevSibling);
+        other.nextSibling = desc->nextSibling;
+        SetDescriptor(disk, desc->prevSibling, other);
+    }
+    else if (desc->parent < 0)
+    {
+        header->rootFirst = desc->nextSibling;
+    }
+    else
+    {
+        other = GetDescriptor(disk, desc->parent);
+        other.firstChild = desc->nextSibling;
+        SetDescriptor(disk, desc->parent, other);
+    }
+    
+    if (desc->nextSibling >= 0)
+    {
+        other = GetDescriptor(disk, desc->nextSibling);
+        other.prevSibling = desc->prevSibling;
+        SetDescriptor(disk, desc->nextSibling, other);
+    }
+}
+
+/*
+ *  Next entry after index in a walk of the tree under the directory top
+ *  (-1 for the root) which visits a directory before its entries; desc
+ *  holds the descriptor of index and gets the one of the next entry.
+ *  Returns -1 at the end of the walk.
+ */
+int NextEntry(struct DiskHandler *disk, int top, int index, struct Descriptor *desc)
+{
+    if ((desc->flags & DESC_DIRECTORY) && desc->firstChild >= 0)
+    {
+        index = desc->firstChild;
+        *desc = GetDescriptor(disk, index);
+        return index;
+    }
+    
+    while (desc->nextSibling < 0)
+    {
+        if (desc->parent == top) return -1;
+        *desc = GetDescriptor(disk, desc->parent);
+    }
+    
+    index = desc->nextSibling;
+    *desc = GetDescriptor(disk, index);
+    return index;
+}
+
+int FirstEntry(struct DiskHandler *disk, int top)
+{
+    return top < 0 ? disk->header.rootFirst : GetDescriptor(disk, top).firstChild;
+}
+
+/*
+ *  Writes the path of the entry relative to the directory top into path.
+ *  Returns 1 if it does not fit in size bytes.
+ */
+int GetEntryPath(struct DiskHandler *disk, int top, int index, char *path, int size)
+{
+    struct Descriptor desc;
+    int length = 0;
+    int part;
+    
+    path[0] = '\0';
+    for (; index != top; index = desc.parent)
+    {
+        desc = GetDescriptor(disk, index);
+        part = (int) strlen(desc.name);
+        if (length + part + (length > 0) >= size) return 1;
+        
+        memmove(path + part + (length > 0), path, length + 1);
+        memcpy(path, desc.name, part);
+        if (length > 0) path[part] = '/';
+        length += part + (length > 0);
+    }
+    return 0;
+}
+
+void RemoveHashSlot(struct DiskHandler *disk, int index)
+{
+    struct HashSlot slot;
+    int level;
+    int first;
+    int size;
+    
+    for (level = disk->segmentCount; level > 0; --level)
+    {
+        first = GetHashLevel(disk, level, &size);
+        if (index >= first && index < first + size) break;
+    }
+    first = GetHashLevel(disk, level, &size);
+    index -= first;
+    
+    /* a deleted slot followed by an empty one can be made empty again */
+    slot = GetHashSlot(disk, first + ((index + 1) & (size - 1)));
+    if (slot.descriptor != SLOT_EMPTY)
+    {
+        slot.descriptor = SLOT_DELETED;
+        SetHashSlot(disk, first + index, slot);
+        return;
+    }
+    
+    slot.descriptor = SLOT_EMPTY;
+    do
+    {
+        SetHashSlot(disk, first + index, slot);
+        index = (index - 1) & (size - 1);
+    } while (GetHashSlot(disk, first + index).descriptor == SLOT_DELETED);
+}
+
+/*
+ *  Returns the map of blocks of the disk. Its pages are read when they
+ *  are first needed.
+ */
+struct BlockMap *GetBlockMap(struct DiskHandler *disk)
+{
+    return &disk->blocks;
+}
+
+void InitBlockMap(struct DiskHandler *disk, struct BlockMap *map)
+{
+    map->disk = disk;
+    map->count = GetMapWords(BASE_MAP_BLOCKS);
+    InitTable(&map->words, GetBitmapAddr(0), sizeof(unsigned int), map->count, MAP_CACHE_PAGES);
+    InitTable(&map->summary, GetSummaryAddr(0), sizeof(int), GetMapPages(BASE_MAP_BLOCKS), 0);
+}
+
+unsigned int GetMapWord(struct BlockMap *map, int index)
+{
+    unsigned int word;
+    GetRecord(map->disk, &map->words, index, &word);
+    return word;
+}
+
+/*
+ *  Number of used blocks in the page of the map and the number of
+ *  blocks it covers (the last page covers only the rest of the disk).
+ */
+int GetPageUsed(struct BlockMap *map, int page)
+{
+    int used;
+    GetRecord(map->disk, &map->summary, page, &used);
+    return used;
+}
+
+int GetPageBlocks(int page)
+{
+    int rest = LIMIT_BLOCKS - page * MAP_PAGE_BLOCKS;
+    return rest < MAP_PAGE_BLOCKS ? rest : MAP_PAGE_BLOCKS;
+}
+
+int CountBits(unsigned int bits)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(bits);
+#else
+    int count = 0;
+    for (; bits; bits &= bits - 1) count++;
+    return count;
+#endif
+}
+
+int IsBlockUsed(struct BlockMap *map, int index)
+{
+    return (GetMapWord(map, index / BITS_WORD) >> (index % BITS_WORD)) & 1;
+}
+
+void MarkBlocks(struct BlockMap *map, int start, int length, int used)
+{
+    int end = start + length;
+    
+    if (!used) DropCachedBlocks(map->disk, start, length);
+    
+    while (start < end)
+    {
+        int bit = start % BITS_WORD;
+        int n = BITS_WORD - bit;
+        int page = start / MAP_PAGE_BLOCKS;
+        int pageUsed;
+        unsigned int mask;
+        unsigned int word;
+        unsigned int changed;
+        
+        if (n > end - start) n = end - start;
+        mask = n == BITS_WORD ? ~0u : ((1u << n) - 1) << bit;
+        
+        word = GetMapWord(map, start / BITS_WORD);
+        changed = used ? mask & ~word : mask & word;
+        
+        if (changed)
+        {
+            word = used ? word | mask : word & ~mask;
+            SetRecord(map->disk, &map->words, start / BITS_WORD, &word);
+            
+            pageUsed = GetPageUsed(map, page) + (used ? CountBits(changed) : -CountBits(changed));
+            SetRecord(map->disk, &map->summary, page, &pageUsed);
+        }
+        
+        start += n;
+    }
+}
+
+int LowestBit(unsigned int bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int i = 0;
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+/*
+ *  Returns the first block >= from whose state is equal to used,
+ *  or LIMIT_BLOCKS if there is no such block. Whole pages of the map
+ *  which cannot contain a match are skipped using the summary, and
+ *  whole words inside a page are skipped at once.
+ */
+int FindBlock(struct BlockMap *map, int from, int used)
+{
+    unsigned int *words;
+    unsigned int bits;
+    int word;
+    int last;
+    int page;
+    
+    while (from < LIMIT_BLOCKS)
+    {
+        page = from / MAP_PAGE_BLOCKS;
+        
+        if (GetPageUsed(map, page) == (used ? 0 : GetPageBlocks(page)))
+        {
+            from = (page + 1) * MAP_PAGE_BLOCKS;
+            continue;
+        }
+        
+        words = (unsigned int *) GetTablePage(map->disk, &map->words, page);
+        word = from / BITS_WORD;
+        last = (page + 1) * MAP_PAGE_WORDS < map->count ? (page + 1) * MAP_PAGE_WORDS : map->count;
+        
+        for (; word < last; ++word)
+        {
+            bits = words ? words[word % MAP_PAGE_WORDS] : GetMapWord(map, word);
+            if (!used) bits = ~bits;
+            if (word == from / BITS_WORD) bits &= ~0u << (from % BITS_WORD);
+            
+            if (bits)
+            {
+                from = word * BITS_WORD + LowestBit(bits);
+                return from < LIMIT_BLOCKS ? from : LIMIT_BLOCKS;
+            }
+        }
+        
+        from = last * BITS_WORD;
+    }
+    
+    return LIMIT_BLOCKS;
+}
+
+/*
+ *  Looks for free space for want blocks. Returns the first free run
+ *  which can hold all of them (first fit); if there is none, the
+ *  longest free run is returned so the file is split into as few
+ *  pieces as possible. The run is marked as used and its length is
+ *  stored in length. Returns -1 if the disk is full.
+ */
+int AllocateBlocks(struct BlockMap *map, int want, int *length)
+{
+    int best = -1;
+    int bestLength = 0;
+    int start;
+    int end = 0;
+    
+    while (end < LIMIT_BLOCKS)
+    {
+        start = FindBlock(map, end, 0);
+        if (start >= LIMIT_BLOCKS) break;
+        end = FindBlock(map, start, 1);
+        
+        if (end - start >= want)
+        {
+            best = start;
+            bestLength = want;
+            break;
+        }
+        
+        if (end - start > bestLength)
+        {
+            best = start;
+            bestLength = end - start;
+        }
+    }
+    
+    if (best >= 0) MarkBlocks(map, best, bestLength, 1);
+    *length = bestLength;
+    return best;
+}
+
+int GetExtentsPerBlock(void)
+{
+    return (SIZE_BLOCK - sizeof(struct ExtentBlock)) / sizeof(struct Extent);
+}
+
+/*
+ *  Number of overflow blocks holding a list of count extents.
+ */
+int GetOverflowBlocks(int count)
+{
+    if (count <= DESC_EXTENTS) return 0;
+    return (count - DESC_EXTENTS + GetExtentsPerBlock() - 1) / GetExtentsPerBlock();
+}
+
+/*
+ *  Copies size bytes of a file between its external copy (from offset 0)
+ *  and its extents in the disk; toDisk gives the direction. Extents
+ *  marked in skip (if it is not NULL) are left out. With more than one
+ *  copy thread the chunks go to the worker pool, otherwise the extents
+ *  are copied one after another with the serial path.
+ *  Returns 0 on success.
+ */
+int CopyExtents(struct DiskHandler *disk, FILE *file, struct Extent *extents, int count, long long size, int toDisk, char *buffer, const char *skip)
+{
+    struct CopyJob job;
+    int chunkSize = COPY_BUFFER;
+    long long copied = 0;
+    int result;
+    int i;
+    
+    if (COPY_THREADS <= 1)
+    {
+        for (i = 0; i < count && copied < size; ++i)
+        {
+            long long toCopy = (long long) extents[i].length * SIZE_BLOCK;
+            if (toCopy > size - copied) toCopy = size - copied;
+            
+            if (skip && skip[i]) fseeko(file, copied + toCopy, SEEK_SET);
+            else if (toDisk) CopyToDisk(disk, GetBlockAddr(extents[i].start), file, toCopy, buffer);
+            else        CopyFromDisk(disk, GetBlockAddr(extents[i].start), file, toCopy, buffer);
+            copied += toCopy;
+        }
+        return 0;
+    }
+    
+    job.count = 0;
+    for (i = 0; i < count; ++i)
+        job.count += ((long long) extents[i].length * SIZE_BLOCK + chunkSize - 1) / chunkSize;
+    
+    job.chunks = malloc(sizeof(struct CopyChunk) * (job.count > 0 ? job.count : 1));
+    if (!job.chunks) return 1;
+    
+    job.count = 0;
+    for (i = 0; i < count && copied < size; ++i)
+    {
+        long long addr = GetBlockAddr(extents[i].start);
+        long long left = (long long) extents[i].length * SIZE_BLOCK;
+        
+        if (left > size - copied) left = size - copied;
+        if (skip && skip[i])
+        {
+            copied += left;
+            continue;
+        }
+        
+        while (left > 0)
+        {
+            struct CopyChunk *chunk = &job.chunks[job.count++];
+            
+            chunk->size = left < chunkSize ? left : chunkSize;
+            chunk->from = toDisk ? copied : addr;
+            chunk->to = toDisk ? addr : copied;
+            
+            addr += chunk->size;
+            copied += chunk->size;
+            left -= chunk->size;
+        }
+    }
+    
+    /* the streams must not keep any data the workers do not see */
+    fflush(file);
+    if (!disk->map) fflush(disk->file);
+    
+    job.in = toDisk ? fileno(file) : fileno(disk->file);
+    job.out = toDisk ? fileno(disk->file) : fileno(file);
+    job.inMap = toDisk ? NULL : disk->map;
+    job.outMap = toDisk ? disk->map : NULL;
+    job.bufferSize = chunkSize;
+    
+    result = RunCopyJob(&job);
+    free(job.chunks);
+    return result;
+}
+
+/*
+ *  Reads the whole extent list of the file, following the overflow
+ *  blocks. Returns the number of extents or -1 if there was not enough
+ *  memory; the list has to be freed by the caller.
+ */
+int LoadExtents(struct DiskHandler *disk, struct Descriptor *desc, struct Extent **list)
+{
+    struct ExtentBlock eb;
+    int count = desc->extentCount;
+    int loaded;
+    int block;
+    
+    *list = malloc(sizeof(struct Extent) * (count > 0 ? count : 1));
+    if (!*list) return -1;
+    
+    loaded = count < DESC_EXTENTS ? count : DESC_EXTENTS;
+    memcpy(*list, desc->extents, sizeof(struct Extent) * loaded);
+    
+    for (block = desc->overflow; block >= 0 && loaded < count; block = eb.next)
+    {
+        ReadDisk(disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock));
+        ReadDisk(disk, GetBlockAddr(block) + sizeof(struct ExtentBlock), *list + loaded, sizeof(struct Extent) * eb.count);
+        loaded += eb.count;
+    }
+    
+    return count;
+}
+
+/*
+ *  Stores the extent list in the descriptor, allocating overflow blocks
+ *  for the extents which do not fit in it. Returns the number of
+ *  overflow blocks taken or -1 if there is no space for them, in which
+ *  case nothing is allocated.
+ */
+int StoreExtents(struct DiskHandler *disk, struct BlockMap *map, struct Descriptor *desc, struct Extent *list, int count)
+{
+    struct ExtentBlock eb;
+    struct Extent run;
+    int perBlock = GetExtentsPerBlock();
+    int *blocks;
+    int needed;
+    int stored;
+    int i;
+    
+    desc->extentCount = count;
+    desc->overflow = -1;
+    
+    /* an empty file may come with no list at all */
+    if (count == 0) return 0;
+    memcpy(desc->extents, list, sizeof(struct Extent) * (count < DESC_EXTENTS ? count : DESC_EXTENTS));
+    
+    if (count <= DESC_EXTENTS) return 0;
+    
+    needed = GetOverflowBlocks(count);
+    blocks = calloc(needed, sizeof(int));
+    if (!blocks) return -1;
+    
+    run.length = 0;
+    for (i = 0; i < needed; ++i)
+    {
+        if (run.length == 0)
+        {
+            run.start = AllocateBlocks(map, needed - i, &run.length);
+            if (run.start < 0)
+            {
+                while (i > 0) MarkBlocks(map, blocks[--i], 1, 0);
+                free(blocks);
+                return -1;
+            }
+        }
+        
+        blocks[i] = run.start++;
+        run.length--;
+    }
+    
+    desc->overflow = blocks[0];
+    stored = DESC_EXTENTS;
+    
+    for (i = 0; i < needed; ++i)
+    {
+        eb.next = i + 1 < needed ? blocks[i + 1] : -1;
+        eb.count = count - stored < perBlock ? count - stored : perBlock;
+        
+        WriteDisk(disk, GetBlockAddr(blocks[i]), &eb, sizeof(struct ExtentBlock));
+        WriteDisk(disk, GetBlockAddr(blocks[i]) + sizeof(struct ExtentBlock), list + stored, sizeof(struct Extent) * eb.count);
+        stored += eb.count;
+    }
+    
+    free(blocks);
+    return needed;
+}
+
+/*
+ *  Adds a reference to every block of the extents.
+ */
+void AddReferences(struct DiskHandler *disk, struct Header *header, struct Extent *list, int count)
+{
+    int refs;
+    int block;
+    int i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        for (block = list[i].start; block < list[i].start + list[i].length; ++block)
+        {
+            refs = GetRefs(disk, block);
+            if (refs > 0) header->sharedBlocks++;
+            SetRefs(disk, block, refs + 1);
+        }
+    }
+}
+
+/*
+ *  Drops a reference to every block of the run; blocks nobody refers to
+ *  any more are marked as free. Returns the number of released blocks.
+ */
+int ReleaseRun(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Extent run)
+{
+    int released = 0;
+    int freeStart = -1;
+    int refs;
+    int block;
+    
+    for (block = run.start; block < run.start + run.length; ++block)
+    {
+        refs = GetRefs(disk, block);
+        if (refs > 1)
+        {
+            SetRefs(disk, block, refs - 1);
+            header->sharedBlocks--;
+            
+            if (freeStart >= 0) MarkBlocks(map, freeStart, block - freeStart, 0);
+            freeStart = -1;
+            continue;
+        }
+        
+        if (refs > 0) SetRefs(disk, block, 0);
+        if (freeStart < 0) freeStart = block;
+        released++;
+    }
+    
+    if (freeStart >= 0) MarkBlocks(map, freeStart, block - freeStart, 0);
+    return released;
+}
+
+/*
+ *  Releases all blocks of the file, including its overflow blocks.
+ *  Returns the number of released blocks.
+ */
+int ReleaseExtents(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Descriptor *desc)
+{
+    struct ExtentBlock eb;
+    struct Extent extent;
+    int released = 0;
+    int block;
+    int i;
+    
+    for (i = 0; i < desc->extentCount && i < DESC_EXTENTS; ++i)
+        released += ReleaseRun(disk, map, header, desc->extents[i]);
+    
+    for (block = desc->overflow; block >= 0; block = eb.next)
+    {
+        ReadDisk(disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock));
+        
+        for (i = 0; i < eb.count; ++i)
+        {
+            ReadDisk(disk, GetBlockAddr(block) + sizeof(struct ExtentBlock) + sizeof(struct Extent) * i, &extent, sizeof(struct Extent));
+            released += ReleaseRun(disk, map, header, extent);
+        }
+        
+        MarkBlocks(map, block, 1, 0);
+        released++;
+    }
+    
+    return released;
+}
+
+/*
+ *  Releases the overflow blocks of the file only, e.g. before its extent
+ *  list is stored again. Returns the number of released blocks.
+ */
+int ReleaseOverflow(struct BlockMap *map, struct Descriptor *desc)
+{
+    struct ExtentBlock eb;
+    int released = 0;
+    int block;
+    
+    for (block = desc->overflow; block >= 0; block = eb.next)
+    {
+        ReadDisk(map->disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock));
+        MarkBlocks(map, block, 1, 0);
+        released++;
+    }
+    
+    desc->overflow = -1;
+    return released;
+}
+
+int HasSharedBlocks(struct DiskHandler *disk, struct Extent *list, int count)
+{
+    int block;
+    int i;
+    
+    for (i = 0; i < count; ++i)
+        for (block = list[i].start; block < list[i].start + list[i].length; ++block)
+            if (GetRefs(disk, block) > 1) return 1;
+    return 0;
+}
+
+int CountBlocks(struct Extent *list, int count)
+{
+    int blocks = 0;
+    int i;
+    
+    for (i = 0; i < count; ++i) blocks += list[i].length;
+    return blocks;
+}
+
+unsigned int HashBlock(const char *data, int size)
+{
+    unsigned int hash = 2166136261u;
+    unsigned int word;
+    int i = 0;
+    
+    for (; i + 4 <= size; i += 4)
+    {
+        memcpy(&word, data + i, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+    
+    return hash;
+}
+
+/*
+ *  Hashes the first count full blocks of the file. Returns the list of
+ *  hashes, which has to be freed by the caller, or NULL if there was not
+ *  enough memory or the file could not be read.
+ */
+unsigned int *HashFileBlocks(FILE *file, int count, char *buffer)
+{
+    unsigned int *hashes = malloc(sizeof(unsigned int) * (count > 0 ? count : 1));
+    int i;
+    
+    if (!hashes) return NULL;
+    
+    fseeko(file, 0, SEEK_SET);
+    for (i = 0; i < count; ++i)
+    {
+        if ((int) fread(buffer, 1, SIZE_BLOCK, file) != SIZE_BLOCK)
+        {
+            free(hashes);
+            return NULL;
+        }
+        hashes[i] = HashBlock(buffer, SIZE_BLOCK);
+    }
+    
+    return hashes;
+}
+
+/*
+ *  Looks for a stored block with the same content as the block of the
+ *  file at offset. buffer must hold two blocks. Returns the block or -1.
+ */
+int FindDuplicate(struct DiskHandler *disk, unsigned int hash, FILE *file, long long offset, char *buffer)
+{
+    struct DedupSlot slot;
+    int loaded = 0;
+    int refs;
+    int i;
+    
+    for (i = 0; i < DEDUP_PROBES; ++i)
+    {
+        slot = GetDedupSlot(disk, (hash + i) & (DEDUP_SIZE - 1));
+        if (slot.block == 0) break;
+        if (slot.hash != hash || slot.block > LIMIT_BLOCKS) continue;
+        
+        /* only blocks of stored files can be shared */
+        refs = GetRefs(disk, slot.block - 1);
+        if (refs == 0 || refs >= REFS_MAX) continue;
+        
+        if (!loaded && ReadAt(fileno(file), buffer, SIZE_BLOCK, offset)) return -1;
+        loaded = 1;
+        
+        ReadDisk(disk, GetBlockAddr(slot.block - 1), buffer + SIZE_BLOCK, SIZE_BLOCK);
+        if (memcmp(buffer, buffer + SIZE_BLOCK, SIZE_BLOCK) == 0) return slot.block - 1;
+    }
+    
+    return -1;
+}
+
+void IndexBlock(struct DiskHandler *disk, unsigned int hash, int block)
+{
+    struct DedupSlot slot;
+    int index = hash & (DEDUP_SIZE - 1);
+    int i;
+    
+    for (i = 0; i < DEDUP_PROBES; ++i)
+    {
+        slot = GetDedupSlot(disk, (hash + i) & (DEDUP_SIZE - 1));
+        if (slot.block == 0 || slot.block > LIMIT_BLOCKS || GetRefs(disk, slot.block - 1) == 0)
+        {
+            index = (hash + i) & (DEDUP_SIZE - 1);
+            break;
+        }
+    }
+    
+    slot.hash = hash;
+    slot.block = block + 1;
+    SetDedupSlot(disk, index, slot);
+}
+
+/*
+ *  Number of bytes of the file stored outside of its extents - inline
+ *  in the descriptor or in a pack.
+ */
+long long GetTailSize(struct Descriptor *desc)
+{
+    if (desc->flags & DESC_INLINE) return desc->fileSize;
+    if (desc->flags & DESC_PACKED) return desc->fileSize % SIZE_BLOCK;
+    return 0;
+}
+
+int GetInlineSize(struct Descriptor *desc)
+{
+    return (int) sizeof(desc->extents) + SIZE_FILENAME - (int) strlen(desc->name) - 1;
+}
+
+/*
+ *  Chooses how a new file is stored, from its name and size: inline if
+ *  it fits in the descriptor, with its tail packed if the tail takes at
+ *  most half a block, otherwise in whole blocks only.
+ */
+void PlanStorage(struct Descriptor *desc)
+{
+    long long tail = desc->fileSize % SIZE_BLOCK;
+    
+    desc->flags = 0;
+    desc->pack = -1;
+    desc->packOffset = 0;
+    
+    if (desc->fileSize <= GetInlineSize(desc)) desc->flags = DESC_INLINE;
+    else if (tail > 0 && tail <= SIZE_BLOCK / 2) desc->flags = DESC_PACKED;
+}
+
+/*
+ *  Reserves space for the tail of a DESC_PACKED file in the open pack,
+ *  or opens a new pack in a newly allocated block if the tail does not
+ *  fit in it. Returns 0 on success or 3 if there is no free block.
+ */
+int ReservePack(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Descriptor *desc)
+{
+    struct Pack pack;
+    
+    int size = (int) GetTailSize(desc);
+    int index = header->openPack;
+    int length;
+    
+    if (index >= 0) pack = GetPack(disk, index);
+    
+    if (index < 0 || pack.used + size > SIZE_BLOCK)
+    {
+        /* freed packs are reused first, then the ones never used */
+        index = header->freePack;
+        if (index < 0 && header->packWatermark < GetPacksLimit()) index = header->packWatermark;
+        if (index < 0) return 3;
+        
+        pack.block = AllocateBlocks(map, 1, &length);
+        if (pack.block < 0) return 3;
+        
+        if (index == header->freePack) header->freePack = GetPack(disk, index).block;
+        else header->packWatermark++;
+        
+        pack.used = 0;
+        pack.live = 0;
+        header->openPack = index;
+        header->usedBlocks++;
+    }
+    
+    desc->pack = index;
+    desc->packOffset = pack.used;
+    pack.used += size;
+    pack.live++;
+    SetPack(disk, index, pack);
+    return 0;
+}
+
+/*
+ *  Removes the tail of the file from its pack; the pack is released with
+ *  its block when its last tail goes. Returns the number of released
+ *  blocks.
+ */
+int ReleasePack(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Descriptor *desc)
+{
+    struct Pack pack;
+    
+    if (!(desc->flags & DESC_PACKED)) return 0;
+    
+    pack = GetPack(disk, desc->pack);
+    if (--pack.live > 0)
+    {
+        SetPack(disk, desc->pack, pack);
+        return 0;
+    }
+    
+    if (desc->pack == header->openPack) header->openPack = -1;
+    
+    MarkBlocks(map, pack.block, 1, 0);
+    pack.block = header->freePack;
+    pack.used = 0;
+    SetPack(disk, desc->pack, pack);
+    header->freePack = desc->pack;
+    return 1;
+}
+
+/*
+ *  Address of the tail of a DESC_PACKED file; has to be called with the
+ *  metadata locked.
+ */
+long long GetTailAddr(struct DiskHandler *disk, struct Descriptor *desc)
+{
+    if (!(desc->flags & DESC_PACKED)) return 0;
+    return GetBlockAddr(GetPack(disk, desc->pack).block) + desc->packOffset;
+}
+
+/*
+ *  Copies size bytes at offset between buffer and the data of a
+ *  DESC_INLINE file; toDesc gives the direction.
+ */
+void AccessInline(struct Descriptor *desc, long long offset, char *buffer, int size, int toDesc)
+{
+    char *rest = desc->name + strlen(desc->name) + 1;
+    int first = (int) sizeof(desc->extents);
+    char *at;
+    int part;
+    
+    for (; size > 0; offset += part, buffer += part, size -= part)
+    {
+        at = offset < first ? (char *) desc->extents + offset : rest + (offset - first);
+        part = offset < first ? first - (int) offset : size;
+        if (part > size) part = size;
+        
+        if (toDesc) memcpy(at, buffer, part);
+        else        memcpy(buffer, at, part);
+    }
+}
+
+/*
+ *  Copies the part of the file stored outside of its extents, like
+ *  CopyExtents. Inline data fills the space of the extents first and
+ *  then the bytes after the name. Returns 0 on success.
+ */
+int CopyTail(struct DiskHandler *disk, FILE *file, struct Descriptor *desc, long long addr, int toDisk, char *buffer)
+{
+    long long size = GetTailSize(desc);
+    char *rest = desc->name + strlen(desc->name) + 1;
+    int first;
+    
+    if (size == 0) return 0;
+    
+    fseeko(file, desc->fileSize - size, SEEK_SET);
+    
+    if (desc->flags & DESC_PACKED)
+    {
+        if (toDisk) CopyToDisk(disk, addr, file, size, buffer);
+        else        CopyFromDisk(disk, addr, file, size, buffer);
+        return 0;
+    }
+    
+    first = size < (long long) sizeof(desc->extents) ? (int) size : (int) sizeof(desc->extents);
+    
+    if (toDisk)
+        return (int) fread(desc->extents, 1, first, file) != first || (long long) fread(rest, 1, size - first, file) != size - first;
+    return (int) fwrite(desc->extents, 1, first, file) != first || (long long) fwrite(rest, 1, size - first, file) != size - first;
+}
+
+/*
+ *  Compression: the data of a compressed file is cut into frames of
+ *  COMPRESS_FRAME bytes (the last one may be shorter) and every frame is
+ *  compressed on its own. The blocks of the file hold a table with the
+ *  end of every frame, counted from the end of the table, followed by
+ *  the frames, so any part of the file is read by decompressing just the
+ *  frames it falls in. A frame which does not get smaller is stored as
+ *  it is; its stored size being the size of the frame tells which one it
+ *  is.
+ *  
+ *  Frames are compressed with a small LZ77 codec in the format of LZ4
+ *  blocks: a sequence is a token (the number of literals in its high
+ *  four bits, the length of the match minus LZ_MIN_MATCH in the low
+ *  ones, 15 meaning that more bytes of the length follow, each added
+ *  until one is not 255), the literals, and the match as a two-byte
+ *  offset back in the output and the rest of its length. The last
+ *  sequence has literals only.
+ */
+#define COMPRESS_FRAME     (64 * 1024)
+#define LZ_HASH_BITS       12
+#define LZ_MIN_MATCH       4
+#define LZ_MAX_OFFSET      65535
+#define LZ_LAST_LITERALS   5
+#define LZ_MATCH_LIMIT     12       /* no match starts in the last bytes */
+
+void PutLength(char **out, int length)
+{
+    for (; length >= 255; length -= 255) *(*out)++ = (char) 255;
+    *(*out)++ = (char) length;
+}
+
+/*
+ *  Appends a sequence to the output ending at end; a sequence without a
+ *  match (length 0) is the last one. Returns 1 if it does not fit.
+ */
+int PutSequence(char **out, char *end, const char *literals, int literalCount, int offset, int length)
+{
+    char *token;
+    
+    if (end - *out < literalCount + literalCount / 255 + length / 255 + 5) return 1;
+    
+    token = (*out)++;
+    *token = (char) ((literalCount < 15 ? literalCount : 15) << 4);
+    if (literalCount >= 15) PutLength(out, literalCount - 15);
+    memcpy(*out, literals, literalCount);
+    *out += literalCount;
+    
+    if (length == 0) return 0;
+    
+    *(*out)++ = (char) (offset & 255);
+    *(*out)++ = (char) (offset >> 8);
+    
+    length -= LZ_MIN_MATCH;
+    *token |= (char) (length < 15 ? length : 15);
+    if (length >= 15) PutLength(out, length - 15);
+    return 0;
+}
+
+/*
+ *  Compresses size bytes into out. Returns the compressed size or 0 if
+ *  it does not fit in capacity bytes. Data which does not compress is
+ *  skipped faster and faster, so it costs little time.
+ */
+int Compress(const char *in, int size, char *out, int capacity)
+{
+    int table[1 << LZ_HASH_BITS];
+    char *op = out;
+    unsigned int word;
+    unsigned int hash;
+    
+    int anchor = 0;
+    int pos = 0;
+    int misses = 0;
+    int candidate;
+    int length;
+    int i;
+    
+    for (i = 0; i < (1 << LZ_HASH_BITS); ++i) table[i] = -1;
+    
+    while (pos < size - LZ_MATCH_LIMIT)
+    {
+        memcpy(&word, in + pos, 4);
+        hash = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        candidate = table[hash];
+        table[hash] = pos;
+        
+        if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0)
+        {
+            pos += 1 + (misses++ >> 6);
+            continue;
+        }
+        
+        length = LZ_MIN_MATCH;
+        while (pos + length < size - LZ_LAST_LITERALS && in[candidate + length] == in[pos + length]) length++;
+        
+        if (PutSequence(&op, out + capacity, in + anchor, pos - anchor, pos - candidate, length)) return 0;
+        pos += length;
+        anchor = pos;
+        misses = 0;
+    }
+    
+    if (PutSequence(&op, out + capacity, in + anchor, size - anchor, 0, 0)) return 0;
+    return (int) (op - out);
+}
+
+int GetLength(const char *in, int size, int *pos, int *length)
+{
+    unsigned char byte;
+    
+    do
+    {
+        if (*pos >= size) return 1;
+        byte = (unsigned char) in[(*pos)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+ *  Decompresses size bytes into out, which holds capacity bytes. Returns
+ *  the decompressed size or -1 if the data is damaged.
+ */
+int Decompress(const char *in, int size, char *out, int capacity)
+{
+    unsigned char token;
+    int pos = 0;
+    int done = 0;
+    int offset;
+    int length;
+    
+    while (pos < size)
+    {
+        token = (unsigned char) in[pos++];
+        
+        length = token >> 4;
+        if (length == 15 && GetLength(in, size, &pos, &length)) return -1;
+        if (length > size - pos || length > capacity - done) return -1;
+        memcpy(out + done, in + pos, length);
+        pos += length;
+        done += length;
+        
+        if (pos == size) break;
+        if (size - pos < 2) return -1;
+        
+        offset = (unsigned char) in[pos] | (unsigned char) in[pos + 1] << 8;
+        pos += 2;
+        
+        length = token & 15;
+        if (length == 15 && GetLength(in, size, &pos, &length)) return -1;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > done || length > capacity - done) return -1;
+        
+        /* an overlapping match repeats the bytes just written */
+        if (offset >= length) memcpy(out + done, out + done - offset, length);
+        else for (; length > 0; --length, ++done) out[done] = out[done - offset];
+        done += length;
+    }
+    
+    return done;
+}
+
+int GetFrames(long long fileSize)
+{
+    return (int) ((fileSize + COMPRESS_FRAME - 1) / COMPRESS_FRAME);
+}
+
+int GetFrameSize(long long fileSize, int index)
+{
+    long long left = fileSize - (long long) index * COMPRESS_FRAME;
+    return left < COMPRESS_FRAME ? (int) left : COMPRESS_FRAME;
+}
+
+long long GetFrameTableSize(long long fileSize)
+{
+    return sizeof(long long) * (long long) GetFrames(fileSize);
+}
+
+/*
+ *  Writes the compressed form of the file into a temporary file. Returns
+ *  it, with its size in storedSize, or NULL if it cannot be made.
+ */
+FILE *CompressFile(FILE *src, long long fileSize, long long *storedSize)
+{
+    FILE *packed = tmpfile();
+    long long *ends = malloc(GetFrameTableSize(fileSize) > 0 ? GetFrameTableSize(fileSize) : 1);
+    char *frame = malloc(COMPRESS_FRAME * 2);
+    
+    long long end = 0;
+    int frames = GetFrames(fileSize);
+    int size;
+    int stored;
+    int i;
+    
+    if (!packed || !ends || !frame)
+    {
+        if (packed) fclose(packed);
+        free(ends);
+        free(frame);
+        return NULL;
+    }
+    
+    fseeko(src, 0, SEEK_SET);
+    fseeko(packed, GetFrameTableSize(fileSize), SEEK_SET);
+    
+    for (i = 0; i < frames; ++i)
+    {
+        size = GetFrameSize(fileSize, i);
+        if ((int) fread(frame, 1, size, src) != size) break;
+        
+        /* only a frame which gets smaller is kept compressed */
+        stored = Compress(frame, size, frame + COMPRESS_FRAME, size - 1);
+        if (stored > 0) fwrite(frame + COMPRESS_FRAME, 1, stored, packed);
+        else            fwrite(frame, 1, stored = size, packed);
+        
+        end += stored;
+        ends[i] = end;
+    }
+    
+    if (i == frames)
+    {
+        fseeko(packed, 0, SEEK_SET);
+        fwrite(ends, sizeof(long long), frames, packed);
+    }
+    
+    free(ends);
+    free(frame);
+    
+    if (i < frames || fflush(packed) != 0 || ferror(packed))
+    {
+        fclose(packed);
+        return NULL;
+    }
+    
+    *storedSize = GetFrameTableSize(fileSize) + end;
+    return packed;
+}
+
+/*
+ *  Offsets in the data of a file are found with a list of the first
+ *  block of the file every extent holds (its last entry is the number
+ *  of blocks), searched by bisection. Returns the list, which has to be
+ *  freed by the caller, or NULL if there is not enough memory.
+ */
+int *IndexExtents(struct Extent *extents, int count)
+{
+    int *starts = malloc(sizeof(int) * (count + 1));
+    int i;
+    
+    if (!starts) return NULL;
+    
+    starts[0] = 0;
+    for (i = 0; i < count; ++i) starts[i + 1] = starts[i] + extents[i].length;
+    return starts;
+}
+
+/*
+ *  Gives the extent list of the file with the descriptor desc at index
+ *  and its index of starts, taken out of the cache of extent lists or
+ *  read from the disk. The lists belong to the caller, who frees them or
+ *  gives them back with KeepExtents. Returns the number of extents or -1
+ *  if there was not enough memory.
+ */
+int TakeExtents(struct DiskHandler *disk, int index, struct Descriptor *desc, struct Extent **extents, int **starts)
+{
+    struct CachedExtents *cached = &disk->lists[index & (EXTENT_CACHE_SIZE - 1)];
+    int count = desc->extentCount;
+    
+    if (cached->extents && cached->index == index && cached->count == count && cached->overflow == desc->overflow &&
+        memcmp(cached->extents, desc->extents, sizeof(struct Extent) * (count < DESC_EXTENTS ? count : DESC_EXTENTS)) == 0)
+    {
+        disk->extentHits++;
+        *extents = cached->extents;
+        *starts = cached->starts;
+        cached->extents = NULL;
+        cached->starts = NULL;
+        return count;
+    }
+    disk->extentMisses++;
+    
+    count = LoadExtents(disk, desc, extents);
+    if (count < 0) return -1;
+    
+    *starts = IndexExtents(*extents, count);
+    if (!*starts)
+    {
+        free(*extents);
+        return -1;
+    }
+    return count;
+}
+
+/*
+ *  Puts the extent list of the file with the descriptor desc at index and
+ *  its index of starts in the cache of extent lists, which frees them
+ *  later.
+ */
+void KeepExtents(struct DiskHandler *disk, int index, struct Descriptor *desc, struct Extent *extents, int *starts, int count)
+{
+    struct CachedExtents *cached = &disk->lists[index & (EXTENT_CACHE_SIZE - 1)];
+    
+    DropExtents(cached);
+    cached->extents = extents;
+    cached->starts = starts;
+    cached->index = index;
+    cached->count = count;
+    cached->overflow = desc->overflow;
+}
+
+/*
+ *  Address of the byte at offset in the data stored in the extents; left
+ *  is set to the number of bytes up to the end of its extent, 0 if the
+ *  offset lies past the extents.
+ */
+long long GetStoredAddr(struct Extent *extents, int *starts, int count, long long offset, long long *left)
+{
+    int low = 0;
+    int high = count - 1;
+    int middle;
+    
+    if (count == 0 || offset >= (long long) starts[count] * SIZE_BLOCK)
+    {
+        *left = 0;
+        return 0;
+    }
+    
+    while (low < high)
+    {
+        middle = (low + high + 1) / 2;
+        if ((long long) starts[middle] * SIZE_BLOCK <= offset) low = middle;
+        else high = middle - 1;
+    }
+    
+    offset -= (long long) starts[low] * SIZE_BLOCK;
+    *left = (long long) extents[low].length * SIZE_BLOCK - offset;
+    return GetBlockAddr(extents[low].start) + offset;
+}
+
+/*
+ *  Reads size bytes at offset of the data stored in the extents. It does
+ *  not use the position of the stream, so it is safe in worker threads.
+ *  Returns 0 on success.
+ */
+int ReadStored(struct DiskHandler *disk, struct Extent *extents, int *starts, int count, long long offset, char *buffer, int size)
+{
+    long long addr;
+    long long left;
+    double start;
+    int part;
+    
+    while (size > 0)
+    {
+        addr = GetStoredAddr(extents, starts, count, offset, &left);
+        if (left == 0) return 1;
+        
+        part = left < size ? (int) left : size;
+        if (disk->map)
+        {
+            start = StartIo();
+            memcpy(buffer, disk->map + addr, part);
+            CountIo(IO_MAP_READ, addr, part, start);
+        }
+        else if (ReadAt(fileno(disk->file), buffer, part, addr)) return 1;
+        
+        buffer += part;
+        offset += part;
+        size -= part;
+    }
+    
+    return 0;
+}
+
+/*
+ *  Reads like ReadStored, through the cache of blocks. A miss reads the
+ *  blocks the rest of the read needs and, while the disk is read
+ *  sequentially, a window of the following blocks of the extent which
+ *  doubles with every miss up to READ_AHEAD_LIMIT. Reads too large for
+ *  the cache take the blocks which are not cached from the disk directly.
+ */
+int ReadCached(struct DiskHandler *disk, struct Extent *extents, int *starts, int count, long long offset, char *buffer, int size)
+{
+    struct BlockCache *cache = &disk->cache;
+    long long addr;
+    long long left;
+    long long needed;
+    int block = -1;
+    int inBlock;
+    int wanted;
+    int run;
+    int entry;
+    int part;
+    
+    if (!InitBlockCache(disk)) return ReadStored(disk, extents, starts, count, offset, buffer, size);
+    
+    while (size > 0)
+    {
+        addr = GetStoredAddr(extents, starts, count, offset, &left);
+        if (left == 0) return 1;
+        
+        block = (int) ((addr - GetBlockAddr(0)) / SIZE_BLOCK);
+        inBlock = (int) ((addr - GetBlockAddr(0)) % SIZE_BLOCK);
+        part = SIZE_BLOCK - inBlock < size ? SIZE_BLOCK - inBlock : size;
+        
+        entry = FindCached(cache, block);
+        if (entry >= 0)
+        {
+            cache->hits++;
+            cache->entries[entry].referenced = 1;
+        }
+        else
+        {
+            /* blocks left in the extent and blocks of it the read needs */
+            left = (left + inBlock) / SIZE_BLOCK;
+            needed = (inBlock + (long long) size + SIZE_BLOCK - 1) / SIZE_BLOCK;
+            if (needed > left) needed = left;
+            
+            if (needed > cache->capacity / 4)
+            {
+                for (run = 1; run < needed && FindCached(cache, block + run) < 0; ++run);
+                
+                part = (long long) run * SIZE_BLOCK - inBlock < size ? (int) ((long long) run * SIZE_BLOCK - inBlock) : size;
+                if (ReadAt(fileno(disk->file), buffer, part, addr)) return 1;
+                cache->misses++;
+                
+                buffer += part;
+                offset += part;
+                size -= part;
+                block += (inBlock + part - 1) / SIZE_BLOCK;
+                continue;
+            }
+            
+            if (block != cache->nextBlock) cache->window = 1;
+            else if (cache->window < READ_AHEAD_LIMIT / SIZE_BLOCK) cache->window *= 2;
+            
+            wanted = needed > cache->window ? (int) needed : cache->window;
+            if (wanted > left) wanted = (int) left;
+            if (wanted > cache->capacity / 4) wanted = cache->capacity / 4;
+            
+            for (run = 1; run < wanted && FindCached(cache, block + run) < 0; ++run);
+            if (LoadCached(disk, block, run)) return 1;
+            if (run > needed) cache->readAhead += run - needed;
+            
+            entry = FindCached(cache, block);
+        }
+        
+        memcpy(buffer, GetCachedData(cache, entry) + inBlock, part);
+        
+        buffer += part;
+        offset += part;
+        size -= part;
+    }
+    
+    cache->nextBlock = block + 1;
+    return 0;
+}
+
+/*
+ *  Writes size bytes at offset of the data stored in the extents; with
+ *  data NULL the bytes are zeroed. Cached blocks are changed in the
+ *  cache, and so are whole blocks of writes small enough for it; the
+ *  rest is written in place. Returns 0 on success.
+ */
+int WriteStored(struct DiskHandler *disk, struct Extent *extents, int *starts, int count, long long offset, const char *data, long long size)
+{
+    static const char zeros[TABLE_PAGE];
+    struct BlockCache *cache = &disk->cache;
+    long long addr;
+    long long left;
+    int cached = InitBlockCache(disk) && size <= (long long) (cache->capacity / 4) * SIZE_BLOCK;
+    int inBlock;
+    int entry = -1;
+    int part;
+    
+    while (size > 0)
+    {
+        addr = GetStoredAddr(extents, starts, count, offset, &left);
+        if (left == 0) return 1;
+        
+        part = left < size ? (int) left : (int) size;
+        
+        if (cache->entries)
+        {
+            inBlock = (int) ((addr - GetBlockAddr(0)) % SIZE_BLOCK);
+            if (part > SIZE_BLOCK - inBlock) part = SIZE_BLOCK - inBlock;
+            
+            entry = FindCached(cache, (int) ((addr - GetBlockAddr(0)) / SIZE_BLOCK));
+            if (entry < 0 && cached && part == SIZE_BLOCK) entry = TakeCached(disk, (int) ((addr - GetBlockAddr(0)) / SIZE_BLOCK));
+        }
+        
+        if (entry >= 0)
+        {
+            if (data) memcpy(GetCachedData(cache, entry) + inBlock, data, part);
+            else memset(GetCachedData(cache, entry) + inBlock, 0, part);
+            
+            if (!cache->entries[entry].dirty) cache->dirty++;
+            cache->entries[entry].dirty = 1;
+            cache->entries[entry].referenced = 1;
+        }
+        else
+        {
+            if (!data && part > TABLE_PAGE) part = TABLE_PAGE;
+            WriteDisk(disk, addr, data ? data : zeros, part);
+        }
+        
+        if (data) data += part;
+        offset += part;
+        size -= part;
+    }
+    
+    return 0;
+}
+
+/*
+ *  Reads the stored range of a frame, [start, end) counted from the end
+ *  of the table, from the table itself.
+ */
+int ReadFrameEnds(struct DiskHandler *disk, struct Extent *extents, int *starts, int count, int index, long long *start, long long *end)
+{
+    long long ends[2];
+    
+    if (index == 0)
+    {
+        *start = 0;
+        return ReadStored(disk, extents, starts, count, 0, (char *) end, sizeof(long long));
+    }
+    
+    if (ReadStored(disk, extents, starts, count, sizeof(long long) * (long long) (index - 1), (char *) ends, sizeof(ends))) return 1;
+    *start = ends[0];
+    *end = ends[1];
+    return 0;
+}
+
+/*
+ *  Reads the frame of a compressed file, stored in [start, end), into
+ *  buffer, which must hold two frames. Returns 0 on success.
+ */
+int ReadFrame(struct DiskHandler *disk, struct Extent *extents, int *starts, int count, long long fileSize, int index,
+              long long start, long long end, char *buffer)
+{
+    long long stored = end - start;
+    int size = GetFrameSize(fileSize, index);
+    
+    start += GetFrameTableSize(fileSize);
+    
+    if (stored <= 0 || stored > size) return 1;
+    if (stored == size) return ReadStored(disk, extents, starts, count, start, buffer, size);
+    
+    if (ReadStored(disk, extents, starts, count, start, buffer + COMPRESS_FRAME, (int) stored)) return 1;
+    return Decompress(buffer + COMPRESS_FRAME, (int) stored, buffer, size) != size;
+}
+
+/*
+ *  Decompression of a whole file: the frames are handed out to a pool
+ *  of workers, each one reads and decompresses its frames and writes
+ *  them at their place in the external file with pwrite.
+ */
+struct FrameJob
+{
+    struct DiskHandler *disk;
+    struct Extent *extents;
+    int *starts;
+    int count;
+    long long *ends;
+    long long fileSize;
+    int frames;
+    int out;
+    
+    int next;
+    int failed;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_t lock;
+#endif
+};
+
+/*
+ *  Returns the next frame to decompress, or the number of frames when
+ *  there is nothing left; failed stops the job.
+ */
+int TakeFrame(struct FrameJob *job, int failed)
+{
+    int i;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_lock(&job->lock);
+#endif
+    if (failed) job->failed = 1;
+    i = job->failed ? job->frames : job->next++;
+#ifdef PARALLEL_COPY
+    pthread_mutex_unlock(&job->lock);
+#endif
+
+    return i < job->frames ? i : job->frames;
+}
+
+void *FrameWorker(void *arg)
+{
+    struct FrameJob *job = arg;
+    char *buffer = malloc(COMPRESS_FRAME * 2);
+    int failed = !buffer;
+    int i;
+    
+    while ((i = TakeFrame(job, failed)) < job->frames)
+    {
+        failed = ReadFrame(job->disk, job->extents, job->starts, job->count, job->fileSize, i, i > 0 ? job->ends[i - 1] : 0, job->ends[i], buffer) ||
+                 WriteAt(job->out, buffer, GetFrameSize(job->fileSize, i), (long long) i * COMPRESS_FRAME);
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+/*
+ *  Writes the decompressed data of a DESC_COMPRESSED file to the file,
+ *  with COPY_THREADS workers. Returns 0 on success.
+ */
+int DecompressExtents(struct DiskHandler *disk, FILE *file, struct Extent *extents, int count, struct Descriptor *desc)
+{
+    struct FrameJob job;
+    
+    job.disk = disk;
+    job.extents = extents;
+    job.count = count;
+    job.fileSize = desc->fileSize;
+    job.frames = GetFrames(desc->fileSize);
+    job.out = fileno(file);
+    job.next = 0;
+    job.failed = 0;
+    
+    job.starts = IndexExtents(extents, count);
+    job.ends = malloc(GetFrameTableSize(desc->fileSize));
+    if (!job.starts || !job.ends)
+    {
+        free(job.starts);
+        free(job.ends);
+        return 1;
+    }
+    
+    /* the workers read the disk and write the file past their streams */
+    fflush(file);
+    if (!disk->map) fflush(disk->file);
+    
+    if (ReadStored(disk, extents, job.starts, count, 0, (char *) job.ends, (int) GetFrameTableSize(desc->fileSize)))
+        job.failed = 1;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_init(&job.lock, NULL);
+    if (!job.failed) RunWorkers(FrameWorker, &job, COPY_THREADS < job.frames ? COPY_THREADS : job.frames);
+    pthread_mutex_destroy(&job.lock);
+#else
+    if (!job.failed) FrameWorker(&job);
+#endif
+
+    free(job.starts);
+    free(job.ends);
+    return job.failed;
+}
+
+/*
+ *  Journal: the metadata changed by an operation is first appended to the
+ *  journal region as one transaction - a JournalTransaction header
+ *  followed by JournalRecords, each one with the bytes to be written at
+ *  its address - and the disk is synced. Only then the metadata is
+ *  written in place, without waiting for it.
+ *
+ *  The disk is synced before every transaction too, so the data of the
+ *  files it refers to is on the disk before it, and so is everything the
+ *  transactions before it wrote in place. The checkpoint in the header
+ *  (journalStart) then moves to the new transaction: replay starts there
+ *  and goes on while the transactions found have a valid checksum and the
+ *  next sequence number. A header written in place without the pages of
+ *  its transaction thus still leads replay to them. A record which is on
+ *  the disk already is not written again, so replaying a transaction
+ *  which did reach the disk costs no writes.
+ */
+#define JOURNAL_MAGIC  0x4a524e4cu
+
+struct JournalTransaction
+{
+    unsigned int magic;
+    int sequence;
+    int count;
+    int size;
+    unsigned int checksum;
+};
+
+struct JournalRecord
+{
+    long long addr;
+    int size;
+};
+
+unsigned int Checksum(const char *data, int size)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+    
+    for (i = 0; i < size; ++i)
+    {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ *  Syncs everything written to the disk so far.
+ */
+int FlushDisk(struct DiskHandler *disk)
+{
+    double start = StartIo();
+    int result;
+    
+    if (disk->map && msync(disk->map, disk->mapSize, MS_SYNC)) return 1;
+    if (!disk->map && fflush(disk->file)) return 1;
+    result = fsync(fileno(disk->file)) != 0;
+    
+    CountIo(IO_SYNC, 0, 0, start);
+    return result;
+}
+
+/*
+ *  Appends a record to the transaction being built at buffer + *used,
+ *  or only counts its size if buffer is NULL.
+ */
+void AddJournalRecord(char *buffer, int *used, int *count, long long addr, const void *data, int size)
+{
+    struct JournalRecord record;
+    
+    if (buffer)
+    {
+        record.addr = addr;
+        record.size = size;
+        memcpy(buffer + *used, &record, sizeof(struct JournalRecord));
+        memcpy(buffer + *used + sizeof(struct JournalRecord), data, size);
+    }
+    
+    *used += sizeof(struct JournalRecord) + size;
+    (*count)++;
+}
+
+/*
+ *  Adds all dirty pages of the cached metadata and the header to the
+ *  transaction; returns its size.
+ */
+int BuildTransaction(struct DiskHandler *disk, char *buffer, int *count)
+{
+    struct Table *tables[METADATA_TABLES];
+    int used = sizeof(struct JournalTransaction);
+    int run;
+    int i;
+    int j;
+    
+    *count = 0;
+    
+    for (j = 0; j < GetMetadataTables(disk, tables); ++j)
+    {
+        struct Table *table = tables[j];
+        
+        if (!table->pages) continue;
+        
+        for (i = 0; i < GetTablePages(table); ++i)
+        {
+            int first = i * table->perPage;
+            int records = table->count - first < table->perPage ? table->count - first : table->perPage;
+            
+            /* a page spanning parts of the table takes a record for each of them */
+            while (table->dirty[i] && records > 0)
+            {
+                long long addr = GetRecordAddr(table, first, &run);
+                if (run > records) run = records;
+                
+                AddJournalRecord(buffer, &used, count, addr, table->pages[i] + (first - i * table->perPage) * table->recordSize, run * table->recordSize);
+                first += run;
+                records -= run;
+            }
+        }
+    }
+    
+    AddJournalRecord(buffer, &used, count, 0, &disk->header, sizeof(struct Header));
+    return used;
+}
+
+/*
+ *  Commits the dirty metadata through the journal and then writes it
+ *  in place. Returns 0 on success.
+ */
+int CommitJournal(struct DiskHandler *disk)
+{
+    struct JournalTransaction transaction;
+    struct Header onDisk;
+    
+    int count;
+    int size = BuildTransaction(disk, NULL, &count);
+    int result;
+    
+    char *buffer;
+    
+    if (size > JOURNAL_SIZE)
+    {
+        printf("Journal of the disk %s is too small\n", disk->name);
+        return 1;
+    }
+    
+    buffer = malloc(size);
+    if (!buffer)
+    {
+        printf("Not enough memory to write the journal of the disk %s\n", disk->name);
+        return 1;
+    }
+    
+    if (disk->header.journalTail + size > JOURNAL_SIZE)
+    {
+        /* everything before is on the disk (see SyncDisk), so the journal starts again once the header says so */
+        ReadDisk(disk, 0, &onDisk, sizeof(struct Header));
+        onDisk.journalTail = 0;
+        onDisk.journalStart = 0;
+        onDisk.startSequence = disk->header.journalSequence;
+        
+        WriteDisk(disk, 0, &onDisk, sizeof(struct Header));
+        result = FlushDisk(disk);
+        
+        if (result)
+        {
+            free(buffer);
+            return 1;
+        }
+        disk->header.journalTail = 0;
+        disk->header.journalStart = 0;
+    }
+    
+    transaction.magic = JOURNAL_MAGIC;
+    transaction.sequence = disk->header.journalSequence;
+    transaction.count = count;
+    transaction.size = size;
+    
+    disk->header.generation++;
+    disk->header.journalTail += size;
+    disk->header.journalSequence++;
+    
+    BuildTransaction(disk, buffer, &count);
+    transaction.checksum = Checksum(buffer + sizeof(struct JournalTransaction), size - sizeof(struct JournalTransaction));
+    memcpy(buffer, &transaction, sizeof(struct JournalTransaction));
+    
+    WriteDisk(disk, GetJournalAddr(disk->header.journalTail - size), buffer, size);
+    free(buffer);
+    
+    return FlushDisk(disk);
+}
+
+/*
+ *  Replays the transactions which were committed but may not have been
+ *  written in place. Returns the number of replayed transactions.
+ */
+int ReplayJournal(struct DiskHandler *disk)
+{
+    struct JournalTransaction transaction;
+    struct JournalRecord record;
+    struct Header header;
+    
+    int replayed = 0;
+    int written;
+    int position;
+    int sequence;
+    int used;
+    int i;
+    
+    char *buffer;
+    char *current;
+    
+    ReadDisk(disk, 0, &header, sizeof(struct Header));
+    SelectJournal(&header);
+    position = header.journalStart;
+    sequence = header.startSequence;
+    
+    while (position >= 0 && position + (int) sizeof(struct JournalTransaction) <= JOURNAL_SIZE)
+    {
+        ReadDisk(disk, GetJournalAddr(position), &transaction, sizeof(struct JournalTransaction));
+        
+        if (transaction.magic != JOURNAL_MAGIC || transaction.sequence != sequence) break;
+        if (transaction.size < (int) sizeof(struct JournalTransaction) || position + transaction.size > JOURNAL_SIZE) break;
+        
+        buffer = malloc(transaction.size);
+        current = malloc(transaction.size);
+        if (!buffer || !current)
+        {
+            free(buffer);
+            free(current);
+            break;
+        }
+        
+        ReadDisk(disk, GetJournalAddr(position), buffer, transaction.size);
+        if (Checksum(buffer + sizeof(struct JournalTransaction), transaction.size - sizeof(struct JournalTransaction)) != transaction.checksum)
+        {
+            free(buffer);
+            free(current);
+            break;
+        }
+        
+        written = 0;
+        used = sizeof(struct JournalTransaction);
+        for (i = 0; i < transaction.count; ++i)
+        {
+            memcpy(&record, buffer + used, sizeof(struct JournalRecord));
+            used += sizeof(struct JournalRecord);
+            
+            /* records go to the tables laid out with the disk or to the segments */
+            if (record.addr >= 0 && record.size >= 0 && used + record.size <= transaction.size &&
+                (record.addr + record.size <= GetMetadataEnd() || record.addr >= GetBlockAddr(0)))
+            {
+                ReadDisk(disk, record.addr, current, record.size);
+                if (memcmp(current, buffer + used, record.size) != 0)
+                {
+                    WriteDisk(disk, record.addr, buffer + used, record.size);
+                    written = 1;
+                }
+            }
+            used += record.size;
+        }
+        
+        free(buffer);
+        free(current);
+        replayed += written;
+        
+        position += transaction.size;
+        sequence++;
+    }
+    
+    if (replayed) FlushDisk(disk);
+    return replayed;
+}
+
+/*
+ *  Maps the image again if it has grown past the mapped part.
+ */
+void RemapDisk(struct DiskHandler *disk)
+{
+    struct stat st;
+    void *map;
+    
+    if (!disk->map || fstat(fileno(disk->file), &st) != 0 || st.st_size <= disk->mapSize) return;
+    
+    map = mmap(NULL, st.st_size, disk->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileno(disk->file), 0);
+    if (map == MAP_FAILED) return;
+    
+    munmap(disk->map, disk->mapSize);
+    disk->map = map;
+    disk->mapSize = st.st_size;
+}
+
+/*
+ *  Adds the records of the segment to the tables. Returns 1 if there is
+ *  no memory for them.
+ */
+int AddSegmentTables(struct DiskHandler *disk, struct Segment *segment)
+{
+    struct BlockMap *map = &disk->blocks;
+    int end = segment->firstMapBlock + segment->mapBlocks;
+    
+    if (segment->files)
+    {
+        if (GrowTable(disk, &disk->descriptors, segment->firstFile + segment->files, segment->descriptors)) return 1;
+        if (GrowTable(disk, &disk->packs, segment->firstFile + 1 + segment->files, segment->packs)) return 1;
+    }
+    
+    if (segment->hashSize && GrowTable(disk, &disk->slots, segment->firstSlot + segment->hashSize, segment->slots)) return 1;
+    
+    if (segment->mapBlocks)
+    {
+        if (GrowTable(disk, &disk->refs, end, segment->refs)) return 1;
+        if (GetMapWords(end) > map->words.count && GrowTable(disk, &map->words, GetMapWords(end), segment->words)) return 1;
+        if (GetMapPages(end) > map->summary.count && GrowTable(disk, &map->summary, GetMapPages(end), segment->summary)) return 1;
+        map->count = map->words.count;
+    }
+    return 0;
+}
+
+void FreeLayout(struct DiskHandler *disk)
+{
+    struct Table *tables[METADATA_TABLES];
+    int i;
+    
+    for (i = 0; i < GetMetadataTables(disk, tables); ++i) FreeTableParts(tables[i]);
+    
+    free(disk->segments);
+    disk->segments = NULL;
+    disk->segmentCount = 0;
+}
+
+/*
+ *  Sets up the tables of the disk: the ones laid out when it was created
+ *  and the segments chained by resizing it. Any cached metadata must have
+ *  been dropped. Returns 0 on success.
+ */
+int LoadLayout(struct DiskHandler *disk)
+{
+    int block = disk->header.lastSegment;
+    int i;
+    
+    FreeLayout(disk);
+    
+    InitTable(&disk->descriptors, GetDescriptorAddr(0), GetDescriptorSize(SIZE_FILENAME), BASE_FILES, TABLE_CACHE_PAGES);
+    InitTable(&disk->slots, GetHashSlotAddr(0), sizeof(struct HashSlot), HASH_SIZE, TABLE_CACHE_PAGES);
+    InitTable(&disk->packs, GetPackAddr(0), sizeof(struct Pack), BASE_FILES + 1, TABLE_CACHE_PAGES);
+    InitTable(&disk->refs, GetRefsAddr(0), sizeof(unsigned short), BASE_MAP_BLOCKS, MAP_CACHE_PAGES);
+    InitTable(&disk->dedup, GetDedupAddr(0), sizeof(struct DedupSlot), DEDUP_SIZE, TABLE_CACHE_PAGES);
+    InitBlockMap(disk, &disk->blocks);
+    
+    if (disk->header.segments == 0) return 0;
+    
+    disk->segments = malloc(disk->header.segments * sizeof(struct Segment));
+    if (!disk->segments)
+    {
+        printf("Not enough memory to mount the disk %s\n", disk->name);
+        return 7;
+    }
+    
+    /* the chain goes from the last segment back */
+    for (i = disk->header.segments - 1; i >= 0; --i)
+    {
+        if (block < 0 || block >= LIMIT_BLOCKS)
+        {
+            printf("Segments of the disk %s are damaged\n", disk->name);
+            FreeLayout(disk);
+            return 2;
+        }
+        
+        ReadDisk(disk, GetBlockAddr(block), &disk->segments[i], sizeof(struct Segment));
+        block = disk->segments[i].previous;
+    }
+    
+    for (i = 0; i < disk->header.segments; ++i)
+    {
+        disk->segmentCount = i + 1;
+        if (AddSegmentTables(disk, &disk->segments[i]))
+        {
+            printf("Not enough memory to mount the disk %s\n", disk->name);
+            FreeLayout(disk);
+            return 7;
+        }
+    }
+    return 0;
+}
+
+int MountDisk(const char *diskName, int writable, struct DiskHandler **result)
+{
+    struct DiskHandler *disk;
+    struct Header header;
+    int status;
+    double start = StartIo();
+    
+    FILE *file = fopen(diskName, writable ? "r+b" : "rb");
+    
+    *result = NULL;
+    
+    if (!file)
+    {
+        printf("Cannot open the disk %s\n", diskName);
+        return 1;
+    }
+    
+    if (fread(&header, sizeof(struct Header), 1, file) != 1) header.version = 0;
+    CountIo(IO_READ, 0, sizeof(struct Header), start);
+    if (header.version != VERSION)
+    {
+        printf("Disk was configurated for a different version of file system (%d vs %d)\n", header.version, VERSION);
+        fclose(file);
+        return 2;
+    }
+    
+    if (header.nameSize < MIN_SIZE_FILENAME || header.nameSize > MAX_SIZE_FILENAME || header.blockSize < MIN_SIZE_BLOCK)
+    {
+        printf("Disk %s has an invalid geometry\n", diskName);
+        fclose(file);
+        return 2;
+    }
+    
+    disk = calloc(1, sizeof(struct DiskHandler));
+    if (disk) disk->name = malloc(strlen(diskName) + 1);
+    if (!disk || !disk->name)
+    {
+        printf("Not enough memory to mount the disk %s\n", diskName);
+        free(disk);
+        fclose(file);
+        return 7;
+    }
+    
+    strcpy(disk->name, diskName);
+    disk->file = file;
+    disk->map = NULL;
+    disk->writable = writable;
+    disk->header = header;
+    disk->headerDirty = 0;
+    disk->locks = 0;
+    
+    SelectDisk(disk);
+    
+    if (DISK_BACKEND == DISK_MMAP)
+    {
+        struct stat st;
+        int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+        
+        /* if the image cannot be mapped the stdio backend is used */
+        if (fstat(fileno(file), &st) == 0 && st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fileno(file), 0);
+            if (map != MAP_FAILED)
+            {
+                disk->map = map;
+                disk->mapSize = st.st_size;
+            }
+        }
+    }
+    
+    status = LoadLayout(disk);
+    if (status)
+    {
+        if (disk->map) munmap(disk->map, disk->mapSize);
+        fclose(file);
+        free(disk->name);
+        free(disk);
+        return status;
+    }
+    
+    *result = disk;
+    return 0;
+}
+
+/*
+ *  Writes all cached blocks and metadata back to the disk: the dirty
+ *  blocks of files first, then the metadata is committed to the journal
+ *  and descriptors, index, map of blocks and the header as the last one
+ *  are written in place.
+ */
+int SyncDisk(struct DiskHandler *disk)
+{
+    struct Table *tables[METADATA_TABLES];
+    int i;
+    
+    SelectDisk(disk);
+    if (disk->writable) FlushBlockCache(disk);
+    
+    if (!disk->writable || !disk->headerDirty) return 0;
+    
+    /* the data of the files and what the transactions before wrote in place reach the disk first */
+    if (FlushDisk(disk)) return 1;
+    disk->header.journalStart = disk->header.journalTail;
+    disk->header.startSequence = disk->header.journalSequence;
+    
+    if (CommitJournal(disk)) return 1;
+    CheckCrashPoint(disk, CRASH_JOURNAL);
+    
+    /* a test of the replay writes the header first, as if the pages written after it were lost */
+    if (CRASH_POINT == CRASH_HEADER) WriteDisk(disk, 0, &disk->header, sizeof(struct Header));
+    CheckCrashPoint(disk, CRASH_HEADER);
+    
+    for (i = 0; i < GetMetadataTables(disk, tables); ++i) SaveTable(disk, tables[i]);
+    WriteDisk(disk, 0, &disk->header, sizeof(struct Header));
+    disk->headerDirty = 0;
+    
+    if (disk->map) return 0;
+    return fflush(disk->file) != 0;
+}
+
+int DiskCacheStats(struct DiskHandler *disk, struct CacheStats *stats)
+{
+    struct Table *tables[METADATA_TABLES];
+    int i;
+    
+    memset(stats, 0, sizeof(struct CacheStats));
+    
+    stats->blockHits = disk->cache.hits;
+    stats->blockMisses = disk->cache.misses;
+    stats->readAhead = disk->cache.readAhead;
+    stats->writeBacks = disk->cache.writeBacks;
+    stats->evictions = disk->cache.evictions;
+    stats->cachedBlocks = disk->cache.entries ? disk->cache.used : 0;
+    stats->pathHits = disk->pathHits;
+    stats->pathMisses = disk->pathMisses;
+    stats->extentHits = disk->extentHits;
+    stats->extentMisses = disk->extentMisses;
+    
+    for (i = 0; i < GetMetadataTables(disk, tables); ++i)
+    {
+        stats->metadataHits += tables[i]->hits;
+        stats->metadataMisses += tables[i]->misses;
+        stats->metadataPages += tables[i]->cached;
+    }
+    return 0;
+}
+
+void ReportCache(struct DiskHandler *disk)
+{
+    struct CacheStats stats;
+    
+    DiskCacheStats(disk, &stats);
+    printf("Cache of %s: blocks %lld hits, %lld misses, %lld read ahead, %lld written back, %lld evicted; metadata %lld hits, %lld misses; paths %lld hits, %lld misses; extent lists %lld hits, %lld misses\n",
+           disk->name, stats.blockHits, stats.blockMisses, stats.readAhead, stats.writeBacks, stats.evictions,
+           stats.metadataHits, stats.metadataMisses, stats.pathHits, stats.pathMisses, stats.extentHits, stats.extentMisses);
+}
+
+int UnmountDisk(struct DiskHandler *disk)
+{
+    int result = SyncDisk(disk);
+    
+    if (CACHE_REPORT) ReportCache(disk);
+    
+    FreeMetadata(disk);
+    FreeLayout(disk);
+    FreeBlockCache(disk);
+    ClearPathCache(disk);
+    ClearExtentCache(disk);
+    
+    if (disk->map) munmap(disk->map, disk->mapSize);
+    if (fclose(disk->file)) result = 1;
+    
+    free(disk->name);
+    free(disk);
+    return result;
+}
+
+/*
+ *  Locking: the metadata (header, descriptors, name index and map of
+ *  blocks) is guarded by a byte-range lock on its region of the image,
+ *  shared for readers and exclusive for writers. Every operation takes
+ *  it, compares the generation of the header with the one it cached and
+ *  drops its cached metadata if another process has changed the disk in
+ *  the meantime. File data is guarded by locks on the extents of the
+ *  file, so exports go on while other files are being inserted, and
+ *  a file is not released while it is being exported.
+ *
+ *  The metadata lock can be taken again by the holder, e.g. a batch which
+ *  keeps it for all its files; the cached metadata is synced only when the
+ *  outermost lock is released. Where open file description locks exist
+ *  (Linux) the locks belong to the mounted disk, so the threads of a
+ *  process can each mount the disk and use it at once, e.g. the FUSE
+ *  daemon; elsewhere they belong to the process, which then must not
+ *  mount a disk twice.
+ *
+ *  The writer of a reserved descriptor holds the byte OWNER_LOCKS + index
+ *  until the file is committed or cancelled, far past the end of the image;
+ *  a reservation whose byte nobody holds was left by a crashed process.
+ */
+#define OWNER_LOCKS     (1LL << 60)
+
+int LockRange(struct DiskHandler *disk, int type, long long start, long long length)
+{
+    struct flock lock;
+    
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = length;
+
+#ifdef F_OFD_SETLKW
+    while (fcntl(fileno(disk->file), F_OFD_SETLKW, &lock) != 0)
+        if (errno != EINTR) return 1;
+#else
+    while (fcntl(fileno(disk->file), F_SETLKW, &lock) != 0)
+        if (errno != EINTR) return 1;
+#endif
+    return 0;
+}
+
+/*
+ *  Returns 1 if another mounted disk (another process, where open file
+ *  description locks do not exist) holds a lock on the byte at addr.
+ */
+int IsRangeLocked(struct DiskHandler *disk, long long addr)
+{
+    struct flock lock;
+    
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = addr;
+    lock.l_len = 1;
+
+#ifdef F_OFD_GETLK
+    if (fcntl(fileno(disk->file), F_OFD_GETLK, &lock) != 0) return 1;
+#else
+    if (fcntl(fileno(disk->file), F_GETLK, &lock) != 0) return 1;
+#endif
+    return lock.l_type != F_UNLCK;
+}
+
+int LockMetadata(struct DiskHandler *disk, int exclusive)
+{
+    struct Header header;
+    
+    /* an operation nested in another one reads the blocks the outer one wrote */
+    if (disk->locks++ > 0)
+    {
+        FlushBlockCache(disk);
+        return 0;
+    }
+    
+    if (LockRange(disk, exclusive ? F_WRLCK : F_RDLCK, 0, GetBlockAddr(0)))
+    {
+        printf("Cannot lock the disk %s\n", disk->name);
+        disk->locks--;
+        return 10;
+    }
+    
+    /* data buffered by the stream may be older than the lock */
+    if (!disk->map) fflush(disk->file);
+    
+    /* a writer finishes what a crashed process has committed */
+    if (exclusive && disk->writable && ReplayJournal(disk) > 0)
+        printf("Recovered the journal of the disk %s\n", disk->name);
+    
+    ReadDisk(disk, 0, &header, sizeof(struct Header));
+    if (header.generation != disk->header.generation)
+    {
+        FreeMetadata(disk);
+        ClearBlockCache(disk);
+        ClearPathCache(disk);
+        ClearExtentCache(disk);
+    }
+    
+    disk->header = header;
+    SelectDisk(disk);
+    
+    /* another process may have resized the disk */
+    RemapDisk(disk);
+    if (disk->segmentCount != header.segments && LoadLayout(disk))
+    {
+        LockRange(disk, F_UNLCK, 0, GetBlockAddr(0));
+        disk->locks--;
+        return 10;
+    }
+    return 0;
+}
+
+int UnlockMetadata(struct DiskHandler *disk)
+{
+    int result;
+    
+    if (--disk->locks > 0) return 0;
+    
+    result = SyncDisk(disk);
+    LockRange(disk, F_UNLCK, 0, GetBlockAddr(0));
+    return result;
+}
+
+/*
+ *  Releases the locks of file data; the locks of the owners of reserved
+ *  descriptors (see ReserveFile) lie past them and are kept.
+ */
+void UnlockExtents(struct DiskHandler *disk)
+{
+    LockRange(disk, F_UNLCK, GetBlockAddr(0), OWNER_LOCKS - GetBlockAddr(0));
+}
+
+int LockExtents(struct DiskHandler *disk, int exclusive, struct Extent *list, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        if (LockRange(disk, exclusive ? F_WRLCK : F_RDLCK, GetBlockAddr(list[i].start), (long long) list[i].length * SIZE_BLOCK))
+        {
+            printf("Cannot lock the blocks of a file in the disk %s\n", disk->name);
+            UnlockExtents(disk);
+            return 10;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Locks the blocks first to last of a file (counted from its first
+ *  block, starts is the index of its extents) like LockExtents, so a
+ *  change of a few blocks of a fragmented file does not lock all its
+ *  extents.
+ */
+int LockBlocks(struct DiskHandler *disk, int exclusive, struct Extent *list, int *starts, int count, int first, int last)
+{
+    struct Extent run;
+    int low = 0;
+    int high = count;
+    int middle;
+    int i;
+    
+    while (high - low > 1)
+    {
+        middle = (low + high) / 2;
+        if (starts[middle] <= first) low = middle;
+        else high = middle;
+    }
+    
+    for (i = low; i < count && starts[i] <= last; ++i)
+    {
+        run = list[i];
+        if (starts[i] < first)
+        {
+            run.start += first - starts[i];
+            run.length -= first - starts[i];
+        }
+        if (starts[i + 1] > last + 1) run.length -= starts[i + 1] - last - 1;
+        if (run.length > 0 && LockExtents(disk, exclusive, &run, 1)) return 10;
+    }
+    return 0;
+}
+
+/*
+ *  Locks the tail of a DESC_PACKED file at addr, like LockExtents; only
+ *  its bytes are locked, so the other files of the pack are not blocked.
+ */
+int LockTail(struct DiskHandler *disk, int exclusive, struct Descriptor *desc, long long addr)
+{
+    if (!(desc->flags & DESC_PACKED)) return 0;
+    
+    if (LockRange(disk, exclusive ? F_WRLCK : F_RDLCK, addr, GetTailSize(desc)))
+    {
+        printf("Cannot lock the blocks of a file in the disk %s\n", disk->name);
+        UnlockExtents(disk);
+        return 10;
+    }
+    return 0;
+}
+
+/*
+ *  Blocks planned for a file being inserted or changed: its extents,
+ *  which of them were stored already (blocks shared with stored files,
+ *  or blocks the changed file keeps) and the hashes of its first hashed
+ *  blocks (the full ones), if it is deduplicated.
+ */
+struct BlockPlan
+{
+    struct Extent *extents;
+    char *shared;
+    int count;
+    int capacity;
+    
+    unsigned int *hashes;
+    int hashed;
+};
+
+void FreePlan(struct BlockPlan *plan)
+{
+    free(plan->extents);
+    free(plan->shared);
+    free(plan->hashes);
+    memset(plan, 0, sizeof(struct BlockPlan));
+}
+
+/*
+ *  Appends the run to the plan, joining it with the last extent if it
+ *  follows it and is shared in the same way. Returns 0 on success.
+ */
+int AddPlannedRun(struct BlockPlan *plan, struct Extent run, int shared)
+{
+    struct Extent *last = plan->count > 0 ? &plan->extents[plan->count - 1] : NULL;
+    
+    if (last && last->start + last->length == run.start && plan->shared[plan->count - 1] == shared)
+    {
+        last->length += run.length;
+        return 0;
+    }
+    
+    if (plan->count == plan->capacity)
+    {
+        int capacity = plan->capacity > 0 ? plan->capacity * 2 : 8;
+        struct Extent *extents = realloc(plan->extents, sizeof(struct Extent) * capacity);
+        char *flags;
+        
+        if (!extents) return 1;
+        plan->extents = extents;
+        
+        flags = realloc(plan->shared, capacity);
+        if (!flags) return 1;
+        plan->shared = flags;
+        
+        plan->capacity = capacity;
+    }
+    
+    plan->extents[plan->count] = run;
+    plan->shared[plan->count] = (char) shared;
+    plan->count++;
+    return 0;
+}
+
+/*
+ *  Allocates blocks new blocks at the end of the plan. Returns 0 on
+ *  success; on failure the new blocks of the plan are left for
+ *  ReleaseNewBlocks.
+ */
+int AddNewBlocks(struct BlockMap *map, struct Header *header, struct BlockPlan *plan, int blocks)
+{
+    struct Extent run;
+    int done;
+    
+    for (done = 0; done < blocks; done += run.length)
+    {
+        run.start = AllocateBlocks(map, blocks - done, &run.length);
+        if (run.start < 0) return 3;
+        
+        header->usedBlocks += run.length;
+        if (AddPlannedRun(plan, run, 0))
+        {
+            MarkBlocks(map, run.start, run.length, 0);
+            header->usedBlocks -= run.length;
+            return 7;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Releases the blocks of the plan which were not stored before, for a
+ *  change of a file which cannot be done.
+ */
+void ReleaseNewBlocks(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct BlockPlan *plan)
+{
+    int i;
+    
+    for (i = 0; i < plan->count; ++i)
+        if (!plan->shared[i]) header->usedBlocks -= ReleaseRun(disk, map, header, plan->extents[i]);
+}
+
+/*
+ *  First step of inserting a file, done with the metadata locked: the
+ *  blocks for the file and its extent list are allocated and a free
+ *  descriptor is taken off the free list, so that other writers do not
+ *  use them while the data is being copied. The descriptor stays unused
+ *  and the file is invisible until CommitFile; it is written DESC_RESERVED
+ *  with the extents, and its owner lock is held until CommitFile or
+ *  CancelFile, so ReclaimFiles gives everything back if the process dies
+ *  in between.
+ *
+ *  Blocks of the file which are already stored (see FindDuplicate) are
+ *  not allocated; the file refers to the stored ones, which get their
+ *  reference here so they cannot be freed in the meantime. The new
+ *  blocks get theirs only in CommitFile, so no other file is pointed at
+ *  them before they hold their data. buffer must hold two blocks.
+ */
+int ReserveFile(struct DiskHandler *disk, const char *path, const char *newName, long long fileSize, struct Descriptor *newDescriptor,
+                struct BlockPlan *plan, FILE *src, char *buffer, int *freeIndex)
+{
+    struct Header header = disk->header;
+    struct Descriptor desc;
+    struct BlockMap *map;
+    struct Extent run;
+    
+    int slotIndex;
+    int overflowBlocks = -1;
+    long long blockBytes = fileSize - GetTailSize(newDescriptor);
+    int fileBlocks = (int) ((blockBytes + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    int newBlocks = fileBlocks;
+    int *dups = NULL;
+    int shared;
+    int want;
+    int i;
+    
+    if (FindDescriptor(disk, newName, &desc, &slotIndex) >= 0)
+    {
+        printf("File %s already exists in the disc %s\n", newName, disk->name);
+        return 4;
+    }
+    
+    if (slotIndex < 0)
+    {
+        printf("Directory of %s does not exist in the disk %s\n", newName, disk->name);
+        return 3;
+    }
+    
+    /* freed descriptors are reused first, then the ones never used */
+    *freeIndex = header.freeDescriptor;
+    if (*freeIndex < 0 && header.descriptorWatermark < LIMIT_FILES) *freeIndex = header.descriptorWatermark;
+    if (*freeIndex < 0)
+    {
+        printf("No free descriptors left in the disk %s\n", disk->name);
+        return 6;
+    }
+    
+    if (LockRange(disk, F_WRLCK, OWNER_LOCKS + *freeIndex, 1))
+    {
+        printf("Cannot lock the disk %s\n", disk->name);
+        return 10;
+    }
+    
+    map = GetBlockMap(disk);
+    if (!map)
+    {
+        printf("Not enough memory to insert the file %s\n", path);
+        LockRange(disk, F_UNLCK, OWNER_LOCKS + *freeIndex, 1);
+        return 7;
+    }
+    
+    /* without the list of duplicates every block is simply a new one */
+    if (plan->hashes) dups = malloc(sizeof(int) * (plan->hashed > 0 ? plan->hashed : 1));
+    for (i = 0; dups && i < plan->hashed; ++i)
+    {
+        dups[i] = FindDuplicate(disk, plan->hashes[i], src, (long long) i * SIZE_BLOCK, buffer);
+        if (dups[i] >= 0) newBlocks--;
+    }
+    
+    if (newBlocks > LIMIT_BLOCKS - header.usedBlocks)
+    {
+        printf("No enough space for the file %s\n", path);
+        LockRange(disk, F_UNLCK, OWNER_LOCKS + *freeIndex, 1);
+        free(dups);
+        return 3;
+    }
+    
+    for (i = 0; i < fileBlocks; i += run.length)
+    {
+        shared = dups && i < plan->hashed && dups[i] >= 0;
+        
+        if (shared)
+        {
+            run.start = dups[i];
+            run.length = 1;
+        }
+        else
+        {
+            for (want = 1; i + want < fileBlocks; ++want)
+                if (dups && i + want < plan->hashed && dups[i + want] >= 0) break;
+            
+            run.start = AllocateBlocks(map, want, &run.length);
+            if (run.start < 0) break;
+            header.usedBlocks += run.length;
+        }
+        
+        if (AddPlannedRun(plan, run, shared))
+        {
+            if (!shared) MarkBlocks(map, run.start, run.length, 0);
+            break;
+        }
+        
+        if (shared) AddReferences(disk, &header, &run, 1);
+    }
+    free(dups);
+    
+    if (i >= fileBlocks)
+        overflowBlocks = StoreExtents(disk, map, newDescriptor, plan->extents, plan->count);
+    
+    if (overflowBlocks >= 0 && (newDescriptor->flags & DESC_PACKED) && ReservePack(disk, map, &header, newDescriptor))
+    {
+        /* releases the extents along with the overflow blocks */
+        ReleaseExtents(disk, map, &header, newDescriptor);
+        plan->count = 0;
+        overflowBlocks = -1;
+    }
+    
+    if (overflowBlocks < 0)
+    {
+        /* nothing points to the planned blocks yet, so they are just released */
+        for (i = 0; i < plan->count; ++i)
+            ReleaseRun(disk, map, &header, plan->extents[i]);
+        
+        printf("No enough space for the file %s\n", path);
+        LockRange(disk, F_UNLCK, OWNER_LOCKS + *freeIndex, 1);
+        return 3;
+    }
+    
+    header.usedBlocks += overflowBlocks;
+    
+    if (*freeIndex == header.freeDescriptor)
+    {
+        desc = GetDescriptor(disk, *freeIndex);
+        header.freeDescriptor = desc.overflow;
+    }
+    else
+    {
+        header.descriptorWatermark++;
+    }
+    
+    desc = *newDescriptor;
+    desc.isUsed = 0;
+    desc.flags |= DESC_RESERVED;
+    SetDescriptor(disk, *freeIndex, desc);
+    header.reservedFiles++;
+    SetHeader(disk, header);
+    
+    return 0;
+}
+
+/*
+ *  Makes the copied file visible: its descriptor and name index slot are
+ *  written, its new blocks get their references and are added to the
+ *  index of blocks. The name is checked again, because another process
+ *  could have inserted the same name while the data was being copied.
+ */
+int CommitFile(struct DiskHandler *disk, const char *newName, struct Descriptor *newDescriptor, int freeIndex, struct BlockPlan *plan)
+{
+    struct Header header = disk->header;
+    struct Descriptor desc;
+    struct HashSlot slot;
+    
+    int slotIndex;
+    int block = 0;
+    int i;
+    int j;
+    
+    char leaf[MAX_SIZE_FILENAME];
+    
+    if (FindDescriptor(disk, newName, &desc, &slotIndex) >= 0)
+    {
+        printf("File %s already exists in the disc %s\n", newName, disk->name);
+        return 4;
+    }
+    
+    /* the directory may have been removed while the data was being copied */
+    if (slotIndex < 0)
+    {
+        printf("Directory of %s does not exist in the disk %s\n", newName, disk->name);
+        return 3;
+    }
+    
+    newDescriptor->parent = FindParent(disk, newName, leaf);
+    LinkEntry(disk, &header, freeIndex, newDescriptor);
+    SetDescriptor(disk, freeIndex, *newDescriptor);
+    
+    slot.descriptor = freeIndex + 1;
+    slot.hash = HashName(newDescriptor->parent, newDescriptor->name);
+    SetHashSlot(disk, slotIndex, slot);
+    
+    for (i = 0; i < plan->count; block += plan->extents[i++].length)
+    {
+        if (plan->shared[i]) continue;
+        
+        AddReferences(disk, &header, &plan->extents[i], 1);
+        for (j = 0; j < plan->extents[i].length && block + j < plan->hashed; ++j)
+            IndexBlock(disk, plan->hashes[block + j], plan->extents[i].start + j);
+    }
+    
+    if (newDescriptor->flags & DESC_COMPRESSED)
+    {
+        header.compressedMemory += newDescriptor->fileSize;
+        header.compressedBlocks += block;
+    }
+    
+    header.usedMemory += newDescriptor->fileSize;
+    header.usedFiles++;
+    header.reservedFiles--;
+    SetHeader(disk, header);
+    
+    LockRange(disk, F_UNLCK, OWNER_LOCKS + freeIndex, 1);
+    return 0;
+}
+
+/*
+ *  Gives back everything ReserveFile has taken for a file which could not
+ *  be inserted.
+ */
+int CancelFile(struct DiskHandler *disk, struct Descriptor *newDescriptor, int freeIndex)
+{
+    struct Header header = disk->header;
+    struct Descriptor desc;
+    struct BlockMap *map;
+    
+    map = GetBlockMap(disk);
+    if (!map) return 7;
+    
+    header.usedBlocks -= ReleaseExtents(disk, map, &header, newDescriptor);
+    header.usedBlocks -= ReleasePack(disk, map, &header, newDescriptor);
+    
+    desc = GetDescriptor(disk, freeIndex);
+    desc.isUsed = 0;
+    desc.flags = 0;
+    desc.overflow = header.freeDescriptor;
+    SetDescriptor(disk, freeIndex, desc);
+    header.freeDescriptor = freeIndex;
+    header.reservedFiles--;
+    
+    SetHeader(disk, header);
+    LockRange(disk, F_UNLCK, OWNER_LOCKS + freeIndex, 1);
+    return 0;
+}
+
+/*
+ *  Cancels the reservations of inserts which never ended: the descriptors
+ *  left DESC_RESERVED whose owner lock nobody holds. The mounted disk must
+ *  not hold reservations itself, so this is done once, at its first insert
+ *  or repair. Returns 0 on success.
+ */
+int ReclaimFiles(struct DiskHandler *disk)
+{
+    struct Descriptor desc;
+    int reclaimed = 0;
+    int result = 0;
+    int i;
+    
+    if (disk->reclaimed || disk->header.reservedFiles <= 0) return 0;
+    disk->reclaimed = 1;
+    
+    for (i = 0; i < disk->header.descriptorWatermark && !result; ++i)
+    {
+        desc = GetDescriptor(disk, i);
+        if (desc.isUsed || !(desc.flags & DESC_RESERVED) || IsRangeLocked(disk, OWNER_LOCKS + i)) continue;
+        
+        result = CancelFile(disk, &desc, i);
+        if (!result) reclaimed++;
+    }
+    
+    if (reclaimed > 0) printf("Reclaimed %d descriptors of inserts which did not end in the disk %s\n", reclaimed, disk->name);
+    return result;
+}
+
+int DiskInsertFile(struct DiskHandler *disk, const char *path, const char *newName)
+{
+    FILE *src;
+    FILE *packed = NULL;
+    struct Descriptor newDescriptor;
+    struct BlockPlan plan;
+    
+    char leaf[MAX_SIZE_FILENAME];
+    long long fileSize;
+    long long storedSize;
+    long long tailAddr = 0;
+    int freeIndex;
+    int result;
+    
+    char *data;
+    char *block = NULL;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    src = fopen(path, "rb");
+    
+    if (!src)
+    {
+        printf("Could not open the file %s\n", path);
+        return 2;
+    }
+    
+    fileSize = GetFileSize(src);
+    
+    /* only the last component of the path is kept in the descriptor */
+    if (CheckPath(newName, leaf))
+    {
+        fclose(src);
+        return 5;
+    }
+    
+    data = AllocCopyBuffer(disk);
+    if (!data)
+    {
+        printf("Not enough memory to insert the file %s\n", path);
+        fclose(src);
+        return 7;
+    }
+    
+    memset(&newDescriptor, 0, sizeof(struct Descriptor));
+    newDescriptor.isUsed = 1;
+    newDescriptor.fileSize = fileSize;
+    time(&newDescriptor.timeAdded);
+    strcpy(newDescriptor.name, leaf);
+    newDescriptor.firstChild = -1;
+    PlanStorage(&newDescriptor);
+    storedSize = fileSize;
+    
+    /* the compressed copy is stored instead of the file if it takes fewer blocks */
+    if (COMPRESSION && !(newDescriptor.flags & DESC_INLINE)) packed = CompressFile(src, fileSize, &storedSize);
+    if (packed && (storedSize + SIZE_BLOCK - 1) / SIZE_BLOCK < (fileSize - GetTailSize(&newDescriptor) + SIZE_BLOCK - 1) / SIZE_BLOCK)
+    {
+        fclose(src);
+        src = packed;
+        newDescriptor.flags = DESC_COMPRESSED;
+    }
+    else if (packed)
+    {
+        fclose(packed);
+        storedSize = fileSize;
+    }
+    
+    /* the full blocks are hashed before the lock is taken; without memory the file is just not deduplicated */
+    memset(&plan, 0, sizeof(struct BlockPlan));
+    if (DEDUPLICATE && !(newDescriptor.flags & DESC_COMPRESSED)) block = malloc(SIZE_BLOCK * 2);
+    if (block)
+    {
+        plan.hashed = (int) ((fileSize - GetTailSize(&newDescriptor)) / SIZE_BLOCK);
+        plan.hashes = HashFileBlocks(src, plan.hashed, block);
+    }
+    
+    result = LockMetadata(disk, 1);
+    if (!result) result = ReclaimFiles(disk);
+    if (!result) result = ReserveFile(disk, path, newName, storedSize, &newDescriptor, &plan, src, block, &freeIndex);
+    if (!result) tailAddr = GetTailAddr(disk, &newDescriptor);
+    free(block);
+    
+    /* a file without full blocks has nothing to copy outside the lock, so it is inserted in one transaction */
+    if (!result && storedSize == GetTailSize(&newDescriptor))
+    {
+        fseeko(src, 0, SEEK_SET);
+        if (CopyTail(disk, src, &newDescriptor, tailAddr, 1, data))
+        {
+            printf("Could not copy the file %s to the disk %s\n", path, disk->name);
+            result = 3;
+        }
+        if (!result) result = CommitFile(disk, newName, &newDescriptor, freeIndex, &plan);
+        if (result) CancelFile(disk, &newDescriptor, freeIndex);
+        if (UnlockMetadata(disk) && !result) result = 9;
+        
+        FreePlan(&plan);
+        FreeCopyBuffer(disk, data);
+        fclose(src);
+        return result;
+    }
+    
+    /* the pack of the tail is not moved by a defragmentation while the tail is being copied */
+    if (!result && LockTail(disk, 1, &newDescriptor, tailAddr))
+    {
+        CancelFile(disk, &newDescriptor, freeIndex);
+        result = 10;
+    }
+    if (UnlockMetadata(disk) && !result) result = 9;
+    
+    if (result)
+    {
+        FreePlan(&plan);
+        FreeCopyBuffer(disk, data);
+        fclose(src);
+        return result;
+    }
+    
+    CheckCrashPoint(disk, CRASH_COPY);
+    
+    /* the blocks are reserved, so the data is copied without holding the lock; shared blocks are not copied at all */
+    fseeko(src, 0, SEEK_SET);
+    if (CopyExtents(disk, src, plan.extents, plan.count, storedSize - GetTailSize(&newDescriptor), 1, data, plan.shared) ||
+        CopyTail(disk, src, &newDescriptor, tailAddr, 1, data))
+    {
+        printf("Could not copy the file %s to the disk %s\n", path, disk->name);
+        result = 3;
+    }
+    
+    UnlockExtents(disk);
+    FreeCopyBuffer(disk, data);
+    fclose(src);
+    
+    if (LockMetadata(disk, 1))
+    {
+        FreePlan(&plan);
+        return 10;
+    }
+    if (!result) result = CommitFile(disk, newName, &newDescriptor, freeIndex, &plan);
+    if (result) CancelFile(disk, &newDescriptor, freeIndex);
+    if (UnlockMetadata(disk) && !result) result = 9;
+    
+    FreePlan(&plan);
+    return result;
+}
+
+int DiskDisplayMap(struct DiskHandler *disk)
+{
+    struct BlockMap *map;
+    
+    int isUsed;
+    int begIndex;
+    int endIndex;
+    int i;
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    map = GetBlockMap(disk);
+    if (!map)
+    {
+        printf("Not enough memory to load the map of blocks\n");
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    printf("\n     USED MEMORY IN THE DISK %s\n\n", disk->name);
+    
+    printf("%9d - %9lu     %9luB: FS header\n", 0, sizeof(struct Header)-1, sizeof(struct Header));
+    printf("%9lu - %9lld     %9lldB: %d File descriptors\n", sizeof(struct Header), GetHashSlotAddr(0)-1, GetHashSlotAddr(0) - GetDescriptorAddr(0), BASE_FILES);
+    printf("%9lld - %9lld     %9lldB: %d Name index slots\n", GetHashSlotAddr(0), GetPackAddr(0)-1, GetPackAddr(0)-GetHashSlotAddr(0), HASH_SIZE);
+    printf("%9lld - %9lld     %9lldB: %d Packs\n", GetPackAddr(0), GetRefsAddr(0)-1, GetRefsAddr(0)-GetPackAddr(0), BASE_FILES + 1);
+    printf("%9lld - %9lld     %9lldB: %d Reference counts\n", GetRefsAddr(0), GetDedupAddr(0)-1, GetDedupAddr(0)-GetRefsAddr(0), BASE_MAP_BLOCKS);
+    printf("%9lld - %9lld     %9lldB: %d Block index slots\n", GetDedupAddr(0), GetBitmapAddr(0)-1, GetBitmapAddr(0)-GetDedupAddr(0), DEDUP_SIZE);
+    printf("%9lld - %9lld     %9lldB: %d Map words\n", GetBitmapAddr(0), GetSummaryAddr(0)-1, GetSummaryAddr(0)-GetBitmapAddr(0), GetMapWords(BASE_MAP_BLOCKS));
+    printf("%9lld - %9lld     %9lldB: %d Map pages summary\n", GetSummaryAddr(0), GetMetadataEnd()-1, GetMetadataEnd()-GetSummaryAddr(0), GetMapPages(BASE_MAP_BLOCKS));
+    printf("%9lld - %9lld     %9lldB: Journal%s\n", GetMetadataEnd(), GetBlockAddr(0)-1, GetBlockAddr(0)-GetMetadataEnd(), JOURNAL_BLOCK >= 0 ? " (not used)" : "");
+    printf("%9lld - %9lld     %9lldB: %d Blocks\n", GetBlockAddr(0), GetBlockAddr(LIMIT_BLOCKS)-1, GetBlockAddr(LIMIT_BLOCKS) - GetBlockAddr(0), LIMIT_BLOCKS);
+    
+    for (i = 0; i < disk->segmentCount; ++i)
+    {
+        struct Segment *segment = &disk->segments[i];
+        printf("  blocks %7d - %7d: Segment of %d files and %d blocks\n", segment->block, segment->block + segment->blocks - 1, segment->files, segment->mapBlocks);
+    }
+    if (JOURNAL_BLOCK >= 0) printf("  blocks %7d - %7d: Journal\n", JOURNAL_BLOCK, JOURNAL_BLOCK + disk->header.journalBlocks - 1);
+    printf("\n\nBLOCKS MEMORY MAP:\n\n");
+    
+    for (begIndex = 0; begIndex < LIMIT_BLOCKS; begIndex = endIndex)
+    {
+        isUsed = IsBlockUsed(map, begIndex);
+        endIndex = FindBlock(map, begIndex, !isUsed);
+        
+        if (isUsed) printf("%7d - %7d     %9lld - %9lld     %9lldB: USED\n", begIndex, endIndex-1, GetBlockAddr(begIndex), GetBlockAddr(endIndex)-1, GetBlockAddr(endIndex)-GetBlockAddr(begIndex));
+        else        printf("%7d - %7d     %9lld - %9lld     %9lldB: FREE\n", begIndex, endIndex-1, GetBlockAddr(begIndex), GetBlockAddr(endIndex)-1, GetBlockAddr(endIndex)-GetBlockAddr(begIndex));
+    }
+    
+    UnlockMetadata(disk);
+    return 0;
+}
+
+void DisplayEntry(int counter, struct Descriptor *desc, const char *path)
+{
+    char strDate[30];
+    struct tm * timeinfo = localtime (&desc->timeAdded);
+    strcpy(strDate, asctime(timeinfo));
+    strDate[strlen(strDate)-1] = '\0';
+    
+    printf(" %3d %9lldB  %30s - %s%s\n", counter, desc->fileSize, strDate, path, (desc->flags & DESC_DIRECTORY) ? "/" : "");
+}
+
+/*
+ *  Lists all files of the disk with their paths, each directory before
+ *  its entries.
+ */
+int DiskDisplayFiles(struct DiskHandler *disk)
+{
+    struct Descriptor desc;
+    
+    int counter = 0;
+    int index;
+    
+    char path[SIZE_BATCH_LINE];
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    printf("\n\tLIST OF FILES ON THE DISK %s\n\n", disk->name);
+    
+    index = FirstEntry(disk, -1);
+    if (index >= 0) desc = GetDescriptor(disk, index);
+    
+    for (; index >= 0; index = NextEntry(disk, -1, index, &desc))
+    {
+        if (GetEntryPath(disk, -1, index, path, SIZE_BATCH_LINE)) strcpy(path, desc.name);
+        DisplayEntry(++counter, &desc, path);
+    }
+    
+    printf("%d files and %d directories in total\n", disk->header.usedFiles - disk->header.directories, disk->header.directories);
+    
+    UnlockMetadata(disk);
+    return 0;
+}
+
+/*
+ *  Lists the entries of a single directory, following only its chain of
+ *  entries.
+ */
+int DiskDisplayDirectory(struct DiskHandler *disk, const char *path)
+{
+    struct Descriptor desc;
+    
+    int counter = 0;
+    int index;
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    index = FindDirectory(disk, path, (int) strlen(path));
+    if (index < -1)
+    {
+        printf("Directory %s does not exist in the disk %s\n", path, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    printf("\n\tLIST OF FILES IN %s ON THE DISK %s\n\n", path, disk->name);
+    
+    for (index = FirstEntry(disk, index); index >= 0; index = desc.nextSibling)
+    {
+        desc = GetDescriptor(disk, index);
+        DisplayEntry(++counter, &desc, desc.name);
+    }
+    
+    printf("%d entries in total\n", counter);
+    
+    UnlockMetadata(disk);
+    return 0;
+}
+
+/*
+ *  Entry of a batch: an external path and the name used in the disk.
+ *  A manifest has one entry per line - the first word is the external
+ *  file and the optional second word the name (the path itself if it
+ *  is missing); empty lines and lines starting with # are skipped.
+ */
+struct BatchEntry
+{
+    char *path;
+    char *name;
+};
+
+int AddBatchEntry(struct BatchEntry **entries, int *count, const char *path, const char *name)
+{
+    struct BatchEntry *grown;
+    struct BatchEntry entry;
+    
+    entry.path = malloc(strlen(path) + 1);
+    entry.name = malloc(strlen(name) + 1);
+    grown = realloc(*entries, sizeof(struct BatchEntry) * (*count + 1));
+    if (grown) *entries = grown;
+    
+    if (!entry.path || !entry.name || !grown)
+    {
+        free(entry.path);
+        free(entry.name);
+        return 1;
+    }
+    
+    strcpy(entry.path, path);
+    strcpy(entry.name, name);
+    (*entries)[(*count)++] = entry;
+    return 0;
+}
+
+void FreeBatch(struct BatchEntry *entries, int count)
+{
+    int i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        free(entries[i].path);
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/*
+ *  Lists the entries under the directory top for an export into the
+ *  directory dir: the directories are created on the way and the files
+ *  are added to entries with their paths in the disk and outside of it.
+ *  Has to be called with the metadata locked. Returns 0 on success.
+ */
+int ListTree(struct DiskHandler *disk, int top, const char *dir, struct BatchEntry **entries, int *count)
+{
+    struct Descriptor desc;
+    
+    int length = (int) strlen(dir);
+    int index;
+    
+    char inside[SIZE_BATCH_LINE];
+    char outside[SIZE_BATCH_LINE];
+    
+    if (length + 2 > SIZE_BATCH_LINE) return 5;
+    sprintf(outside, "%s/", dir);
+    
+    index = FirstEntry(disk, top);
+    if (index >= 0) desc = GetDescriptor(disk, index);
+    
+    for (; index >= 0; index = NextEntry(disk, top, index, &desc))
+    {
+        if (GetEntryPath(disk, -1, index, inside, SIZE_BATCH_LINE) ||
+            GetEntryPath(disk, top, index, outside + length + 1, SIZE_BATCH_LINE - length - 1))
+        {
+            printf("Path of %s is too long to be exported\n", desc.name);
+            continue;
+        }
+        
+        if (desc.flags & DESC_DIRECTORY)
+        {
+            if (mkdir(outside, 0755) && errno != EEXIST) printf("Cannot create the directory %s\n", outside);
+        }
+        else if (AddBatchEntry(entries, count, inside, outside))
+        {
+            printf("Not enough memory to list the files of the disk %s\n", disk->name);
+            return 7;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Exports the file to newName; a directory is exported into the
+ *  directory newName with everything under it.
+ */
+int DiskExportFile(struct DiskHandler *disk, const char *fileToExport, const char *newName)
+{
+    FILE *dst;
+    struct Descriptor desc;
+    struct Extent *extents;
+    struct BatchEntry *entries = NULL;
+    
+    long long tailAddr;
+    int fileIndex;
+    int slotIndex;
+    int extentCount;
+    int result = 0;
+    int count = 0;
+    int exported = 0;
+    int i;
+    
+    char *data;
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    fileIndex = FindDescriptor(disk, fileToExport, &desc, &slotIndex);
+    
+    if (fileIndex < 0)
+    {
+        printf("Could not find file %s\n", fileToExport);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (desc.flags & DESC_DIRECTORY)
+    {
+        if (mkdir(newName, 0755) && errno != EEXIST)
+        {
+            printf("Cannot create destination directory %s\n", newName);
+            result = 4;
+        }
+        
+        /* the files are exported one by one, without the lock on the metadata */
+        if (!result) result = ListTree(disk, fileIndex, newName, &entries, &count);
+        UnlockMetadata(disk);
+        
+        for (i = 0; !result && i < count; ++i)
+            if (DiskExportFile(disk, entries[i].path, entries[i].name) == 0) exported++;
+        
+        FreeBatch(entries, count);
+        if (result) return result;
+        
+        printf("Exported %d of %d files of the directory %s\n", exported, count, fileToExport);
+        return exported == count ? 0 : 5;
+    }
+    
+    extentCount = LoadExtents(disk, &desc, &extents);
+    if (extentCount < 0)
+    {
+        printf("Not enough memory to export the file %s\n", fileToExport);
+        UnlockMetadata(disk);
+        return 7;
+    }
+    
+    /* the file cannot be deleted while its extents are locked, so the metadata can be unlocked */
+    tailAddr = GetTailAddr(disk, &desc);
+    result = LockExtents(disk, 0, extents, extentCount);
+    if (!result) result = LockTail(disk, 0, &desc, tailAddr);
+    UnlockMetadata(disk);
+    
+    if (result)
+    {
+        free(extents);
+        return result;
+    }
+    
+    dst = fopen(newName, "wb");
+    if (!dst)
+    {
+        printf("Cannot create destination file %s\n", newName);
+        UnlockExtents(disk);
+        free(extents);
+        return 4;
+    }
+    
+    data = AllocCopyBuffer(disk);
+    if (!data)
+    {
+        printf("Not enough memory to export the file %s\n", fileToExport);
+        UnlockExtents(disk);
+        free(extents);
+        fclose(dst);
+        return 7;
+    }
+    
+    if (desc.flags & DESC_COMPRESSED)
+        result = DecompressExtents(disk, dst, extents, extentCount, &desc);
+    else
+        result = CopyExtents(disk, dst, extents, extentCount, desc.fileSize - GetTailSize(&desc), 0, data, NULL);
+    if (!result) result = CopyTail(disk, dst, &desc, tailAddr, 0, data);
+    UnlockExtents(disk);
+    
+    free(extents);
+    FreeCopyBuffer(disk, data);
+    if (fclose(dst)) result = 1;
+    
+    if (result)
+    {
+        printf("Could not write the file %s\n", newName);
+        return 5;
+    }
+    return 0;
+}
+
+int DiskDeleteFile(struct DiskHandler *disk, const char *fileName)
+{
+    struct Header header;
+    struct Descriptor desc;
+    struct BlockMap *map;
+    struct Extent *extents;
+    
+    int fileIndex;
+    int slotIndex;
+    int extentCount;
+    int result;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    
+    fileIndex = FindDescriptor(disk, fileName, &desc, &slotIndex);
+    
+    if (fileIndex < 0)
+    {
+        printf("File %s does not exist in the disk %s\n", fileName, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (desc.flags & DESC_DIRECTORY)
+    {
+        printf("%s is a directory; it is removed with rmdir\n", fileName);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    map = GetBlockMap(disk);
+    extentCount = LoadExtents(disk, &desc, &extents);
+    if (!map || extentCount < 0)
+    {
+        printf("Not enough memory to load the map of blocks\n");
+        if (extentCount >= 0) free(extents);
+        UnlockMetadata(disk);
+        return 7;
+    }
+    
+    /* waits for the exports of the file which are still running */
+    result = LockExtents(disk, 1, extents, extentCount);
+    if (!result) result = LockTail(disk, 1, &desc, GetTailAddr(disk, &desc));
+    if (desc.flags & DESC_COMPRESSED)
+    {
+        header.compressedMemory -= desc.fileSize;
+        header.compressedBlocks -= CountBlocks(extents, extentCount);
+    }
+    free(extents);
+    if (result)
+    {
+        UnlockMetadata(disk);
+        return result;
+    }
+    
+    header.usedBlocks -= ReleaseExtents(disk, map, &header, &desc);
+    header.usedBlocks -= ReleasePack(disk, map, &header, &desc);
+    UnlockExtents(disk);
+    
+    UnlinkEntry(disk, &header, &desc);
+    desc.isUsed = 0;
+    desc.overflow = header.freeDescriptor;
+    SetDescriptor(disk, fileIndex, desc);
+    header.freeDescriptor = fileIndex;
+    
+    RemoveHashSlot(disk, slotIndex);
+    
+    header.usedFiles--;
+    header.usedMemory -= desc.fileSize;
+    SetHeader(disk, header);
+    
+    return UnlockMetadata(disk) ? 9 : 0;
+}
+
+int DiskMakeDirectory(struct DiskHandler *disk, const char *path)
+{
+    struct Header header;
+    struct Descriptor desc;
+    struct HashSlot slot;
+    
+    int index;
+    int slotIndex;
+    
+    char leaf[MAX_SIZE_FILENAME];
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (CheckPath(path, leaf)) return 5;
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    
+    if (FindDescriptor(disk, path, &desc, &slotIndex) >= 0)
+    {
+        printf("File %s already exists in the disc %s\n", path, disk->name);
+        UnlockMetadata(disk);
+        return 4;
+    }
+    
+    if (slotIndex < 0)
+    {
+        printf("Directory of %s does not exist in the disk %s\n", path, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    /* freed descriptors are reused first, then the ones never used */
+    index = header.freeDescriptor;
+    if (index >= 0) header.freeDescriptor = GetDescriptor(disk, index).overflow;
+    else if (header.descriptorWatermark < LIMIT_FILES) index = header.descriptorWatermark++;
+    else
+    {
+        printf("No free descriptors left in the disk %s\n", disk->name);
+        UnlockMetadata(disk);
+        return 6;
+    }
+    
+    memset(&desc, 0, sizeof(struct Descriptor));
+    desc.isUsed = 1;
+    desc.flags = DESC_DIRECTORY;
+    desc.overflow = -1;
+    desc.firstChild = -1;
+    time(&desc.timeAdded);
+    desc.parent = FindParent(disk, path, leaf);
+    strcpy(desc.name, leaf);
+    
+    LinkEntry(disk, &header, index, &desc);
+    SetDescriptor(disk, index, desc);
+    
+    slot.descriptor = index + 1;
+    slot.hash = HashName(desc.parent, desc.name);
+    SetHashSlot(disk, slotIndex, slot);
+    
+    header.usedFiles++;
+    header.directories++;
+    SetHeader(disk, header);
+    
+    return UnlockMetadata(disk) ? 9 : 0;
+}
+
+int DiskRemoveDirectory(struct DiskHandler *disk, const char *path)
+{
+    struct Header header;
+    struct Descriptor desc;
+    
+    int index;
+    int slotIndex;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    
+    index = FindDescriptor(disk, path, &desc, &slotIndex);
+    
+    if (index < 0 || !(desc.flags & DESC_DIRECTORY))
+    {
+        printf("Directory %s does not exist in the disk %s\n", path, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (desc.firstChild >= 0)
+    {
+        printf("Directory %s is not empty\n", path);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    UnlinkEntry(disk, &header, &desc);
+    desc.isUsed = 0;
+    desc.overflow = header.freeDescriptor;
+    SetDescriptor(disk, index, desc);
+    header.freeDescriptor = index;
+    
+    RemoveHashSlot(disk, slotIndex);
+    ClearPathCache(disk);
+    
+    header.usedFiles--;
+    header.directories--;
+    SetHeader(disk, header);
+    
+    return UnlockMetadata(disk) ? 9 : 0;
+}
+
+/*
+ *  Moves a file or a directory, with everything under it, to a new path.
+ *  Only its own descriptor and index slot change; the data of an inline
+ *  file is moved along with the end of its name.
+ */
+int DiskRenameFile(struct DiskHandler *disk, const char *oldPath, const char *newPath)
+{
+    struct Header header;
+    struct Descriptor desc;
+    struct Descriptor other;
+    struct HashSlot slot;
+    
+    int index;
+    int slotIndex;
+    int parent;
+    int i;
+    
+    char leaf[MAX_SIZE_FILENAME];
+    char data[sizeof(desc.extents) + MAX_SIZE_FILENAME];
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (CheckPath(newPath, leaf)) return 5;
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    
+    index = FindDescriptor(disk, oldPath, &desc, &slotIndex);
+    
+    if (index < 0)
+    {
+        printf("File %s does not exist in the disk %s\n", oldPath, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (FindDescriptor(disk, newPath, &other, &i) >= 0)
+    {
+        printf("File %s already exists in the disc %s\n", newPath, disk->name);
+        UnlockMetadata(disk);
+        return 4;
+    }
+    
+    parent = FindParent(disk, newPath, leaf);
+    if (parent < -1)
+    {
+        printf("Directory of %s does not exist in the disk %s\n", newPath, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    /* a directory cannot be moved under itself */
+    for (i = parent; i >= 0; i = GetDescriptor(disk, i).parent)
+    {
+        if (i != index) continue;
+        
+        printf("Cannot move %s into itself\n", oldPath);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    if ((desc.flags & DESC_INLINE) && desc.fileSize > (long long) sizeof(desc.extents) + SIZE_FILENAME - (long long) strlen(leaf) - 1)
+    {
+        printf("Name %s is too long for the data of the file\n", newPath);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    if (desc.flags & DESC_INLINE) AccessInline(&desc, 0, data, (int) desc.fileSize, 0);
+    
+    UnlinkEntry(disk, &header, &desc);
+    RemoveHashSlot(disk, slotIndex);
+    
+    desc.parent = parent;
+    strcpy(desc.name, leaf);
+    if (desc.flags & DESC_INLINE) AccessInline(&desc, 0, data, (int) desc.fileSize, 1);
+    
+    LinkEntry(disk, &header, index, &desc);
+    SetDescriptor(disk, index, desc);
+    
+    /* removing the old slot may have moved the place of the new one */
+    FindEntry(disk, parent, leaf, &other, &slotIndex);
+    slot.descriptor = index + 1;
+    slot.hash = HashName(parent, leaf);
+    SetHashSlot(disk, slotIndex, slot);
+    
+    if (desc.flags & DESC_DIRECTORY) ClearPathCache(disk);
+    SetHeader(disk, header);
+    
+    return UnlockMetadata(disk) ? 9 : 0;
+}
+
+/*
+ *  Stores a file in whole blocks only, before it is changed: inline data
+ *  and a packed tail get a block of their own after the blocks of the
+ *  file and a compressed file is decompressed into new blocks. The old
+ *  places of the data are released only when the new ones are filled.
+ *  list is replaced with the new extents. Has to be called with the
+ *  metadata and the file locked. Returns 0 on success.
+ */
+int UnpackFile(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Descriptor *desc,
+               struct Extent **list, int *count, char *buffer)
+{
+    struct Descriptor old = *desc;
+    struct BlockPlan plan;
+    struct Extent *last;
+    
+    char data[sizeof(struct Extent) * DESC_EXTENTS + MAX_SIZE_FILENAME];
+    long long tail = GetTailSize(desc);
+    long long start;
+    long long end;
+    int *oldStarts = NULL;
+    int *newStarts = NULL;
+    char *frame = NULL;
+    int overflowBlocks;
+    int blocks;
+    int result = 0;
+    int i;
+    
+    if (desc->flags == 0) return 0;
+    
+    memset(&plan, 0, sizeof(struct BlockPlan));
+    
+    if (desc->flags & DESC_COMPRESSED) blocks = (int) ((desc->fileSize + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    else blocks = tail > 0 ? 1 : 0;
+    
+    for (i = 0; !(desc->flags & DESC_COMPRESSED) && i < *count && !result; ++i)
+        result = AddPlannedRun(&plan, (*list)[i], 1) ? 7 : 0;
+    
+    if (!result && blocks + GetOverflowBlocks(plan.count + blocks) > LIMIT_BLOCKS - header->usedBlocks) result = 3;
+    if (!result) result = AddNewBlocks(map, header, &plan, blocks);
+    
+    last = plan.count > 0 ? &plan.extents[plan.count - 1] : NULL;
+    
+    if (!result && tail > 0 && (desc->flags & DESC_INLINE))
+    {
+        AccessInline(desc, 0, data, (int) tail, 0);
+        WriteDisk(disk, GetBlockAddr(last->start + last->length - 1), data, (int) tail);
+    }
+    else if (!result && tail > 0 && (desc->flags & DESC_PACKED))
+    {
+        MoveData(disk, GetTailAddr(disk, desc), GetBlockAddr(last->start + last->length - 1), tail, buffer);
+    }
+    else if (!result && (desc->flags & DESC_COMPRESSED))
+    {
+        oldStarts = IndexExtents(*list, *count);
+        newStarts = IndexExtents(plan.extents, plan.count);
+        frame = malloc(COMPRESS_FRAME * 2);
+        if (!oldStarts || !newStarts || !frame) result = 7;
+        
+        for (i = 0; !result && i < GetFrames(desc->fileSize); ++i)
+        {
+            if (ReadFrameEnds(disk, *list, oldStarts, *count, i, &start, &end) ||
+                ReadFrame(disk, *list, oldStarts, *count, desc->fileSize, i, start, end, frame) ||
+                WriteStored(disk, plan.extents, newStarts, plan.count, (long long) i * COMPRESS_FRAME, frame, GetFrameSize(desc->fileSize, i)))
+                result = 5;
+        }
+        
+        free(oldStarts);
+        free(newStarts);
+        free(frame);
+    }
+    
+    if (!result)
+    {
+        desc->flags = 0;
+        desc->pack = -1;
+        desc->packOffset = 0;
+        
+        overflowBlocks = StoreExtents(disk, map, desc, plan.extents, plan.count);
+        if (overflowBlocks < 0) result = 3;
+        else header->usedBlocks += overflowBlocks;
+    }
+    
+    if (result)
+    {
+        ReleaseNewBlocks(disk, map, header, &plan);
+        FreePlan(&plan);
+        *desc = old;
+        return result;
+    }
+    
+    if (old.flags & DESC_COMPRESSED)
+    {
+        header->usedBlocks -= ReleaseExtents(disk, map, header, &old);
+        header->compressedMemory -= old.fileSize;
+        header->compressedBlocks -= CountBlocks(*list, *count);
+    }
+    else
+    {
+        header->usedBlocks -= ReleaseOverflow(map, &old);
+        header->usedBlocks -= ReleasePack(disk, map, header, &old);
+    }
+    
+    for (i = 0; i < plan.count; ++i)
+        if (!plan.shared[i]) AddReferences(disk, header, &plan.extents[i], 1);
+    
+    free(*list);
+    *list = plan.extents;
+    *count = plan.count;
+    plan.extents = NULL;
+    FreePlan(&plan);
+    return 0;
+}
+
+/*
+ *  Gives a file stored in whole blocks the blocks for newSize bytes:
+ *  blocks past the new end are released and missing ones allocated, and
+ *  the blocks of [lo, hi), which are about to be written, are copied
+ *  first if they are shared with other files. list is replaced with the
+ *  new extents, unless none of them changes. Returns 0 on success; on
+ *  failure nothing is changed.
+ */
+int ResizeBlocks(struct DiskHandler *disk, struct BlockMap *map, struct Header *header, struct Descriptor *desc,
+                 struct Extent **list, int *count, long long newSize, long long lo, long long hi, char *buffer)
+{
+    struct Descriptor old = *desc;
+    struct BlockPlan plan;
+    struct Extent run;
+    struct Extent piece;
+    
+    int oldBlocks = CountBlocks(*list, *count);
+    int newBlocks = (int) ((newSize + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    int first = (int) (lo / SIZE_BLOCK);
+    int last = hi > lo ? (int) ((hi - 1) / SIZE_BLOCK) : -1;
+    int grown = newBlocks > oldBlocks ? newBlocks - oldBlocks : 0;
+    int copies = 0;
+    int copied = 0;
+    int *sources;
+    int overflowBlocks;
+    int block;
+    int length;
+    int result = 0;
+    int i;
+    int j;
+    
+    if (last >= newBlocks) last = newBlocks - 1;
+    
+    /* every copy can split an extent in three, the space for all of it is checked first */
+    for (i = 0, block = 0; i < *count; block += (*list)[i++].length)
+        for (j = first > block ? first - block : 0; j < (*list)[i].length && block + j <= last; ++j)
+            if (GetRefs(disk, (*list)[i].start + j) > 1) copies++;
+    
+    /* a write over blocks of its own which keeps the size in blocks leaves the list as it is */
+    if (copies == 0 && newBlocks == oldBlocks) return 0;
+    
+    if (copies + grown + GetOverflowBlocks(*count + copies * 2 + grown) > LIMIT_BLOCKS - header->usedBlocks)
+    {
+        printf("No enough space to change the file %s\n", desc->name);
+        return 3;
+    }
+    
+    /* a file may refer to a shared block more than once, so the copied ones are remembered */
+    sources = malloc(sizeof(int) * (copies > 0 ? copies : 1));
+    if (!sources) return 7;
+    
+    memset(&plan, 0, sizeof(struct BlockPlan));
+    
+    for (i = 0, block = 0; !result && i < *count; block += (*list)[i++].length)
+    {
+        run = (*list)[i];
+        if (block + run.length > newBlocks) run.length = newBlocks > block ? newBlocks - block : 0;
+        
+        for (j = 0; !result && j < run.length; j += length)
+        {
+            /* outside [first, last] the blocks are kept in whole runs */
+            if (block + j < first) length = first - block - j < run.length - j ? first - block - j : run.length - j;
+            else if (block + j > last) length = run.length - j;
+            else length = 1;
+            
+            piece.start = run.start + j;
+            piece.length = length;
+            
+            if (block + j < first || block + j > last || GetRefs(disk, piece.start) <= 1)
+            {
+                result = AddPlannedRun(&plan, piece, 1) ? 7 : 0;
+                continue;
+            }
+            
+            piece.start = AllocateBlocks(map, 1, &piece.length);
+            header->usedBlocks++;
+            MoveData(disk, GetBlockAddr(run.start + j), GetBlockAddr(piece.start), SIZE_BLOCK, buffer);
+            
+            if (AddPlannedRun(&plan, piece, 0))
+            {
+                MarkBlocks(map, piece.start, 1, 0);
+                header->usedBlocks--;
+                result = 7;
+            }
+            else sources[copied++] = run.start + j;
+        }
+    }
+    
+    if (!result) result = AddNewBlocks(map, header, &plan, grown);
+    
+    if (!result)
+    {
+        overflowBlocks = StoreExtents(disk, map, desc, plan.extents, plan.count);
+        if (overflowBlocks < 0) result = 3;
+        else header->usedBlocks += overflowBlocks;
+    }
+    
+    if (result)
+    {
+        ReleaseNewBlocks(disk, map, header, &plan);
+        FreePlan(&plan);
+        free(sources);
+        *desc = old;
+        return result;
+    }
+    
+    /* the old overflow blocks, the blocks past the new end and the copied blocks are released */
+    header->usedBlocks -= ReleaseOverflow(map, &old);
+    for (i = 0, block = 0; i < *count; block += (*list)[i++].length)
+    {
+        run = (*list)[i];
+        if (block + run.length <= newBlocks) continue;
+        
+        piece.start = run.start + (newBlocks > block ? newBlocks - block : 0);
+        piece.length = run.start + run.length - piece.start;
+        header->usedBlocks -= ReleaseRun(disk, map, header, piece);
+    }
+    
+    piece.length = 1;
+    for (i = 0; i < copied; ++i)
+    {
+        piece.start = sources[i];
+        header->usedBlocks -= ReleaseRun(disk, map, header, piece);
+    }
+    free(sources);
+    
+    for (i = 0; i < plan.count; ++i)
+        if (!plan.shared[i]) AddReferences(disk, header, &plan.extents[i], 1);
+    
+    free(*list);
+    *list = plan.extents;
+    *count = plan.count;
+    plan.extents = NULL;
+    FreePlan(&plan);
+    return 0;
+}
+
+/*
+ *  Changes a file in place: its size is set to newSize (-1 - the end of
+ *  the written bytes, if it is past the end of the file), the bytes
+ *  between its old end and offset read as zeros and size bytes of data
+ *  are written at offset (-1 - at the end of the file). A small file
+ *  stays inline while it fits in its descriptor; otherwise the file is
+ *  unpacked into whole blocks first and only the blocks it needs more
+ *  are allocated, so a change costs the bytes written, not the size of
+ *  the file.
+ */
+int ModifyFile(struct DiskHandler *disk, const char *fileName, long long offset, const char *data, int size, long long newSize)
+{
+    static char zeros[sizeof(struct Extent) * DESC_EXTENTS + MAX_SIZE_FILENAME];
+    struct Header header;
+    struct Descriptor desc;
+    struct BlockMap *map;
+    struct Extent *extents = NULL;
+    struct Extent *loaded;
+    
+    long long oldSize;
+    long long gapEnd;
+    long long lo;
+    long long hi;
+    int fileIndex;
+    int slotIndex;
+    int oldBlocks;
+    int newBlocks;
+    int count;
+    int *starts = NULL;
+    int result;
+    int failed = 0;
+    
+    char *buffer;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    
+    fileIndex = FindDescriptor(disk, fileName, &desc, &slotIndex);
+    
+    if (fileIndex < 0)
+    {
+        printf("File %s does not exist in the disk %s\n", fileName, disk->name);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (desc.flags & DESC_DIRECTORY)
+    {
+        printf("%s is a directory\n", fileName);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    oldSize = desc.fileSize;
+    if (offset < 0) offset = oldSize;
+    if (newSize < 0) newSize = offset + size > oldSize ? offset + size : oldSize;
+    
+    /* bytes in [lo, hi) are written: the gap after the old end with zeros, then the data */
+    gapEnd = offset < newSize ? offset : newSize;
+    lo = gapEnd > oldSize ? oldSize : offset;
+    hi = offset + size > gapEnd ? offset + size : gapEnd;
+    
+    map = GetBlockMap(disk);
+    count = TakeExtents(disk, fileIndex, &desc, &extents, &starts);
+    loaded = extents;
+    buffer = AllocCopyBuffer(disk);
+    if (!map || count < 0 || !buffer)
+    {
+        printf("Not enough memory to change the file %s\n", fileName);
+        if (count >= 0) KeepExtents(disk, fileIndex, &desc, extents, starts, count);
+        if (buffer) FreeCopyBuffer(disk, buffer);
+        UnlockMetadata(disk);
+        return 7;
+    }
+    
+    /* waits for the exports of the file which are still running, on the blocks written and released */
+    oldBlocks = starts[count];
+    newBlocks = (int) ((newSize + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    if (desc.flags & DESC_COMPRESSED) result = LockExtents(disk, 1, extents, count);
+    else result = LockBlocks(disk, 1, extents, starts, count, (int) (lo / SIZE_BLOCK), (int) ((hi - 1) / SIZE_BLOCK)) ||
+                  LockBlocks(disk, 1, extents, starts, count, newBlocks, oldBlocks - 1) ? 10 : 0;
+    if (!result) result = LockTail(disk, 1, &desc, GetTailAddr(disk, &desc));
+    
+    /* the blocks are read past the stream */
+    if (!disk->map) fflush(disk->file);
+    
+    if (!result && (desc.flags & DESC_INLINE) && newSize <= GetInlineSize(&desc))
+    {
+        if (gapEnd > oldSize) AccessInline(&desc, oldSize, zeros, (int) (gapEnd - oldSize), 1);
+        AccessInline(&desc, offset, (char *) data, size, 1);
+    }
+    else if (!result)
+    {
+        result = UnpackFile(disk, map, &header, &desc, &extents, &count, buffer);
+        if (!result)
+        {
+            result = ResizeBlocks(disk, map, &header, &desc, &extents, &count, newSize, lo, hi, buffer);
+            
+            /* the file stays unpacked, its old place has been released */
+            if (result) SetDescriptor(disk, fileIndex, desc);
+        }
+        
+        if (!result && extents != loaded)
+        {
+            free(starts);
+            starts = IndexExtents(extents, count);
+        }
+        
+        /* the blocks are taken already, so a failed write only loses the data */
+        if (!result)
+        {
+            failed = !starts;
+            if (!failed && gapEnd > oldSize) failed = WriteStored(disk, extents, starts, count, oldSize, NULL, gapEnd - oldSize);
+            if (!failed) failed = WriteStored(disk, extents, starts, count, offset, data, size);
+        }
+    }
+    
+    if (!result)
+    {
+        desc.fileSize = newSize;
+        SetDescriptor(disk, fileIndex, desc);
+        header.usedMemory += newSize - oldSize;
+    }
+    SetHeader(disk, header);
+    
+    /* the next change of the file starts from the lists it has now */
+    if (!result && starts) KeepExtents(disk, fileIndex, &desc, extents, starts, count);
+    else
+    {
+        free(extents);
+        free(starts);
+    }
+    
+    UnlockExtents(disk);
+    FreeCopyBuffer(disk, buffer);
+    
+    if (UnlockMetadata(disk) && !result) result = 9;
+    if (!result && failed)
+    {
+        printf("Could not write the file %s\n", fileName);
+        result = 5;
+    }
+    return result;
+}
+
+/*
+ *  Reads up to size bytes of the file from offset into buffer; the
+ *  number of bytes read, less at the end of the file, is stored in got.
+ *  The blocks holding the range are found without walking the file and
+ *  a compressed file is decompressed only in the frames of the range.
+ */
+int DiskReadFile(struct DiskHandler *disk, const char *fileName, long long offset, char *buffer, int size, int *got)
+{
+    struct Descriptor desc;
+    struct Extent *extents;
+    
+    long long blockBytes;
+    long long position;
+    long long start;
+    long long end;
+    int fileIndex;
+    int slotIndex;
+    int count;
+    int *starts;
+    int done;
+    int part = 0;
+    int frameIndex;
+    int result = 0;
+    
+    char *frame = NULL;
+    
+    SelectDisk(disk);
+    *got = 0;
+    
+    if (offset < 0 || size < 0)
+    {
+        printf("Invalid range of the file %s\n", fileName);
+        return 5;
+    }
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    fileIndex = FindDescriptor(disk, fileName, &desc, &slotIndex);
+    
+    if (fileIndex < 0)
+    {
+        printf("Could not find file %s\n", fileName);
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    if (desc.flags & DESC_DIRECTORY)
+    {
+        printf("%s is a directory\n", fileName);
+        UnlockMetadata(disk);
+        return 5;
+    }
+    
+    if (offset >= desc.fileSize) size = 0;
+    else if (size > desc.fileSize - offset) size = (int) (desc.fileSize - offset);
+    
+    if (desc.flags & DESC_INLINE)
+    {
+        AccessInline(&desc, offset, buffer, size, 0);
+        *got = size;
+        UnlockMetadata(disk);
+        return 0;
+    }
+    
+    count = TakeExtents(disk, fileIndex, &desc, &extents, &starts);
+    if (desc.flags & DESC_COMPRESSED) frame = malloc(COMPRESS_FRAME * 2);
+    if (count < 0 || ((desc.flags & DESC_COMPRESSED) && !frame))
+    {
+        printf("Not enough memory to read the file %s\n", fileName);
+        if (count >= 0) KeepExtents(disk, fileIndex, &desc, extents, starts, count);
+        free(frame);
+        UnlockMetadata(disk);
+        return 7;
+    }
+    
+    /* the blocks are read past the stream */
+    if (!disk->map) fflush(disk->file);
+    
+    blockBytes = desc.fileSize - GetTailSize(&desc);
+    for (done = 0; !result && done < size; done += part)
+    {
+        position = offset + done;
+        
+        if (desc.flags & DESC_COMPRESSED)
+        {
+            frameIndex = (int) (position / COMPRESS_FRAME);
+            part = COMPRESS_FRAME - (int) (position % COMPRESS_FRAME);
+            if (part > size - done) part = size - done;
+            
+            result = ReadFrameEnds(disk, extents, starts, count, frameIndex, &start, &end) ||
+                     ReadFrame(disk, extents, starts, count, desc.fileSize, frameIndex, start, end, frame);
+            if (!result) memcpy(buffer + done, frame + position % COMPRESS_FRAME, part);
+        }
+        else if (position < blockBytes)
+        {
+            part = blockBytes - position < size - done ? (int) (blockBytes - position) : size - done;
+            result = ReadCached(disk, extents, starts, count, position, buffer + done, part);
+        }
+        else
+        {
+            part = size - done;
+            ReadDisk(disk, GetTailAddr(disk, &desc) + (position - blockBytes), buffer + done, part);
+        }
+    }
+    
+    KeepExtents(disk, fileIndex, &desc, extents, starts, count);
+    UnlockMetadata(disk);
+    free(frame);
+    
+    if (result)
+    {
+        printf("Could not read the file %s\n", fileName);
+        return 5;
+    }
+    
+    *got = size;
+    return 0;
+}
+
+int DiskWriteFile(struct DiskHandler *disk, const char *fileName, long long offset, const char *data, int size)
+{
+    if (offset < 0 || size < 0)
+    {
+        printf("Invalid range of the file %s\n", fileName);
+        return 5;
+    }
+    return ModifyFile(disk, fileName, offset, data, size, -1);
+}
+
+int DiskAppendFile(struct DiskHandler *disk, const char *fileName, const char *data, int size)
+{
+    if (size < 0)
+    {
+        printf("Invalid range of the file %s\n", fileName);
+        return 5;
+    }
+    return ModifyFile(disk, fileName, -1, data, size, -1);
+}
+
+int DiskTruncateFile(struct DiskHandler *disk, const char *fileName, long long size)
+{
+    if (size < 0)
+    {
+        printf("Invalid size of the file %s\n", fileName);
+        return 5;
+    }
+    return ModifyFile(disk, fileName, size, NULL, 0, size);
+}
+
+int DiskDisplayInfo(struct DiskHandler *disk)
+{
+    struct Header header;
+    
+    long long totalMemory;
+    long long notAvailable;
+    long long rawMemory;
+    double frag;
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    header = disk->header;
+    UnlockMetadata(disk);
+    
+    totalMemory = (long long) header.blocksLimit * header.blockSize;
+    notAvailable = (long long) header.usedBlocks * header.blockSize;
+    
+    /* fragmentation is measured as if the shared blocks were stored for every file, and without the compressed files */
+    rawMemory = notAvailable + (header.sharedBlocks - header.compressedBlocks) * header.blockSize;
+    if (rawMemory > 0) frag = 100.0 - (double)(header.usedMemory - header.compressedMemory) / (double)rawMemory * 100.0;
+    else frag = 0;
+    
+    printf("\n\n      INFORMATION ABOUT DISK %s\n\n", disk->name);
+    printf(" Total memory:          %9lldB\n", totalMemory);
+    printf(" Available memory:      %9lldB\n", totalMemory - notAvailable);
+    printf(" Used memory:           %9lldB\n", header.usedMemory);
+    printf(" Not available:         %9lldB\n", notAvailable);
+    printf(" Int fragmentation:     %.3f%%\n", frag);
+    
+    printf("\n");
+    printf(" Files:                 %d\n", header.usedFiles - header.directories);
+    printf(" Directories:           %d\n", header.directories);
+    printf(" Max number of files:   %d\n", header.filesLimit);
+    printf(" Max length of names:   %d\n", header.nameSize - 1);
+    
+    printf("\n");
+    printf(" Version:               %d\n", header.version);
+    printf(" Block size:            %dB\n", header.blockSize);
+    printf(" Blocks:                %d\n", header.blocksLimit);
+    printf(" Used blocks:           %d\n", header.usedBlocks);
+    printf(" Shared blocks saved:   %lld\n", header.sharedBlocks);
+    printf(" Compressed files:      %lldB in %d blocks\n", header.compressedMemory, header.compressedBlocks);
+    printf(" Journal:               %dB\n", header.journalBlock < 0 ? header.journalSize : header.journalBlocks * header.blockSize);
+    printf(" Table segments:        %d in %d blocks\n", header.segments, header.segmentBlocks);
+    
+    printf("\n");
+    
+    return 0;
+}
+
+/*
+ *  Fills info with the size and the time of adding of the file, without
+ *  printing anything if it does not exist. Returns 3 if it does not.
+ */
+int DiskStatFile(struct DiskHandler *disk, const char *fileName, struct FileInfo *info)
+{
+    struct Descriptor desc;
+    int slotIndex;
+    int fileIndex;
+    
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    fileIndex = FindDescriptor(disk, fileName, &desc, &slotIndex);
+    UnlockMetadata(disk);
+    
+    if (fileIndex < 0) return 3;
+    
+    strcpy(info->name, desc.name);
+    info->size = desc.fileSize;
+    info->timeAdded = desc.timeAdded;
+    info->isDirectory = (desc.flags & DESC_DIRECTORY) != 0;
+    return 0;
+}
+
+/*
+ *  Returns the entries of the directory at path in an array which the
+ *  caller frees.
+ */
+int DiskListFiles(struct DiskHandler *disk, const char *path, struct FileInfo **files, int *count)
+{
+    struct Descriptor desc;
+    struct FileInfo *grown;
+    int size = 16;
+    int index;
+    
+    SelectDisk(disk);
+    *count = 0;
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    index = FindDirectory(disk, path, (int) strlen(path));
+    if (index < -1)
+    {
+        UnlockMetadata(disk);
+        return 3;
+    }
+    
+    *files = malloc(size * sizeof(struct FileInfo));
+    for (index = FirstEntry(disk, index); *files && index >= 0; index = desc.nextSibling)
+    {
+        desc = GetDescriptor(disk, index);
+        
+        if (*count == size)
+        {
+            grown = realloc(*files, size * 2 * sizeof(struct FileInfo));
+            if (!grown) free(*files);
+            *files = grown;
+            size *= 2;
+            if (!grown) break;
+        }
+        
+        strcpy((*files)[*count].name, desc.name);
+        (*files)[*count].size = desc.fileSize;
+        (*files)[*count].timeAdded = desc.timeAdded;
+        (*files)[*count].isDirectory = (desc.flags & DESC_DIRECTORY) != 0;
+        (*count)++;
+    }
+    
+    UnlockMetadata(disk);
+    
+    if (!*files)
+    {
+        printf("Not enough memory to list the files of the disk %s\n", disk->name);
+        *count = 0;
+        return 7;
+    }
+    return 0;
+}
+
+int DiskGetUsage(struct DiskHandler *disk, struct DiskUsage *usage)
+{
+    SelectDisk(disk);
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    usage->blockSize = disk->header.blockSize;
+    usage->blocks = disk->header.blocksLimit;
+    usage->usedBlocks = disk->header.usedBlocks;
+    usage->files = disk->header.filesLimit;
+    usage->usedFiles = disk->header.usedFiles;
+    usage->nameSize = disk->header.nameSize;
+    
+    UnlockMetadata(disk);
+    return 0;
+}
+
+/*
+ *  Number of runs of used blocks and the end of the last one.
+ */
+int CountRuns(struct BlockMap *map, int *end)
+{
+    int runs = 0;
+    int begIndex;
+    int endIndex = 0;
+    
+    for (begIndex = FindBlock(map, 0, 1); begIndex < LIMIT_BLOCKS; begIndex = FindBlock(map, endIndex, 1))
+    {
+        endIndex = FindBlock(map, begIndex, 0);
+        runs++;
+    }
+    
+    if (end) *end = endIndex;
+    return runs;
+}
+
+/*
+ *  Defragmentation step for one file, done with the metadata locked:
+ *  the file is copied to the first free run which holds all of its
+ *  blocks, if that joins its pieces or moves it closer to the start of
+ *  the disk. The new blocks are synced before the descriptor is pointed
+ *  at them, so a crash leaves the file in one of its places. Files
+ *  larger than budget (unless it is negative) are skipped. The number
+ *  of copied bytes is stored in moved.
+ */
+int RelocateFile(struct DiskHandler *disk, int index, long long budget, long long *moved, char *buffer)
+{
+    struct Header header = disk->header;
+    struct Descriptor desc;
+    struct BlockMap *map;
+    struct Extent *extents;
+    struct Extent run;
+    
+    long long to;
+    int count;
+    int blocks;
+    int result;
+    int i;
+    
+    *moved = 0;
+    
+    desc = GetDescriptor(disk, index);
+    if (!desc.isUsed || desc.extentCount == 0) return 0;
+    
+    map = GetBlockMap(disk);
+    count = LoadExtents(disk, &desc, &extents);
+    if (!map || count < 0)
+    {
+        printf("Not enough memory to defragment the disk %s\n", disk->name);
+        if (count >= 0) free(extents);
+        return 7;
+    }
+    
+    blocks = CountBlocks(extents, count);
+    
+    /* blocks shared with other files stay where they are, moving them would store them twice */
+    run.start = -1;
+    if ((budget < 0 || (long long) blocks * SIZE_BLOCK <= budget) && !HasSharedBlocks(disk, extents, count))
+        run.start = AllocateBlocks(map, blocks, &run.length);
+    
+    /* a run which does not hold the whole file or lies higher than the file is not worth the copy */
+    if (run.start >= 0 && (run.length < blocks || (count == 1 && run.start > extents[0].start)))
+    {
+        MarkBlocks(map, run.start, run.length, 0);
+        run.start = -1;
+    }
+    
+    if (run.start < 0)
+    {
+        free(extents);
+        return 0;
+    }
+    
+    /* waits for the exports of the file which are still running */
+    result = LockExtents(disk, 1, extents, count);
+    if (result)
+    {
+        MarkBlocks(map, run.start, run.length, 0);
+        free(extents);
+        return result;
+    }
+    
+    to = GetBlockAddr(run.start);
+    for (i = 0; i < count; ++i)
+    {
+        MoveData(disk, GetBlockAddr(extents[i].start), to, (long long) extents[i].length * SIZE_BLOCK, buffer);
+        to += (long long) extents[i].length * SIZE_BLOCK;
+    }
+    free(extents);
+    
+    if (FlushDisk(disk))
+    {
+        printf("Cannot write the disk %s\n", disk->name);
+        UnlockExtents(disk);
+        MarkBlocks(map, run.start, run.length, 0);
+        return 5;
+    }
+    
+    header.usedBlocks -= ReleaseExtents(disk, map, &header, &desc);
+    StoreExtents(disk, map, &desc, &run, 1);
+    AddReferences(disk, &header, &run, 1);
+    header.usedBlocks += blocks;
+    
+    SetDescriptor(disk, index, desc);
+    SetHeader(disk, header);
+    UnlockExtents(disk);
+    
+    *moved = (long long) blocks * SIZE_BLOCK;
+    return 0;
+}
+
+/*
+ *  Like RelocateFile, for the block of a pack: it is moved to the first
+ *  free block if that is lower.
+ */
+int RelocatePack(struct DiskHandler *disk, int index, long long budget, long long *moved, char *buffer)
+{
+    struct Pack pack;
+    struct BlockMap *map;
+    
+    int start;
+    int length;
+    
+    *moved = 0;
+    
+    pack = GetPack(disk, index);
+    if (pack.live == 0 || (budget >= 0 && SIZE_BLOCK > budget)) return 0;
+    
+    map = GetBlockMap(disk);
+    if (!map)
+    {
+        printf("Not enough memory to defragment the disk %s\n", disk->name);
+        return 7;
+    }
+    
+    start = AllocateBlocks(map, 1, &length);
+    if (start < 0) return 0;
+    if (start > pack.block)
+    {
+        MarkBlocks(map, start, 1, 0);
+        return 0;
+    }
+    
+    /* waits for the exports of its tails and for the inserts still copying into it */
+    if (LockRange(disk, F_WRLCK, GetBlockAddr(pack.block), SIZE_BLOCK))
+    {
+        printf("Cannot lock the blocks of a file in the disk %s\n", disk->name);
+        MarkBlocks(map, start, 1, 0);
+        return 10;
+    }
+    
+    MoveData(disk, GetBlockAddr(pack.block), GetBlockAddr(start), SIZE_BLOCK, buffer);
+    
+    if (FlushDisk(disk))
+    {
+        printf("Cannot write the disk %s\n", disk->name);
+        UnlockExtents(disk);
+        MarkBlocks(map, start, 1, 0);
+        return 5;
+    }
+    
+    MarkBlocks(map, pack.block, 1, 0);
+    pack.block = start;
+    SetPack(disk, index, pack);
+    SetHeader(disk, disk->header);
+    UnlockExtents(disk);
+    
+    *moved = SIZE_BLOCK;
+    return 0;
+}
+
+/*
+ *  Highest block the file takes, with the overflow blocks of its extent
+ *  list, or -1 if it takes none or there is not enough memory.
+ */
+int GetHighestBlock(struct DiskHandler *disk, struct Descriptor *desc)
+{
+    struct ExtentBlock eb;
+    struct Extent *extents;
+    int highest = -1;
+    int count;
+    int block;
+    int i;
+    
+    count = LoadExtents(disk, desc, &extents);
+    if (count < 0) return -1;
+    
+    for (i = 0; i < count; ++i)
+        if (extents[i].length > 0 && extents[i].start + extents[i].length - 1 > highest) highest = extents[i].start + extents[i].length - 1;
+    free(extents);
+    
+    for (block = desc->overflow; block >= 0; block = eb.next)
+    {
+        if (block > highest) highest = block;
+        ReadDisk(disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock));
+    }
+    return highest;
+}
+
+/*
+ *  What holds the block, for the report of a shrink: the index of the
+ *  file whose data or extent list is in it, -2 for a pack or -1 for
+ *  anything else (the tables added by resizing or the journal).
+ */
+int FindBlockOwner(struct DiskHandler *disk, int block)
+{
+    struct Descriptor desc;
+    struct ExtentBlock eb;
+    struct Extent *extents;
+    int overflow;
+    int count;
+    int i;
+    int j;
+    
+    for (i = 0; i < disk->header.descriptorWatermark; ++i)
+    {
+        desc = GetDescriptor(disk, i);
+        if (!desc.isUsed || desc.extentCount == 0) continue;
+        
+        count = LoadExtents(disk, &desc, &extents);
+        for (j = 0; j < count; ++j)
+            if (block >= extents[j].start && block < extents[j].start + extents[j].length) break;
+        if (count >= 0) free(extents);
+        if (j < count) return i;
+        
+        for (overflow = desc.overflow; overflow >= 0; overflow = eb.next)
+        {
+            if (overflow == block) return i;
+            ReadDisk(disk, GetBlockAddr(overflow), &eb, sizeof(struct ExtentBlock));
+        }
+    }
+    
+    for (i = 0; i < disk->header.packWatermark; ++i)
+        if (GetPack(disk, i).live > 0 && GetPack(disk, i).block == block) return -2;
+    return -1;
+}
+
+/*
+ *  Step of shrinking the disk for one file, done with the metadata
+ *  locked: the blocks of the file are moved, the highest first, into
+ *  the lowest free runs while these lie below them, so a file larger
+ *  than any hole below it is split into several runs instead of being
+ *  left at the end of the disk. At most budget bytes (unless it is
+ *  negative) are copied; files with blocks shared with other files are
+ *  not moved. The new blocks are synced before the descriptor is
+ *  pointed at them. The number of copied bytes, with the ones of the
+ *  extent list if it moved too, is stored in moved.
+ */
+int CompactFile(struct DiskHandler *disk, int index, long long budget, long long *moved, char *buffer)
+{
+    struct Header header = disk->header;
+    struct Descriptor desc;
+    struct Descriptor old;
+    struct BlockMap *map;
+    struct Extent *extents;
+    struct Extent *olds = NULL;
+    struct Extent *news = NULL;
+    struct Extent *spares = NULL;
+    struct Extent *grown;
+    struct ExtentBlock eb;
+    
+    int count;
+    int capacity;
+    int pieces = 0;
+    int spareCount = 0;
+    int relist;
+    int block;
+    int copied = 0;
+    int limit;
+    int top;
+    int start;
+    int length;
+    int overflowBlocks = -1;
+    int result;
+    int i;
+    
+    *moved = 0;
+    
+    desc = GetDescriptor(disk, index);
+    if (!desc.isUsed || desc.extentCount == 0) return 0;
+    
+    map = GetBlockMap(disk);
+    count = LoadExtents(disk, &desc, &extents);
+    if (!map || count < 0)
+    {
+        printf("Not enough memory to defragment the disk %s\n", disk->name);
+        if (count >= 0) free(extents);
+        return 7;
+    }
+    
+    /* blocks shared with other files stay where they are, moving them would store them twice */
+    if (HasSharedBlocks(disk, extents, count))
+    {
+        free(extents);
+        return 0;
+    }
+    
+    /* waits for the exports of the file which are still running */
+    result = LockExtents(disk, 1, extents, count);
+    
+    limit = budget < 0 || budget / SIZE_BLOCK > INT_MAX ? INT_MAX : (int) (budget / SIZE_BLOCK);
+    capacity = count;
+    
+    while (!result && copied < limit)
+    {
+        for (top = 0, i = 1; i < count; ++i)
+            if (extents[i].start > extents[top].start) top = i;
+        
+        start = FindBlock(map, 0, 0);
+        if (start >= extents[top].start) break;
+        
+        /* the lowest free blocks are kept for the overflow blocks of the list, which grows */
+        if (GetOverflowBlocks(count + 1) > spareCount)
+        {
+            grown = realloc(spares, sizeof(struct Extent) * (spareCount + 1));
+            if (!grown)
+            {
+                result = 7;
+                break;
+            }
+            spares = grown;
+            spares[spareCount].start = start;
+            spares[spareCount++].length = 1;
+            MarkBlocks(map, start, 1, 1);
+            continue;
+        }
+        
+        /* the free run ends at the latest at the extent, which is used */
+        length = FindBlock(map, start, 1) - start;
+        if (length > extents[top].length) length = extents[top].length;
+        if (length > limit - copied) length = limit - copied;
+        
+        /* every piece can split an extent in two */
+        if (pieces % 16 == 0)
+        {
+            grown = realloc(olds, sizeof(struct Extent) * (pieces + 16));
+            if (grown) olds = grown;
+            grown = grown ? realloc(news, sizeof(struct Extent) * (pieces + 16)) : NULL;
+            if (grown) news = grown;
+            if (!grown) result = 7;
+        }
+        if (!result && count == capacity)
+        {
+            grown = realloc(extents, sizeof(struct Extent) * capacity * 2);
+            if (grown) extents = grown;
+            if (grown) capacity *= 2;
+            else result = 7;
+        }
+        if (result) break;
+        
+        olds[pieces].start = extents[top].start + extents[top].length - length;
+        olds[pieces].length = length;
+        news[pieces].start = start;
+        news[pieces].length = length;
+        
+        MarkBlocks(map, start, length, 1);
+        MoveData(disk, GetBlockAddr(olds[pieces].start), GetBlockAddr(start), (long long) length * SIZE_BLOCK, buffer);
+        
+        extents[top].length -= length;
+        if (extents[top].length == 0) extents[top] = news[pieces];
+        else
+        {
+            memmove(extents + top + 2, extents + top + 1, sizeof(struct Extent) * (count - top - 1));
+            extents[top + 1] = news[pieces];
+            count++;
+        }
+        
+        pieces++;
+        copied += length;
+    }
+    
+    if (result == 7) printf("Not enough memory to defragment the disk %s\n", disk->name);
+    
+    if (!result && pieces > 0 && FlushDisk(disk))
+    {
+        printf("Cannot write the disk %s\n", disk->name);
+        result = 5;
+    }
+    
+    for (i = 0; i < spareCount; ++i) MarkBlocks(map, spares[i].start, 1, 0);
+    
+    /* the overflow blocks of the list are taken again from the lowest free ones if they lie higher */
+    relist = pieces > 0;
+    for (block = desc.overflow; block >= 0 && !relist; block = eb.next)
+    {
+        relist = block > FindBlock(map, 0, 0);
+        ReadDisk(disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock));
+    }
+    
+    /* a longer extent list may not find its overflow blocks, then the file stays where it was */
+    old = desc;
+    if (!result && relist) overflowBlocks = StoreExtents(disk, map, &desc, extents, count);
+    
+    if (overflowBlocks < 0)
+    {
+        for (i = 0; i < pieces; ++i) MarkBlocks(map, news[i].start, news[i].length, 0);
+        copied = 0;
+    }
+    else
+    {
+        copied += overflowBlocks;
+        header.usedBlocks += overflowBlocks;
+        header.usedBlocks -= ReleaseOverflow(map, &old);
+        
+        for (i = 0; i < pieces; ++i)
+        {
+            header.usedBlocks -= ReleaseRun(disk, map, &header, olds[i]);
+            AddReferences(disk, &header, &news[i], 1);
+            header.usedBlocks += news[i].length;
+        }
+        
+        SetDescriptor(disk, index, desc);
+        SetHeader(disk, header);
+    }
+    
+    UnlockExtents(disk);
+    free(extents);
+    free(olds);
+    free(news);
+    free(spares);
+    
+    *moved = (long long) copied * SIZE_BLOCK;
+    return result;
+}
+
+/*
+ *  A file (pack 0) or a pack, with the highest block it takes.
+ */
+struct CompactItem
+{
+    int highest;
+    int index;
+    int pack;
+};
+
+int CompareItems(const void *a, const void *b)
+{
+    const struct CompactItem *x = a;
+    const struct CompactItem *y = b;
+    
+    return (x->highest < y->highest) - (x->highest > y->highest);
+}
+
+/*
+ *  Compaction before a shrink: the files and packs are moved into the
+ *  lowest free blocks, the one ending highest first, a file split over
+ *  as many runs as it takes (see CompactFile). It stops when no free
+ *  block is left below the next one, something cannot be moved or the
+ *  total of copied bytes reaches budget (0 - no limit). The moved
+ *  files, packs and bytes are added to files, packs and total.
+ */
+int CompactDisk(struct DiskHandler *disk, long long budget, long long *total, int *files, int *packs, char *buffer)
+{
+    struct CompactItem *items;
+    struct Descriptor desc;
+    struct Pack pack;
+    struct BlockMap *map;
+    
+    long long moved;
+    int count = 0;
+    int result = 0;
+    int i;
+    
+    if (LockMetadata(disk, 0)) return 10;
+    
+    items = malloc(sizeof(struct CompactItem) * (disk->header.descriptorWatermark + disk->header.packWatermark + 1));
+    for (i = 0; items && i < disk->header.descriptorWatermark; ++i)
+    {
+        desc = GetDescriptor(disk, i);
+        if (!desc.isUsed || desc.extentCount == 0) continue;
+        
+        items[count].highest = GetHighestBlock(disk, &desc);
+        items[count].index = i;
+        items[count].pack = 0;
+        if (items[count].highest >= 0) count++;
+    }
+    for (i = 0; items && i < disk->header.packWatermark; ++i)
+    {
+        pack = GetPack(disk, i);
+        if (pack.live == 0) continue;
+        
+        items[count].highest = pack.block;
+        items[count].index = i;
+        items[count].pack = 1;
+        count++;
+    }
+    
+    UnlockMetadata(disk);
+    
+    if (!items)
+    {
+        printf("Not enough memory to defragment the disk %s\n", disk->name);
+        return 7;
+    }
+    
+    qsort(items, count, sizeof(struct CompactItem), CompareItems);
+    
+    for (i = 0; !result && i < count; ++i)
+    {
+        if (budget > 0 && *total >= budget) break;
+        if (LockMetadata(disk, 1))
+        {
+            result = 10;
+            break;
+        }
+        
+        map = GetBlockMap(disk);
+        moved = 0;
+        
+        if (!map)
+        {
+            printf("Not enough memory to defragment the disk %s\n", disk->name);
+            result = 7;
+        }
+        else if (items[i].highest < FindBlock(map, 0, 0))
+            moved = 0;
+        else if (items[i].pack)
+            result = RelocatePack(disk, items[i].index, budget > 0 ? budget - *total : -1, &moved, buffer);
+        else
+            result = CompactFile(disk, items[i].index, budget > 0 ? budget - *total : -1, &moved, buffer);
+        
+        if (UnlockMetadata(disk) && !result) result = 9;
+        
+        /* what is left above cannot go lower either */
+        if (moved == 0) break;
+        
+        if (items[i].pack) (*packs)++;
+        else (*files)++;
+        *total += moved;
+    }
+    
+    free(items);
+    return result;
+}
+
+/*
+ *  Moves files and packs towards the start of the disk, joining the
+ *  pieces of every file into a single run, until nothing can be moved
+ *  or budget bytes (0 - no limit) have been copied. Every file is moved
+ *  in its own transaction, with the metadata locked only for that file,
+ *  so the disk stays usable in the meantime and an interrupted run can
+ *  be continued later. With shrink set the files ending highest are
+ *  then moved into the holes below them, split if they have to be (see
+ *  CompactDisk), the free blocks at the end of the disk are cut off the
+ *  image and the free blocks which are left below the end are reported.
+ */
+int DiskDefragment(struct DiskHandler *disk, long long budget, int shrink)
+{
+    struct Descriptor desc;
+    
+    char *buffer;
+    
+    long long total = 0;
+    long long compacted;
+    long long moved;
+    int passMoved;
+    int files = 0;
+    int packs = 0;
+    int runsBefore;
+    int runsAfter;
+    int oldLimit;
+    int owner;
+    int end;
+    int result = 0;
+    int i;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    buffer = malloc(COPY_BUFFER);
+    if (!buffer)
+    {
+        printf("Not enough memory to defragment the disk %s\n", disk->name);
+        return 7;
+    }
+    
+    if (LockMetadata(disk, 0))
+    {
+        free(buffer);
+        return 10;
+    }
+    runsBefore = CountRuns(GetBlockMap(disk), NULL);
+    UnlockMetadata(disk);
+    
+    do
+    {
+        passMoved = 0;
+        
+        for (i = 0; !result && i < disk->header.descriptorWatermark + disk->header.packWatermark; ++i)
+        {
+            if (budget > 0 && total >= budget) break;
+            if (LockMetadata(disk, 1))
+            {
+                result = 10;
+                break;
+            }
+            
+            /* files first, so the packs go into the holes which are left */
+            if (i < disk->header.descriptorWatermark)
+                result = RelocateFile(disk, i, budget > 0 ? budget - total : -1, &moved, buffer);
+            else
+                result = RelocatePack(disk, i - disk->header.descriptorWatermark, budget > 0 ? budget - total : -1, &moved, buffer);
+            
+            if (UnlockMetadata(disk) && !result) result = 9;
+            
+            if (moved > 0)
+            {
+                if (i < disk->header.descriptorWatermark) files++;
+                else packs++;
+                total += moved;
+                passMoved = 1;
+            }
+        }
+    }
+    while (!result && passMoved && (budget == 0 || total < budget));
+    
+    /* a file larger than every hole below it is split over them; the files moved free holes under the ones moved before */
+    do
+    {
+        compacted = total;
+        if (!result && shrink) result = CompactDisk(disk, budget, &total, &files, &packs, buffer);
+    }
+    while (!result && shrink && total > compacted && (budget == 0 || total < budget));
+    
+    free(buffer);
+    
+    if (!result && shrink)
+    {
+        if (LockMetadata(disk, 1)) return 10;
+        
+        oldLimit = LIMIT_BLOCKS;
+        CountRuns(GetBlockMap(disk), &end);
+        if (end < 1) end = 1;
+        
+        if (end < oldLimit)
+        {
+            struct Header header = disk->header;
+            header.blocksLimit = end;
+            SetHeader(disk, header);
+            
+            /* the image is cut only after the new size has been committed */
+            if (SyncDisk(disk)) result = 9;
+            else if (ftruncate(fileno(disk->file), GetBlockAddr(end)) != 0) result = 5;
+            
+            if (!result) printf("Shrunk the disk %s from %d to %d blocks\n", disk->name, oldLimit, end);
+        }
+        
+        /* the free blocks left below the end are reported with what holds the last used block */
+        owner = end > disk->header.usedBlocks ? FindBlockOwner(disk, end - 1) : -1;
+        if (owner >= 0) desc = GetDescriptor(disk, owner);
+        if (!result && end > disk->header.usedBlocks)
+            printf("%d free blocks of the disk %s could not be reclaimed, its last used block holds %s%s\n",
+                   end - disk->header.usedBlocks, disk->name,
+                   owner >= 0 ? "the file " : owner == -2 ? "a pack of small files" : "the tables added by resizing or the journal",
+                   owner >= 0 ? desc.name : "");
+        
+        if (UnlockMetadata(disk) && !result) result = 9;
+    }
+    
+    if (LockMetadata(disk, 0)) return 10;
+    runsAfter = CountRuns(GetBlockMap(disk), NULL);
+    UnlockMetadata(disk);
+    
+    printf("Moved %d files and %d packs (%lldB), runs of used blocks: %d -> %d\n", files, packs, total, runsBefore, runsAfter);
+    return result;
+}
+
+/*
+ *  Extends the image to hold the blocks up to newLimit; what it held
+ *  before is made zero, as a new disk is.
+ */
+int ExtendImage(struct DiskHandler *disk, int newLimit)
+{
+    int fd = fileno(disk->file);
+    
+    if (!disk->map) fflush(disk->file);
+    
+    if (ftruncate(fd, GetBlockAddr(LIMIT_BLOCKS)) != 0 || ftruncate(fd, GetBlockAddr(newLimit)) != 0 ||
+        (PREALLOCATE && posix_fallocate(fd, GetBlockAddr(LIMIT_BLOCKS), GetBlockAddr(newLimit) - GetBlockAddr(LIMIT_BLOCKS)) != 0))
+    {
+        printf("Cannot extend the disk %s to %d blocks\n", disk->name, newLimit);
+        return 9;
+    }
+    return 0;
+}
+
+/*
+ *  Moves the journal to the blocks from block on, once everything which
+ *  was committed to the old one is written in place (as a checkpoint
+ *  does), and releases the blocks of the old one if it was in a segment.
+ */
+int MoveJournal(struct DiskHandler *disk, int block, int blocks)
+{
+    struct Header header;
+    
+    if (SyncDisk(disk) || FlushDisk(disk)) return 9;
+    
+    header = disk->header;
+    header.journalBlock = block;
+    header.journalBlocks = blocks;
+    header.journalTail = 0;
+    header.journalStart = 0;
+    header.startSequence = header.journalSequence;
+    
+    WriteDisk(disk, 0, &header, sizeof(struct Header));
+    if (FlushDisk(disk)) return 9;
+    
+    if (disk->header.journalBlock >= 0)
+    {
+        MarkBlocks(GetBlockMap(disk), disk->header.journalBlock, disk->header.journalBlocks, 0);
+        header.usedBlocks -= disk->header.journalBlocks;
+        header.segmentBlocks -= disk->header.journalBlocks;
+    }
+    
+    SetHeader(disk, header);
+    SelectDisk(disk);
+    return 0;
+}
+
+/*
+ *  Grows the disk to diskSize bytes of blocks and filesLimit files (0 -
+ *  as many as now) in place. The tables gain their new records in a
+ *  segment taken from the first new blocks, so the time does not depend
+ *  on what is already stored. Blocks cut off by shrinking the disk come
+ *  back without a segment.
+ */
+int DiskResize(struct DiskHandler *disk, long long diskSize, int filesLimit)
+{
+    struct Segment segment;
+    struct Segment *segments;
+    struct Header header;
+    struct BlockMap *map;
+    
+    long long addr;
+    long long metadata;
+    int newLimit;
+    int journalBlocks = 0;
+    int words;
+    int result = 0;
+    
+    SelectDisk(disk);
+    
+    if (!disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (LockMetadata(disk, 1)) return 10;
+    
+    header = disk->header;
+    map = GetBlockMap(disk);
+    newLimit = diskSize > 0 && (diskSize + SIZE_BLOCK - 1) / SIZE_BLOCK <= INT_MAX - BITS_WORD ? (int) ((diskSize + SIZE_BLOCK - 1) / SIZE_BLOCK) : -1;
+    if (filesLimit == 0) filesLimit = LIMIT_FILES;
+    
+    if (newLimit < 0 || filesLimit < 0 || filesLimit > MAX_LIMIT_FILES)
+    {
+        printf("Cannot resize the disk %s to %lldB and %d files\n", disk->name, diskSize, filesLimit);
+        result = 5;
+    }
+    else if (newLimit < LIMIT_BLOCKS || filesLimit < LIMIT_FILES)
+    {
+        printf("The disk %s can only grow (it has %d blocks and %d files); it is shrunk by defrag\n", disk->name, LIMIT_BLOCKS, LIMIT_FILES);
+        result = 5;
+    }
+    else if (filesLimit == LIMIT_FILES && newLimit <= MAP_BLOCKS)
+    {
+        result = ExtendImage(disk, newLimit);
+        if (!result)
+        {
+            header.blocksLimit = newLimit;
+            SetHeader(disk, header);
+        }
+        
+        if (UnlockMetadata(disk) && !result) result = 9;
+        return result;
+    }
+    
+    if (result)
+    {
+        UnlockMetadata(disk);
+        return result;
+    }
+    
+    segment.previous = header.lastSegment;
+    segment.block = LIMIT_BLOCKS;
+    segment.firstFile = LIMIT_FILES;
+    segment.files = filesLimit - LIMIT_FILES;
+    segment.firstSlot = disk->slots.count;
+    segment.hashSize = 0;
+    segment.firstMapBlock = MAP_BLOCKS;
+    segment.mapBlocks = newLimit > MAP_BLOCKS ? newLimit - MAP_BLOCKS : 0;
+    
+    /* the newest level of the name index has room for all the files */
+    if (segment.files)
+    {
+        segment.hashSize = 1;
+        while (segment.hashSize < filesLimit * 2) segment.hashSize *= 2;
+    }
+    
+    addr = sizeof(struct Segment);
+    segment.descriptors = addr;
+    addr += GetDescriptorSize(SIZE_FILENAME) * (long long) segment.files;
+    segment.packs = addr;
+    addr += sizeof(struct Pack) * (long long) segment.files;
+    segment.slots = addr;
+    addr += sizeof(struct HashSlot) * (long long) segment.hashSize;
+    segment.refs = addr;
+    addr += sizeof(unsigned short) * (long long) segment.mapBlocks;
+    segment.words = addr;
+    words = GetMapWords(MAP_BLOCKS + segment.mapBlocks) - GetMapWords(MAP_BLOCKS);
+    addr += sizeof(unsigned int) * (long long) words;
+    segment.summary = addr;
+    addr += sizeof(int) * (long long) (GetMapPages(MAP_BLOCKS + segment.mapBlocks) - GetMapPages(MAP_BLOCKS));
+    segment.blocks = (int) ((addr + SIZE_BLOCK - 1) / SIZE_BLOCK);
+    
+    /* once the journal cannot hold all the metadata, it is moved to one holding twice as much, as a new disk has */
+    metadata = GetMetadataEnd() + (header.segmentBlocks - (JOURNAL_BLOCK >= 0 ? header.journalBlocks : 0) + (long long) segment.blocks) * SIZE_BLOCK;
+    if ((metadata / SIZE_BLOCK + 2) * SIZE_BLOCK > JOURNAL_SIZE) journalBlocks = (int) (metadata / SIZE_BLOCK + 2) * 2;
+    
+    if ((long long) journalBlocks * SIZE_BLOCK > INT_MAX)
+    {
+        printf("The journal of the disk %s cannot grow to hold all its metadata\n", disk->name);
+        result = 5;
+    }
+    else if (newLimit - LIMIT_BLOCKS < segment.blocks + journalBlocks)
+    {
+        printf("Resizing the disk %s needs at least %d more blocks for its tables\n", disk->name, segment.blocks + journalBlocks);
+        result = 3;
+    }
+    
+    if (!result) result = ExtendImage(disk, newLimit);
+    
+    segments = result ? NULL : realloc(disk->segments, (disk->segmentCount + 1) * sizeof(struct Segment));
+    if (!result && !segments)
+    {
+        printf("Not enough memory to resize the disk %s\n", disk->name);
+        result = 7;
+    }
+    
+    if (result)
+    {
+        UnlockMetadata(disk);
+        return result;
+    }
+    
+    RemapDisk(disk);
+    
+    /* the segment is written before the header refers to it */
+    addr = GetBlockAddr(segment.block);
+    segment.descriptors += addr;
+    segment.packs += addr;
+    segment.slots += addr;
+    segment.refs += addr;
+    segment.words += addr;
+    segment.summary += addr;
+    WriteDisk(disk, addr, &segment, sizeof(struct Segment));
+    
+    if (words > 0 && (MAP_BLOCKS + segment.mapBlocks) % BITS_WORD)
+    {
+        unsigned int word = ~0u << ((MAP_BLOCKS + segment.mapBlocks) % BITS_WORD);
+        WriteDisk(disk, segment.words + sizeof(unsigned int) * (long long) (words - 1), &word, sizeof(unsigned int));
+    }
+    
+    disk->segments = segments;
+    disk->segments[disk->segmentCount++] = segment;
+    if (AddSegmentTables(disk, &segment))
+    {
+        /* nothing refers to the new blocks yet, the disk stays as it was */
+        printf("Not enough memory to resize the disk %s\n", disk->name);
+        FreeMetadata(disk);
+        LoadLayout(disk);
+        UnlockMetadata(disk);
+        return 7;
+    }
+    
+    /* the bits of the last word which were past the end of the map are free now */
+    if (segment.mapBlocks && segment.firstMapBlock % BITS_WORD)
+    {
+        int bit = segment.firstMapBlock % BITS_WORD;
+        int n = BITS_WORD - bit < segment.mapBlocks ? BITS_WORD - bit : segment.mapBlocks;
+        unsigned int word = GetMapWord(map, segment.firstMapBlock / BITS_WORD);
+        
+        word &= ~((n == BITS_WORD ? ~0u : (1u << n) - 1) << bit);
+        SetRecord(disk, &map->words, segment.firstMapBlock / BITS_WORD, &word);
+    }
+    
+    header.blocksLimit = newLimit;
+    header.filesLimit = filesLimit;
+    header.mapBlocks = MAP_BLOCKS + segment.mapBlocks;
+    header.segments++;
+    header.lastSegment = segment.block;
+    header.segmentBlocks += segment.blocks + journalBlocks;
+    header.usedBlocks += segment.blocks + journalBlocks;
+    SetHeader(disk, header);
+    SelectDisk(disk);
+    
+    MarkBlocks(map, segment.block, segment.blocks + journalBlocks, 1);
+    
+    if (journalBlocks) result = MoveJournal(disk, segment.block + segment.blocks, journalBlocks);
+    
+    if (UnlockMetadata(disk) && !result) result = 9;
+    return result;
+}
+
+/*
+ *  Check of a disk (fsck). The packs and the descriptors are read in one
+ *  streaming pass, in large runs of records, and what the check needs of
+ *  every descriptor is kept in a CheckEntry. The overflow blocks of the
+ *  extent lists are then walked by a pool of workers. Every block used
+ *  by a segment, the journal, a pack or a file is claimed in a table of
+ *  the kind of every block and the number of files referring to it; a
+ *  block claimed twice, other than a data block shared by deduplication,
+ *  is cross-linked, and the file claiming it later is damaged and keeps
+ *  no claims at all. A data block of several files which is counted for
+ *  one of them only is cross-linked as well, but as the files copy the
+ *  shared blocks before writing them, it is simply counted again. The map of blocks, its summary and the reference
+ *  counts are then streamed and compared with the claims (blocks used by
+ *  nothing are leaked), and the free lists, the directory tree, the name
+ *  index and the counters of the header with the descriptors.
+ *
+ *  The repair removes the damaged files, links the entries which are not
+ *  reachable into the root directory, rebuilds the free lists, the lists
+ *  of entries and the name index when they are inconsistent and rewrites
+ *  the map, the reference counts and the counters from the claims, all
+ *  in one transaction of the journal. An insert keeps its blocks and its
+ *  descriptor reserved while it copies the data without the lock, which
+ *  looks like leaks, so a disk is repaired only while nothing writes it.
+ */
+#define CLAIM_FREE      0
+#define CLAIM_DATA      1
+#define CLAIM_OVERFLOW  2
+#define CLAIM_PACK      3
+#define CLAIM_SEGMENT   4
+#define CLAIM_JOURNAL   5
+
+#define PACK_UNUSED     0       /* past the watermark */
+#define PACK_FREE       1
+#define PACK_LIVE       2
+#define PACK_BAD        3
+
+#define CHECK_REPORTS   100     /* problems described; the rest are only counted */
+
+const char *CLAIM_NAMES[] = { "free", "data of another file", "a list of extents", "a pack", "a segment", "the journal" };
+
+const char *BLOCK_PROBLEMS[] = { NULL, "used by nothing (leaked)", "in use but free in the map", "past the end of the disk but used in the map",
+                                 "past the end of the map but free in it", "counted with wrong references",
+                                 "shared by files but counted for one (cross-linked)" };
+
+struct CheckEntry
+{
+    long long fileSize;
+    unsigned int hash;
+    int flags;
+    int blocks;
+    int extentCount;
+    int overflow;       /* for free descriptors: next free descriptor */
+    int pack;
+    int parent;
+    int firstChild;
+    int nextSibling;
+    int prevSibling;
+    
+    char isUsed;
+    char bad;           /* damaged: it claims no blocks and the repair removes it */
+    char claimed;       /* 1 - the extents in the descriptor are claimed, 2 - the ones in overflow blocks too */
+    char listed;        /* found in the free list, or in the entries of its directory */
+    char indexed;
+};
+
+/*
+ *  Overflow blocks of the extent list of a file, as read by a worker.
+ */
+struct ChainCheck
+{
+    int index;
+    struct Extent *extents;     /* extents held in the blocks */
+    struct Extent *blocks;      /* the blocks, as runs of one block */
+    int blockCount;
+    const char *error;          /* why the list is damaged, or NULL */
+    int failed;                 /* no memory to read it */
+};
+
+struct Check
+{
+    struct DiskHandler *disk;
+    struct Header header;       /* as found */
+    struct Header fixed;        /* as the tables say it should be */
+    int files;
+    
+    struct CheckEntry *entries;
+    char *kinds;
+    unsigned short *claims;
+    
+    struct Pack *packs;
+    char *packStates;
+    int *packFiles;
+    int packCount;
+    
+    struct ChainCheck *chains;
+    int chainCount;
+    
+    long long problems;
+    int unrepaired;             /* problems the repair cannot fix */
+    int removed;
+    int relink;
+    int reindex;
+    int refreeFiles;
+    int refreePacks;
+    
+    int runType;
+    int runStart;
+    long long leaked;
+    
+    char name[MAX_SIZE_FILENAME];
+    char message[256];
+};
+
+/*
+ *  Counts a problem; returns 1 if it is to be described.
+ */
+int ReportProblem(struct Check *check)
+{
+    if (++check->problems == CHECK_REPORTS + 1) printf("More problems are only counted\n");
+    return check->problems <= CHECK_REPORTS;
+}
+
+/*
+ *  Name of the entry for the messages; it may be damaged.
+ */
+const char *GetCheckName(struct Check *check, int index)
+{
+    struct Descriptor desc = GetDescriptor(check->disk, index);
+    
+    desc.name[SIZE_FILENAME - 1] = '\0';
+    strcpy(check->name, desc.name);
+    return check->name;
+}
+
+int IsRunOnDisk(struct Extent run)
+{
+    return run.start >= 0 && run.length > 0 && run.start <= LIMIT_BLOCKS - run.length;
+}
+
+/*
+ *  Reads like ReadDisk, past the stream, so several workers can read at
+ *  once. Returns 0 on success.
+ */
+int ReadDiskAt(struct DiskHandler *disk, long long addr, void *buffer, int size)
+{
+    double start;
+    
+    if (!disk->map) return ReadAt(fileno(disk->file), buffer, size, addr);
+    
+    start = StartIo();
+    memcpy(buffer, disk->map + addr, size);
+    CountIo(IO_MAP_READ, addr, size, start);
+    return 0;
+}
+
+/*
+ *  Claims length blocks from start for kind. Returns the number of blocks
+ *  claimed before one which is claimed already, or length.
+ */
+int ClaimBlocks(struct Check *check, int start, int length, int kind)
+{
+    int block;
+    
+    for (block = start; block < start + length; ++block)
+    {
+        if (check->kinds[block] == CLAIM_FREE)
+        {
+            check->kinds[block] = (char) kind;
+            check->claims[block] = 1;
+        }
+        else if (check->kinds[block] == CLAIM_DATA && kind == CLAIM_DATA && check->claims[block] < REFS_MAX)
+        {
+            check->claims[block]++;
+        }
+        else
+        {
+            return block - start;
+        }
+    }
+    return length;
+}
+
+void UnclaimBlocks(struct Check *check, int start, int length)
+{
+    int block;
+    
+    for (block = start; block < start + length; ++block)
+        if (--check->claims[block] == 0) check->kinds[block] = CLAIM_FREE;
+}
+
+/*
+ *  Claims the runs for kind, all or none of them. Returns -1 on success,
+ *  otherwise the block which was claimed already.
+ */
+int ClaimRuns(struct Check *check, struct Extent *runs, int count, int kind)
+{
+    int done;
+    int i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        done = ClaimBlocks(check, runs[i].start, runs[i].length, kind);
+        if (done < runs[i].length)
+        {
+            UnclaimBlocks(check, runs[i].start, done);
+            done += runs[i].start;
+            while (i > 0)
+            {
+                --i;
+                UnclaimBlocks(check, runs[i].start, runs[i].length);
+            }
+            return done;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Drops the claims of the file.
+ */
+void UnclaimFile(struct Check *check, int index, struct ChainCheck *chain)
+{
+    struct CheckEntry *entry = &check->entries[index];
+    struct Descriptor desc;
+    int i;
+    
+    if (entry->claimed == 0) return;
+    
+    desc = GetDescriptor(check->disk, index);
+    for (i = 0; i < entry->extentCount && i < DESC_EXTENTS; ++i)
+        UnclaimBlocks(check, desc.extents[i].start, desc.extents[i].length);
+    
+    if (entry->claimed == 2)
+    {
+        for (i = 0; i < chain->blockCount; ++i) UnclaimBlocks(check, chain->blocks[i].start, 1);
+        for (i = 0; i < entry->extentCount - DESC_EXTENTS; ++i) UnclaimBlocks(check, chain->extents[i].start, chain->extents[i].length);
+    }
+    entry->claimed = 0;
+}
+
+/*
+ *  Marks the file as damaged, dropping its claims.
+ */
+void MarkBad(struct Check *check, int index, struct ChainCheck *chain, const char *error)
+{
+    UnclaimFile(check, index, chain);
+    check->entries[index].bad = 1;
+    if (ReportProblem(check)) printf("Descriptor %d (%s): %s\n", index, GetCheckName(check, index), error);
+}
+
+/*
+ *  A file has to have the blocks its size needs; more are only wasted.
+ */
+void CheckFileBlocks(struct Check *check, int index, struct ChainCheck *chain)
+{
+    struct CheckEntry *entry = &check->entries[index];
+    long long tail = entry->flags & DESC_PACKED ? entry->fileSize % SIZE_BLOCK : 0;
+    long long needed = (entry->fileSize - tail + SIZE_BLOCK - 1) / SIZE_BLOCK;
+    
+    if ((entry->flags & (DESC_INLINE | DESC_COMPRESSED | DESC_DIRECTORY)) || entry->blocks == needed) return;
+    
+    sprintf(check->message, "it holds %lldB in %d blocks", entry->fileSize, entry->blocks);
+    if (entry->blocks < needed)
+    {
+        MarkBad(check, index, chain, check->message);
+        return;
+    }
+    
+    check->unrepaired++;
+    if (ReportProblem(check)) printf("Descriptor %d (%s): %s\n", index, GetCheckName(check, index), check->message);
+}
+
+/*
+ *  Claims the blocks of the segments and of the journal moved to them.
+ */
+void ClaimLayout(struct Check *check)
+{
+    struct Extent run;
+    int block;
+    int i;
+    
+    check->fixed.segmentBlocks = 0;
+    
+    for (i = 0; i <= check->disk->segmentCount; ++i)
+    {
+        if (i < check->disk->segmentCount)
+        {
+            run.start = check->disk->segments[i].block;
+            run.length = check->disk->segments[i].blocks;
+        }
+        else if (check->header.journalBlock >= 0)
+        {
+            run.start = check->header.journalBlock;
+            run.length = check->header.journalBlocks;
+        }
+        else break;
+        
+        block = IsRunOnDisk(run) ? ClaimRuns(check, &run, 1, i < check->disk->segmentCount ? CLAIM_SEGMENT : CLAIM_JOURNAL) : run.start;
+        if (block < 0)
+        {
+            check->fixed.segmentBlocks += run.length;
+            continue;
+        }
+        
+        check->unrepaired++;
+        if (!ReportProblem(check)) continue;
+        
+        if (i < check->disk->segmentCount) printf("Segment %d: ", i);
+        else printf("Journal: ");
+        if (IsRunOnDisk(run)) printf("its block %d is also %s\n", block, CLAIM_NAMES[(int) check->kinds[block]]);
+        else printf("its blocks %d-%d are past the end of the disk\n", run.start, run.start + run.length - 1);
+    }
+}
+
+/*
+ *  Reads the packs, checks their free list and claims the blocks of the
+ *  ones in use.
+ */
+void CheckPacks(struct Check *check)
+{
+    struct Extent run;
+    int chunk = COPY_BUFFER / sizeof(struct Pack);
+    int count;
+    int block;
+    int p;
+    
+    for (p = 0; p < check->packCount; p += count)
+    {
+        count = check->packCount - p < chunk ? check->packCount - p : chunk;
+        AccessRecords(check->disk, &check->disk->packs, p, count, (char *) (check->packs + p), 0);
+    }
+    
+    for (p = 0; p < check->packCount; ++p) check->packStates[p] = PACK_LIVE;
+    
+    for (p = check->header.freePack; p != -1; p = check->packs[p].block)
+    {
+        if (p < 0 || p >= check->packCount || check->packStates[p] == PACK_FREE)
+        {
+            if (ReportProblem(check)) printf("The free list of packs is %s at pack %d\n", p < 0 || p >= check->packCount ? "damaged" : "cyclic", p);
+            check->refreePacks = 1;
+            break;
+        }
+        check->packStates[p] = PACK_FREE;
+    }
+    
+    for (p = 0; p < check->packCount; ++p)
+    {
+        if (check->packStates[p] != PACK_LIVE) continue;
+        
+        run.start = check->packs[p].block;
+        run.length = 1;
+        
+        if (!IsRunOnDisk(run) || check->packs[p].used < 0 || check->packs[p].used > SIZE_BLOCK)
+        {
+            check->packStates[p] = PACK_BAD;
+            if (ReportProblem(check)) printf("Pack %d: it is damaged\n", p);
+        }
+        else if ((block = ClaimRuns(check, &run, 1, CLAIM_PACK)) >= 0)
+        {
+            check->packStates[p] = PACK_BAD;
+            if (ReportProblem(check)) printf("Pack %d: its block %d is also %s\n", p, block, CLAIM_NAMES[(int) check->kinds[block]]);
+        }
+    }
+}
+
+/*
+ *  Takes what the check needs from the descriptor, validates it and
+ *  claims the extents it holds.
+ */
+void CheckDescriptor(struct Check *check, int index, struct Descriptor *desc)
+{
+    struct CheckEntry *entry = &check->entries[index];
+    const char *error = NULL;
+    int block;
+    int i;
+    
+    entry->isUsed = desc->isUsed != 0;
+    entry->overflow = desc->overflow;
+    entry->flags = desc->flags;
+    if (!entry->isUsed) return;
+    
+    entry->fileSize = desc->fileSize;
+    entry->extentCount = desc->extentCount;
+    entry->pack = desc->pack;
+    entry->parent = desc->parent;
+    entry->firstChild = desc->firstChild;
+    entry->nextSibling = desc->nextSibling;
+    entry->prevSibling = desc->prevSibling;
+    
+    if (index >= check->header.descriptorWatermark)
+    {
+        if (ReportProblem(check)) printf("Descriptor %d: it is used past the watermark %d\n", index, check->header.descriptorWatermark);
+        check->refreeFiles = 1;
+    }
+    
+    if (!memchr(desc->name, '\0', SIZE_FILENAME) || desc->name[0] == '\0' || strchr(desc->name, '/')) error = "its name is damaged";
+    else if (desc->flags & ~(DESC_INLINE | DESC_PACKED | DESC_COMPRESSED | DESC_DIRECTORY)) error = "it has unknown flags";
+    else if ((desc->flags & DESC_DIRECTORY) && (desc->flags != DESC_DIRECTORY || desc->extentCount != 0)) error = "it is a directory holding data";
+    else if ((desc->flags & DESC_INLINE) && (desc->flags != DESC_INLINE || desc->extentCount != 0 || desc->fileSize > GetInlineSize(desc)))
+        error = "its inline data is damaged";
+    else if ((desc->flags & DESC_PACKED) && (desc->flags & DESC_COMPRESSED)) error = "it is both packed and compressed";
+    else if (desc->fileSize < 0 || desc->extentCount < 0) error = "its size is negative";
+    else if (desc->extentCount > LIMIT_BLOCKS) error = "it has more extents than the disk has blocks";
+    
+    for (i = 0; !error && i < desc->extentCount && i < DESC_EXTENTS; ++i)
+    {
+        if (!IsRunOnDisk(desc->extents[i])) error = "an extent points past the end of the disk";
+        else entry->blocks += desc->extents[i].length;
+    }
+    
+    if (!error && desc->extentCount > DESC_EXTENTS && (desc->overflow < 0 || desc->overflow >= LIMIT_BLOCKS))
+        error = "its list of extents points past the end of the disk";
+    
+    if (!error && (desc->flags & DESC_PACKED))
+    {
+        if (desc->pack < 0 || desc->pack >= check->packCount || check->packStates[desc->pack] == PACK_FREE) error = "its tail is in a free pack";
+        else if (check->packStates[desc->pack] == PACK_BAD) error = "its tail is in a damaged pack";
+        else if (desc->packOffset < 0 || desc->packOffset + GetTailSize(desc) > check->packs[desc->pack].used) error = "its tail is past the end of its pack";
+    }
+    
+    if (error)
+    {
+        entry->bad = 1;
+        desc->name[SIZE_FILENAME - 1] = '\0';
+        if (ReportProblem(check)) printf("Descriptor %d (%s): %s\n", index, desc->name, error);
+        return;
+    }
+    
+    entry->hash = HashName(desc->parent, desc->name);
+    
+    if (desc->extentCount <= DESC_EXTENTS && desc->overflow != -1)
+    {
+        if (ReportProblem(check)) printf("Descriptor %d (%s): it points to a list of extents it does not have\n", index, desc->name);
+        check->relink = 1;
+    }
+    
+    block = ClaimRuns(check, desc->extents, desc->extentCount < DESC_EXTENTS ? desc->extentCount : DESC_EXTENTS, CLAIM_DATA);
+    if (block >= 0)
+    {
+        sprintf(check->message, "its block %d is also %s", block, CLAIM_NAMES[(int) check->kinds[block]]);
+        MarkBad(check, index, NULL, check->message);
+        return;
+    }
+    
+    entry->claimed = 1;
+    if (desc->extentCount <= DESC_EXTENTS) CheckFileBlocks(check, index, NULL);
+}
+
+/*
+ *  The streaming pass over the descriptors.
+ */
+int CheckDescriptors(struct Check *check)
+{
+    struct Table *table = &check->disk->descriptors;
+    struct Descriptor desc;
+    
+    int chunk = COPY_BUFFER / table->recordSize;
+    int count;
+    int first;
+    int i;
+    
+    char *buffer = malloc((size_t) chunk * table->recordSize);
+    if (!buffer) return 7;
+    
+    for (first = 0; first < check->files; first += count)
+    {
+        count = check->files - first < chunk ? check->files - first : chunk;
+        AccessRecords(check->disk, table, first, count, buffer, 0);
+        
+        for (i = 0; i < count; ++i)
+        {
+            memcpy(&desc, buffer + (size_t) i * table->recordSize, table->recordSize);
+            CheckDescriptor(check, first + i, &desc);
+        }
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+/*
+ *  Reads the overflow blocks of the extent list of a file. The walk ends
+ *  after as many blocks as the list needs, so a cyclic list is found
+ *  without remembering the blocks.
+ */
+void WalkChain(struct Check *check, struct ChainCheck *chain)
+{
+    struct CheckEntry *entry = &check->entries[chain->index];
+    struct ExtentBlock eb;
+    
+    int count = entry->extentCount - DESC_EXTENTS;
+    int needed = GetOverflowBlocks(entry->extentCount);
+    int loaded = 0;
+    int block = entry->overflow;
+    int i;
+    
+    chain->extents = malloc(sizeof(struct Extent) * count);
+    chain->blocks = malloc(sizeof(struct Extent) * needed);
+    if (!chain->extents || !chain->blocks)
+    {
+        chain->failed = 1;
+        return;
+    }
+    
+    while (!chain->error && block != -1)
+    {
+        if (chain->blockCount == needed) chain->error = "its list of extents is longer than it needs to be, or cyclic";
+        else if (block < 0 || block >= LIMIT_BLOCKS) chain->error = "its list of extents points past the end of the disk";
+        else if (ReadDiskAt(check->disk, GetBlockAddr(block), &eb, sizeof(struct ExtentBlock))) chain->error = "its list of extents cannot be read";
+        else if (eb.count <= 0 || eb.count > GetExtentsPerBlock() || eb.count > count - loaded) chain->error = "its list of extents is damaged";
+        else if (ReadDiskAt(check->disk, GetBlockAddr(block) + sizeof(struct ExtentBlock), chain->extents + loaded, sizeof(struct Extent) * eb.count))
+            chain->error = "its list of extents cannot be read";
+        else
+        {
+            for (i = loaded; i < loaded + eb.count; ++i)
+            {
+                if (!IsRunOnDisk(chain->extents[i])) chain->error = "an extent points past the end of the disk";
+                else entry->blocks += chain->extents[i].length;
+            }
+            
+            loaded += eb.count;
+            chain->blocks[chain->blockCount].start = block;
+            chain->blocks[chain->blockCount].length = 1;
+            chain->blockCount++;
+            block = eb.next;
+        }
+    }
+    
+    if (!chain->error && loaded < count) chain->error = "its list of extents ends too early";
+}
+
+/*
+ *  Lists of extents are handed out to a pool of workers, which only read
+ *  the disk; the claims are made by the calling thread afterwards.
+ */
+struct ChainJob
+{
+    struct Check *check;
+    int next;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_t lock;
+#endif
+};
+
+int TakeChain(struct ChainJob *job)
+{
+    int i;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_lock(&job->lock);
+#endif
+    i = job->next++;
+#ifdef PARALLEL_COPY
+    pthread_mutex_unlock(&job->lock);
+#endif
+
+    return i;
+}
+
+void *ChainWorker(void *arg)
+{
+    struct ChainJob *job = arg;
+    int i;
+    
+    while ((i = TakeChain(job)) < job->check->chainCount) WalkChain(job->check, &job->check->chains[i]);
+    return NULL;
+}
+
+/*
+ *  Walks the lists of extents of the files with overflow blocks, with
+ *  COPY_THREADS workers, and claims the blocks they hold in the order of
+ *  the descriptors.
+ */
+int CheckChains(struct Check *check)
+{
+    struct ChainJob job;
+    struct ChainCheck *chain;
+    
+    int block;
+    int failed = 0;
+    int i;
+    
+    for (i = 0; i < check->files; ++i)
+        if (check->entries[i].isUsed && !check->entries[i].bad && check->entries[i].extentCount > DESC_EXTENTS) check->chainCount++;
+    
+    if (check->chainCount == 0) return 0;
+    
+    check->chains = calloc(check->chainCount, sizeof(struct ChainCheck));
+    if (!check->chains) return 7;
+    
+    check->chainCount = 0;
+    for (i = 0; i < check->files; ++i)
+        if (check->entries[i].isUsed && !check->entries[i].bad && check->entries[i].extentCount > DESC_EXTENTS)
+            check->chains[check->chainCount++].index = i;
+    
+    /* the workers read past the stream */
+    if (!check->disk->map) fflush(check->disk->file);
+    
+    job.check = check;
+    job.next = 0;
+
+#ifdef PARALLEL_COPY
+    pthread_mutex_init(&job.lock, NULL);
+    RunWorkers(ChainWorker, &job, COPY_THREADS < check->chainCount ? COPY_THREADS : check->chainCount);
+    pthread_mutex_destroy(&job.lock);
+#else
+    ChainWorker(&job);
+#endif
+
+    for (i = 0; i < check->chainCount; ++i)
+    {
+        chain = &check->chains[i];
+        
+        if (chain->failed) failed = 1;
+        else if (chain->error) MarkBad(check, chain->index, chain, chain->error);
+        else if ((block = ClaimRuns(check, chain->blocks, chain->blockCount, CLAIM_OVERFLOW)) >= 0)
+        {
+            sprintf(check->message, "its block %d is also %s", block, CLAIM_NAMES[(int) check->kinds[block]]);
+            MarkBad(check, chain->index, chain, check->message);
+        }
+        else if ((block = ClaimRuns(check, chain->extents, check->entries[chain->index].extentCount - DESC_EXTENTS, CLAIM_DATA)) >= 0)
+        {
+            sprintf(check->message, "its block %d is also %s", block, CLAIM_NAMES[(int) check->kinds[block]]);
+            for (block = 0; block < chain->blockCount; ++block) UnclaimBlocks(check, chain->blocks[block].start, 1);
+            MarkBad(check, chain->index, chain, check->message);
+        }
+        else
+        {
+            check->entries[chain->index].claimed = 2;
+            CheckFileBlocks(check, chain->index, chain);
+        }
+        
+        free(chain->extents);
+        free(chain->blocks);
+    }
+    
+    free(check->chains);
+    check->chains = NULL;
+    return failed ? 7 : 0;
+}
+
+/*
+ *  Counts the files which are kept and checks the packs holding their
+ *  tails; packs holding none are released.
+ */
+void CountEntries(struct Check *check)
+{
+    struct CheckEntry *entry;
+    int used = 0;
+    int p;
+    int i;
+    
+    check->fixed.usedFiles = 0;
+    check->fixed.directories = 0;
+    check->fixed.usedMemory = 0;
+    check->fixed.compressedMemory = 0;
+    check->fixed.compressedBlocks = 0;
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        entry = &check->entries[i];
+        if (!entry->isUsed || entry->bad) continue;
+        
+        used = i + 1;
+        check->fixed.usedFiles++;
+        check->fixed.usedMemory += entry->fileSize;
+        if (entry->flags & DESC_DIRECTORY) check->fixed.directories++;
+        if (entry->flags & DESC_PACKED) check->packFiles[entry->pack]++;
+        if (entry->flags & DESC_COMPRESSED)
+        {
+            check->fixed.compressedMemory += entry->fileSize;
+            check->fixed.compressedBlocks += entry->blocks;
+        }
+    }
+    
+    if (used > check->fixed.descriptorWatermark) check->fixed.descriptorWatermark = used;
+    
+    for (p = 0; p < check->packCount; ++p)
+    {
+        if (check->packStates[p] == PACK_FREE) continue;
+        
+        if (check->packFiles[p] == 0)
+        {
+            if (check->packStates[p] == PACK_LIVE)
+            {
+                UnclaimBlocks(check, check->packs[p].block, 1);
+                if (ReportProblem(check)) printf("Pack %d: it holds no files\n", p);
+            }
+            check->packStates[p] = PACK_FREE;
+            check->refreePacks = 1;
+        }
+        else if (check->packs[p].live != check->packFiles[p])
+        {
+            if (ReportProblem(check)) printf("Pack %d: it counts %d files, it holds %d\n", p, check->packs[p].live, check->packFiles[p]);
+            check->refreePacks = 1;
+        }
+    }
+    
+    p = check->header.openPack;
+    if (p != -1 && (p < 0 || p >= check->packCount || check->packStates[p] != PACK_LIVE))
+    {
+        if (ReportProblem(check)) printf("The open pack %d is not in use\n", p);
+        check->fixed.openPack = -1;
+    }
+}
+
+/*
+ *  Every descriptor below the watermark which is not used has to be in
+ *  the free list, once.
+ */
+void CheckFreeDescriptors(struct Check *check)
+{
+    int limit = check->fixed.descriptorWatermark;
+    int lost = 0;
+    int i;
+    
+    check->fixed.reservedFiles = 0;
+    
+    for (i = check->header.freeDescriptor; i != -1; i = check->entries[i].overflow)
+    {
+        if (i < 0 || i >= limit || check->entries[i].isUsed || (check->entries[i].flags & DESC_RESERVED) || check->entries[i].listed)
+        {
+            if (ReportProblem(check))
+            {
+                if (i < 0 || i >= limit) printf("The free list of descriptors points to %d, past the watermark\n", i);
+                else if (check->entries[i].isUsed) printf("The free list of descriptors holds the used descriptor %d\n", i);
+                else if (check->entries[i].flags & DESC_RESERVED) printf("The free list of descriptors holds the reserved descriptor %d\n", i);
+                else printf("The free list of descriptors is cyclic at %d\n", i);
+            }
+            check->refreeFiles = 1;
+            break;
+        }
+        check->entries[i].listed = 1;
+    }
+    
+    /* the reserved ones belong to inserts which have not ended */
+    for (i = 0; i < limit; ++i)
+    {
+        if (check->entries[i].isUsed || check->entries[i].listed) continue;
+        if (check->entries[i].flags & DESC_RESERVED) check->fixed.reservedFiles++;
+        else lost++;
+    }
+    
+    if (lost > 0)
+    {
+        if (ReportProblem(check)) printf("%d free descriptors are not in the free list\n", lost);
+        check->refreeFiles = 1;
+    }
+}
+
+/*
+ *  Walks the entries of the directory dir (-1 - the root) from first,
+ *  pushing the directories found on the stack.
+ */
+void CheckEntryList(struct Check *check, int dir, int first, int *stack, int *top)
+{
+    struct CheckEntry *entry;
+    int prev = -1;
+    int i;
+    
+    for (i = first; i != -1; prev = i, i = entry->nextSibling)
+    {
+        if (i < 0 || i >= check->files || !check->entries[i].isUsed || check->entries[i].listed)
+        {
+            if (ReportProblem(check))
+            {
+                if (dir < 0) printf("The root directory: ");
+                else printf("Descriptor %d (%s): ", dir, GetCheckName(check, dir));
+                
+                if (i < 0 || i >= check->files || !check->entries[i].isUsed) printf("its entries lead to the free descriptor %d\n", i);
+                else printf("its entries lead to descriptor %d twice, or cross another list\n", i);
+            }
+            check->relink = 1;
+            return;
+        }
+        
+        entry = &check->entries[i];
+        entry->listed = 1;
+        
+        if (entry->parent != dir || entry->prevSibling != prev)
+        {
+            if (ReportProblem(check)) printf("Descriptor %d (%s): its links to its directory are damaged\n", i, GetCheckName(check, i));
+            check->relink = 1;
+        }
+        
+        if ((entry->flags & DESC_DIRECTORY) && !entry->bad && entry->parent == dir) stack[(*top)++] = i;
+    }
+}
+
+/*
+ *  Walks the tree from the root; every entry kept has to be found once.
+ */
+int CheckTree(struct Check *check)
+{
+    int *stack = malloc(sizeof(int) * (check->files > 0 ? check->files : 1));
+    int top = 0;
+    int dir;
+    int i;
+    
+    if (!stack) return 7;
+    
+    /* listed meant "in the free list" for the free descriptors */
+    for (i = 0; i < check->files; ++i) check->entries[i].listed = 0;
+    
+    CheckEntryList(check, -1, check->header.rootFirst, stack, &top);
+    while (top > 0)
+    {
+        dir = stack[--top];
+        CheckEntryList(check, dir, check->entries[dir].firstChild, stack, &top);
+    }
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        if (!check->entries[i].isUsed || check->entries[i].bad || check->entries[i].listed) continue;
+        
+        if (ReportProblem(check)) printf("Descriptor %d (%s): it cannot be reached from the root directory\n", i, GetCheckName(check, i));
+        check->relink = 1;
+    }
+    
+    free(stack);
+    return 0;
+}
+
+/*
+ *  Reads the slots of a level of the name index; returns NULL if there
+ *  is no memory for them.
+ */
+struct HashSlot *ReadHashLevel(struct Check *check, int level, int *first, int *size)
+{
+    struct HashSlot *slots;
+    
+    *first = GetHashLevel(check->disk, level, size);
+    slots = malloc(sizeof(struct HashSlot) * (*size > 0 ? *size : 1));
+    if (slots && *size > 0) AccessRecords(check->disk, &check->disk->slots, *first, *size, (char *) slots, 0);
+    return slots;
+}
+
+/*
+ *  Every entry kept has to be in the name index once, in a slot a lookup
+ *  of its name reaches.
+ */
+int CheckIndex(struct Check *check)
+{
+    struct HashSlot *slots;
+    struct CheckEntry *entry;
+    
+    int first;
+    int size;
+    int level;
+    int index;
+    int i;
+    int j;
+    
+    for (level = 0; level <= check->disk->segmentCount; ++level)
+    {
+        slots = ReadHashLevel(check, level, &first, &size);
+        if (!slots) return 7;
+        
+        for (i = 0; i < size; ++i)
+        {
+            if (slots[i].descriptor == SLOT_EMPTY || slots[i].descriptor == SLOT_DELETED) continue;
+            
+            index = slots[i].descriptor - 1;
+            entry = index >= 0 && index < check->files ? &check->entries[index] : NULL;
+            
+            /* the slots of damaged files go with them */
+            if (entry && entry->bad) continue;
+            
+            for (j = slots[i].hash & (size - 1); j != i && slots[j].descriptor != SLOT_EMPTY; j = (j + 1) & (size - 1));
+            
+            if (!entry || !entry->isUsed || slots[i].hash != entry->hash || entry->indexed || j != i)
+            {
+                if (ReportProblem(check))
+                {
+                    printf("Slot %d of the name index: ", first + i);
+                    if (!entry || !entry->isUsed) printf("it holds the free descriptor %d\n", index);
+                    else if (slots[i].hash != entry->hash) printf("it holds a wrong name of descriptor %d\n", index);
+                    else if (entry->indexed) printf("descriptor %d is indexed twice\n", index);
+                    else printf("descriptor %d is not reached by a lookup\n", index);
+                }
+                check->reindex = 1;
+            }
+            
+            if (entry) entry->indexed = 1;
+        }
+        
+        free(slots);
+    }
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        if (!check->entries[i].isUsed || check->entries[i].bad || check->entries[i].indexed) continue;
+        
+        if (ReportProblem(check)) printf("Descriptor %d (%s): it is not in the name index\n", i, GetCheckName(check, i));
+        check->reindex = 1;
+    }
+    return 0;
+}
+
+/*
+ *  Adds a block in the given state (an index of BLOCK_PROBLEMS, 0 - in
+ *  order) to the run being reported; runs of blocks with the same
+ *  problem are reported at once.
+ */
+void AddBlockState(struct Check *check, int block, int type)
+{
+    if (type == check->runType) return;
+    
+    if (check->runType && ReportProblem(check))
+    {
+        if (block - check->runStart == 1) printf("Block %d is %s\n", check->runStart, BLOCK_PROBLEMS[check->runType]);
+        else printf("Blocks %d-%d are %s\n", check->runStart, block - 1, BLOCK_PROBLEMS[check->runType]);
+    }
+    
+    check->runType = type;
+    check->runStart = block;
+}
+
+/*
+ *  Word of the map as the claims say it should be: blocks past the end
+ *  of the disk are free and bits past the end of the map are set.
+ */
+unsigned int GetClaimedWord(struct Check *check, int word)
+{
+    unsigned int bits = 0;
+    int block;
+    int i;
+    
+    for (i = 0; i < BITS_WORD; ++i)
+    {
+        block = word * BITS_WORD + i;
+        if (block >= MAP_BLOCKS || (block < LIMIT_BLOCKS && check->kinds[block] != CLAIM_FREE)) bits |= 1u << i;
+    }
+    return bits;
+}
+
+/*
+ *  Streams the map of blocks and the reference counts, compares them
+ *  with the claims and, with repair, writes the ones which differ.
+ */
+int CheckBlockMap(struct Check *check, int repair)
+{
+    struct DiskHandler *disk = check->disk;
+    struct BlockMap *map = GetBlockMap(disk);
+    
+    int chunk = COPY_BUFFER / sizeof(unsigned int);
+    int pages = map->summary.count;
+    int *summary = malloc(sizeof(int) * pages);
+    int *found = calloc(pages, sizeof(int));
+    int *claimed = calloc(pages, sizeof(int));
+    unsigned int *words = malloc(sizeof(unsigned int) * chunk);
+    unsigned short *refs = (unsigned short *) words;
+    
+    unsigned int expected;
+    unsigned int inMap;
+    int block;
+    int count;
+    int first;
+    int page;
+    int i;
+    int j;
+    
+    if (!summary || !found || !claimed || !words)
+    {
+        free(summary);
+        free(found);
+        free(claimed);
+        free(words);
+        return 7;
+    }
+    
+    check->runType = 0;
+    for (first = 0; first < map->count; first += count)
+    {
+        count = map->count - first < chunk ? map->count - first : chunk;
+        AccessRecords(disk, &map->words, first, count, (char *) words, 0);
+        
+        for (i = 0; i < count; ++i)
+        {
+            expected = GetClaimedWord(check, first + i);
+            block = (first + i) * BITS_WORD;
+            page = block / MAP_PAGE_BLOCKS;
+            
+            /* the summary counts the blocks of the map only */
+            inMap = MAP_BLOCKS - block >= BITS_WORD ? ~0u : (1u << (MAP_BLOCKS - block)) - 1;
+            found[page] += CountBits(words[i] & inMap);
+            claimed[page] += CountBits(expected & inMap);
+            
+            if (words[i] == expected)
+            {
+                AddBlockState(check, block, 0);
+                continue;
+            }
+            
+            for (j = 0; j < BITS_WORD; ++j, ++block)
+            {
+                if (((words[i] ^ expected) >> j & 1) == 0) AddBlockState(check, block, 0);
+                else if (block >= MAP_BLOCKS) AddBlockState(check, block, 4);
+                else if (block >= LIMIT_BLOCKS) AddBlockState(check, block, 3);
+                else if (expected >> j & 1) AddBlockState(check, block, 2);
+                else
+                {
+                    AddBlockState(check, block, 1);
+                    check->leaked++;
+                }
+            }
+            
+            if (repair) SetRecord(disk, &map->words, first + i, &expected);
+        }
+    }
+    AddBlockState(check, map->count * BITS_WORD, 0);
+    
+    AccessRecords(disk, &map->summary, 0, pages, (char *) summary, 0);
+    for (page = 0; page < pages; ++page)
+    {
+        if (summary[page] != found[page] && ReportProblem(check))
+            printf("Page %d of the map counts %d used blocks, it has %d\n", page, summary[page], found[page]);
+        if (repair && summary[page] != claimed[page]) SetRecord(disk, &map->summary, page, &claimed[page]);
+    }
+    
+    chunk = COPY_BUFFER / sizeof(unsigned short);
+    for (first = 0; first < disk->refs.count; first += count)
+    {
+        count = disk->refs.count - first < chunk ? disk->refs.count - first : chunk;
+        AccessRecords(disk, &disk->refs, first, count, (char *) refs, 0);
+        
+        for (i = 0; i < count; ++i)
+        {
+            block = first + i;
+            expected = block < LIMIT_BLOCKS && check->kinds[block] == CLAIM_DATA ? check->claims[block] : 0;
+            
+            if (refs[i] == expected)
+            {
+                AddBlockState(check, block, 0);
+                continue;
+            }
+            
+            AddBlockState(check, block, expected > 1 && refs[i] <= 1 ? 6 : 5);
+            if (repair) SetRefs(disk, block, (int) expected);
+        }
+    }
+    AddBlockState(check, disk->refs.count, 0);
+    
+    free(summary);
+    free(found);
+    free(claimed);
+    free(words);
+    return 0;
+}
+
+void CompareCounter(struct Check *check, const char *name, long long found, long long fixed)
+{
+    if (found != fixed && ReportProblem(check)) printf("The header counts %lld %s, the disk has %lld\n", found, name, fixed);
+}
+
+/*
+ *  Compares the counters of the header with the ones computed from the
+ *  tables.
+ */
+void CheckCounters(struct Check *check)
+{
+    struct Header *header = &check->header;
+    struct Header *fixed = &check->fixed;
+    int block;
+    
+    fixed->usedBlocks = 0;
+    fixed->sharedBlocks = 0;
+    
+    for (block = 0; block < LIMIT_BLOCKS; ++block)
+    {
+        if (check->kinds[block] == CLAIM_FREE) continue;
+        
+        fixed->usedBlocks++;
+        if (check->kinds[block] == CLAIM_DATA) fixed->sharedBlocks += check->claims[block] - 1;
+    }
+    
+    CompareCounter(check, "files and directories", header->usedFiles, fixed->usedFiles);
+    CompareCounter(check, "directories", header->directories, fixed->directories);
+    CompareCounter(check, "reserved descriptors", header->reservedFiles, fixed->reservedFiles);
+    CompareCounter(check, "bytes of files", header->usedMemory, fixed->usedMemory);
+    CompareCounter(check, "used blocks", header->usedBlocks, fixed->usedBlocks);
+    CompareCounter(check, "shared blocks", header->sharedBlocks, fixed->sharedBlocks);
+    CompareCounter(check, "bytes of compressed files", header->compressedMemory, fixed->compressedMemory);
+    CompareCounter(check, "blocks of compressed files", header->compressedBlocks, fixed->compressedBlocks);
+    CompareCounter(check, "blocks of segments", header->segmentBlocks, fixed->segmentBlocks);
+}
+
+/*
+ *  Links the entries again from their parents: an entry whose directory
+ *  is gone, or which is in a cycle of directories, goes to the root.
+ *  Descriptors whose links change are written.
+ */
+void RepairLinks(struct Check *check)
+{
+    struct CheckEntry *entries = check->entries;
+    struct Descriptor desc;
+    struct Descriptor old;
+    
+    int moved = 0;
+    int parent;
+    int i;
+    int j;
+    
+    /* listed marks the entries whose way to the root is known (2) or being followed (1) */
+    for (i = 0; i < check->files; ++i)
+    {
+        entries[i].listed = 0;
+        if (!entries[i].isUsed) continue;
+        
+        parent = entries[i].parent;
+        if (parent != -1 && (parent < 0 || parent >= check->files || !entries[parent].isUsed || !(entries[parent].flags & DESC_DIRECTORY)))
+            entries[i].parent = -1;
+    }
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        if (!entries[i].isUsed || entries[i].listed) continue;
+        
+        for (j = i; j != -1 && entries[j].listed == 0; j = entries[j].parent) entries[j].listed = 1;
+        
+        /* the way ends in a cycle when it comes back to an entry being followed, which is cut off there */
+        parent = j != -1 && entries[j].listed == 1 ? j : -1;
+        for (j = i; j != -1 && entries[j].listed == 1; j = entries[j].parent) entries[j].listed = 2;
+        if (parent != -1) entries[parent].parent = -1;
+    }
+    
+    /* the lists are built backwards, so the entries are listed in the order of the descriptors */
+    check->fixed.rootFirst = -1;
+    for (i = 0; i < check->files; ++i)
+        if (entries[i].isUsed && (entries[i].flags & DESC_DIRECTORY)) entries[i].firstChild = -1;
+    
+    for (i = check->files - 1; i >= 0; --i)
+    {
+        if (!entries[i].isUsed) continue;
+        
+        parent = entries[i].parent;
+        entries[i].prevSibling = -1;
+        entries[i].nextSibling = parent < 0 ? check->fixed.rootFirst : entries[parent].firstChild;
+        if (entries[i].nextSibling >= 0) entries[entries[i].nextSibling].prevSibling = i;
+        
+        if (parent < 0) check->fixed.rootFirst = i;
+        else entries[parent].firstChild = i;
+    }
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        if (!entries[i].isUsed) continue;
+        
+        desc = GetDescriptor(check->disk, i);
+        old = desc;
+        
+        if (desc.parent != entries[i].parent)
+        {
+            entries[i].hash = HashName(entries[i].parent, desc.name);
+            check->reindex = 1;
+            moved++;
+        }
+        
+        desc.parent = entries[i].parent;
+        desc.nextSibling = entries[i].nextSibling;
+        desc.prevSibling = entries[i].prevSibling;
+        if (desc.flags & DESC_DIRECTORY) desc.firstChild = entries[i].firstChild;
+        if (desc.extentCount <= DESC_EXTENTS) desc.overflow = -1;
+        
+        if (desc.parent != old.parent || desc.nextSibling != old.nextSibling || desc.prevSibling != old.prevSibling ||
+            desc.firstChild != old.firstChild || desc.overflow != old.overflow)
+            SetDescriptor(check->disk, i, desc);
+    }
+    
+    if (moved > 0) printf("Moved %d entries to the root directory\n", moved);
+}
+
+/*
+ *  Builds the name index again: all entries go to its newest level.
+ */
+int RepairIndex(struct Check *check)
+{
+    struct HashSlot *slots;
+    struct HashSlot *built;
+    
+    int newest = 0;
+    int probes;
+    int first;
+    int size;
+    int level;
+    int i;
+    int j;
+    
+    for (level = 0; level <= check->disk->segmentCount; ++level)
+    {
+        GetHashLevel(check->disk, level, &size);
+        if (size > 0) newest = level;
+    }
+    
+    for (level = 0; level <= check->disk->segmentCount; ++level)
+    {
+        slots = ReadHashLevel(check, level, &first, &size);
+        built = calloc(size > 0 ? size : 1, sizeof(struct HashSlot));
+        if (!slots || !built)
+        {
+            free(slots);
+            free(built);
+            return 7;
+        }
+        
+        for (i = 0; level == newest && i < check->files; ++i)
+        {
+            if (!check->entries[i].isUsed) continue;
+            
+            for (j = check->entries[i].hash & (size - 1), probes = 0; probes < size && built[j].descriptor != SLOT_EMPTY; j = (j + 1) & (size - 1))
+                probes++;
+            
+            if (probes == size)
+            {
+                if (ReportProblem(check)) printf("Descriptor %d: there is no room for it in the name index\n", i);
+                check->unrepaired++;
+                continue;
+            }
+            
+            built[j].descriptor = i + 1;
+            built[j].hash = check->entries[i].hash;
+        }
+        
+        /* only the slots which change are written */
+        for (i = 0; i < size; ++i)
+            if (slots[i].descriptor != built[i].descriptor || (built[i].descriptor != SLOT_EMPTY && slots[i].hash != built[i].hash))
+                SetHashSlot(check->disk, first + i, built[i]);
+        
+        free(slots);
+        free(built);
+    }
+    return 0;
+}
+
+/*
+ *  Builds the free lists of descriptors and packs again, from the last
+ *  one down, so they are handed out in order.
+ */
+void RepairFreeLists(struct Check *check)
+{
+    struct Descriptor desc;
+    struct Pack pack;
+    int i;
+    
+    if (check->refreeFiles)
+    {
+        check->fixed.freeDescriptor = -1;
+        
+        for (i = check->fixed.descriptorWatermark - 1; i >= 0; --i)
+        {
+            if (check->entries[i].isUsed || (check->entries[i].flags & DESC_RESERVED)) continue;
+            
+            desc = GetDescriptor(check->disk, i);
+            if (desc.isUsed || desc.overflow != check->fixed.freeDescriptor)
+            {
+                desc.isUsed = 0;
+                desc.overflow = check->fixed.freeDescriptor;
+                SetDescriptor(check->disk, i, desc);
+            }
+            check->fixed.freeDescriptor = i;
+        }
+    }
+    
+    if (check->refreePacks)
+    {
+        check->fixed.freePack = -1;
+        
+        for (i = check->packCount - 1; i >= 0; --i)
+        {
+            pack = check->packs[i];
+            
+            if (check->packStates[i] == PACK_LIVE)
+            {
+                pack.live = check->packFiles[i];
+            }
+            else
+            {
+                pack.block = check->fixed.freePack;
+                pack.used = 0;
+                pack.live = 0;
+                check->fixed.freePack = i;
+            }
+            
+            if (memcmp(&pack, &check->packs[i], sizeof(struct Pack)) != 0) SetPack(check->disk, i, pack);
+        }
+    }
+}
+
+/*
+ *  Removes the damaged files and rebuilds what is inconsistent.
+ */
+int RepairDisk(struct Check *check)
+{
+    struct Descriptor desc;
+    int i;
+    
+    for (i = 0; i < check->files; ++i)
+    {
+        if (!check->entries[i].isUsed || !check->entries[i].bad) continue;
+        
+        desc = GetDescriptor(check->disk, i);
+        desc.isUsed = 0;
+        desc.flags = 0;
+        SetDescriptor(check->disk, i, desc);
+        
+        check->entries[i].isUsed = 0;
+        check->entries[i].flags = 0;
+        check->removed++;
+    }
+    
+    if (check->removed > 0)
+    {
+        printf("Removed %d damaged files and directories\n", check->removed);
+        check->relink = 1;
+        check->reindex = 1;
+        check->refreeFiles = 1;
+    }
+    
+    if (check->relink) RepairLinks(check);
+    if (check->reindex && RepairIndex(check)) return 7;
+    RepairFreeLists(check);
+    
+    SetHeader(check->disk, check->fixed);
+    return 0;
+}
+
+void FreeCheck(struct Check *check)
+{
+    free(check->entries);
+    free(check->kinds);
+    free(check->claims);
+    free(check->packs);
+    free(check->packStates);
+    free(check->packFiles);
+}
+
+int DiskCheck(struct DiskHandler *disk, int repair)
+{
+    struct Check check;
+    int result;
+    
+    SelectDisk(disk);
+    
+    if (repair && !disk->writable)
+    {
+        printf("Disk %s is mounted read-only\n", disk->name);
+        return 8;
+    }
+    
+    if (LockMetadata(disk, repair)) return 10;
+    
+    /* the reservations of crashed inserts are given back, and written in place, before the tables are read */
+    result = repair ? ReclaimFiles(disk) : 0;
+    if (!result && repair && SyncDisk(disk)) result = 9;
+    if (result)
+    {
+        if (result == 7) printf("Not enough memory to check the disk %s\n", disk->name);
+        UnlockMetadata(disk);
+        return result;
+    }
+    
+    memset(&check, 0, sizeof(struct Check));
+    check.disk = disk;
+    check.header = disk->header;
+    check.fixed = disk->header;
+    check.files = disk->descriptors.count;
+    check.packCount = check.header.packWatermark;
+    
+    if (check.header.descriptorWatermark < 0 || check.header.descriptorWatermark > check.files)
+    {
+        if (ReportProblem(&check)) printf("The watermark of descriptors %d is past the end of the table\n", check.header.descriptorWatermark);
+        check.fixed.descriptorWatermark = check.header.descriptorWatermark < 0 ? 0 : check.files;
+        check.refreeFiles = 1;
+    }
+    
+    if (check.packCount < 0 || check.packCount > GetPacksLimit())
+    {
+        if (ReportProblem(&check)) printf("The watermark of packs %d is past the end of the table\n", check.packCount);
+        check.packCount = check.packCount < 0 ? 0 : GetPacksLimit();
+        check.fixed.packWatermark = check.packCount;
+        check.refreePacks = 1;
+    }
+    
+    check.entries = calloc(check.files > 0 ? check.files : 1, sizeof(struct CheckEntry));
+    check.kinds = calloc(LIMIT_BLOCKS, sizeof(char));
+    check.claims = calloc(LIMIT_BLOCKS, sizeof(unsigned short));
+    check.packs = malloc(sizeof(struct Pack) * (check.packCount > 0 ? check.packCount : 1));
+    check.packStates = calloc(check.packCount > 0 ? check.packCount : 1, sizeof(char));
+    check.packFiles = calloc(check.packCount > 0 ? check.packCount : 1, sizeof(int));
+    
+    result = check.entries && check.kinds && check.claims && check.packs && check.packStates && check.packFiles ? 0 : 7;
+    
+    if (!result)
+    {
+        ClaimLayout(&check);
+        CheckPacks(&check);
+        result = CheckDescriptors(&check);
+    }
+    if (!result) result = CheckChains(&check);
+    if (!result)
+    {
+        CountEntries(&check);
+        CheckFreeDescriptors(&check);
+        result = CheckTree(&check);
+    }
+    if (!result) result = CheckIndex(&check);
+    if (!result) result = CheckBlockMap(&check, repair);
+    if (!result)
+    {
+        CheckCounters(&check);
+        if (repair && check.problems > 0) result = RepairDisk(&check);
+    }
+    
+    if (result == 7) printf("Not enough memory to check the disk %s\n", disk->name);
+    
+    if (!result)
+    {
+        printf("Checked the disk %s: %d files, %d directories, %d of %d blocks used\n", disk->name,
+               check.fixed.usedFiles - check.fixed.directories, check.fixed.directories, check.fixed.usedBlocks, LIMIT_BLOCKS);
+        
+        if (check.problems == 0) printf("No problems found\n");
+        else if (!repair) printf("Found %lld problems (%lld leaked blocks); they are fixed by 'fsck %s repair'\n", check.problems, check.leaked, disk->name);
+        else if (check.unrepaired == 0) printf("Found and repaired %lld problems (%lld leaked blocks)\n", check.problems, check.leaked);
+        else printf("Found %lld problems (%lld leaked blocks), %d of which could not be repaired\n", check.problems, check.leaked, check.unrepaired);
+        
+        if (check.problems > 0 && (!repair || check.unrepaired > 0)) result = 5;
+    }
+    
+    FreeCheck(&check);
+    if (UnlockMetadata(disk) && !result) result = 9;
+    return result;
+}
+
+int IsDirectory(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ *  Reads a manifest, or lists the regular files of a directory which are
+ *  then stored under their own names. Returns the number of entries
+ *  or -1 if the list cannot be read.
+ */
+int LoadBatch(const char *list, struct BatchEntry **entries)
+{
+    char line[SIZE_BATCH_LINE];
+    char path[SIZE_BATCH_LINE];
+    char name[SIZE_BATCH_LINE];
+    int count = 0;
+    int words;
+    
+    *entries = NULL;
+    
+    if (IsDirectory(list))
+    {
+        DIR *dir = opendir(list);
+        struct dirent *ent;
+        struct stat st;
+        
+        if (!dir)
+        {
+            printf("Cannot open the directory %s\n", list);
+            return -1;
+        }
+        
+        while ((ent = readdir(dir)) != NULL)
+        {
+            if (snprintf(path, sizeof(path), "%s/%s", list, ent->d_name) >= (int) sizeof(path)) continue;
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            
+            if (AddBatchEntry(entries, &count, path, ent->d_name))
+            {
+                printf("Not enough memory to read the directory %s\n", list);
+                FreeBatch(*entries, count);
+                closedir(dir);
+                return -1;
+            }
+        }
+        
+        closedir(dir);
+        return count;
+    }
+    else
+    {
+        FILE *file = fopen(list, "r");
+        
+        if (!file)
+        {
+            printf("Cannot open the manifest %s\n", list);
+            return -1;
+        }
+        
+        while (fgets(line, SIZE_BATCH_LINE, file))
+        {
+            words = sscanf(line, "%s %s", path, name);
+            if (words < 1 || path[0] == '#') continue;
+            
+            if (AddBatchEntry(entries, &count, path, words > 1 ? name : path))
+            {
+                printf("Not enough memory to read the manifest %s\n", list);
+                FreeBatch(*entries, count);
+                fclose(file);
+                return -1;
+            }
+        }
+        
+        fclose(file);
+        return count;
+    }
+}
+
+/*
+ *  Counts the descriptors and the blocks the new files of the batch need
+ *  at least: every file is planned like PlanStorage does it, the tails
+ *  are packed like ReservePack packs them and every file is taken as one
+ *  extent, so it needs no overflow blocks. With deduplication or
+ *  compression any block may be saved, so no blocks are counted then.
+ *  Entries which are going to fail anyway (their names are taken or
+ *  wrong) are not counted; planned is set for the others. Returns 0 or
+ *  2 if a file cannot be read.
+ */
+int GetBatchNeeds(struct DiskHandler *disk, struct BatchEntry *entries, int count, char *planned, int *files, long long *blocks)
+{
+    struct Descriptor desc;
+    struct Descriptor found;
+    struct stat st;
+    
+    int packUsed = disk->header.openPack >= 0 ? GetPack(disk, disk->header.openPack).used : SIZE_BLOCK;
+    int tail;
+    int slotIndex;
+    int i;
+    
+    *files = 0;
+    *blocks = 0;
+    
+    for (i = 0; i < count; ++i)
+    {
+        if (stat(entries[i].path, &st) != 0)
+        {
+            printf("Could not open the file %s\n", entries[i].path);
+            return 2;
+        }
+        
+        memset(&desc, 0, sizeof(struct Descriptor));
+        if (GetLeafName(entries[i].name, desc.name) < 0 || (int) strlen(desc.name) >= SIZE_FILENAME) continue;
+        if (FindDescriptor(disk, entries[i].name, &found, &slotIndex) >= 0 || slotIndex < 0) continue;
+        
+        planned[i] = 1;
+        (*files)++;
+        if (DEDUPLICATE || COMPRESSION) continue;
+        
+        desc.fileSize = st.st_size;
+        PlanStorage(&desc);
+        tail = (int) GetTailSize(&desc);
+        *blocks += (desc.fileSize - tail + SIZE_BLOCK - 1) / SIZE_BLOCK;
+        
+        if (!(desc.flags & DESC_PACKED)) continue;
+        if (packUsed + tail > SIZE_BLOCK)
+        {
+            (*blocks)++;
+            packUsed = 0;
+        }
+        packUsed += tail;
+    }
+    return 0;
+}
+
+/*
+ *  Inserts all files of the batch in one session, as one transaction:
+ *  the payloads are streamed one after another and the metadata is
+ *  written back once, when the batch releases the metadata lock. A batch
+ *  which needs more descriptors or blocks than the disk has left is
+ *  rejected before anything is written; as its needs are only known
+ *  exactly while it is stored (deduplicated blocks, compressed files,
+ *  extents split by the free space), a batch running out of them on the
+ *  way is rolled back - the files already inserted are deleted before the
+ *  metadata is written back, so it is stored whole or not at all. A file
+ *  whose name is taken (also by an earlier file of the batch) or wrong is
+ *  only left out.
+ */
+int DiskInsertBatch(struct DiskHandler *disk, const char *list)
+{
+    struct BatchEntry *entries;
+    char *states;           /* 0 - left out, 1 - planned, 2 - inserted */
+    
+    int count;
+    int files;
+    long long blocks;
+    int done = 0;
+    int result = 0;
+    int i;
+    
+    SelectDisk(disk);
+    
+    count = LoadBatch(list, &entries);
+    if (count < 0) return 2;
+    
+    states = calloc(count > 0 ? count : 1, 1);
+    if (!states)
+    {
+        printf("Not enough memory to insert the files from %s\n", list);
+        FreeBatch(entries, count);
+        return 7;
+    }
+    
+    /* the batch keeps the metadata locked, so it is written back only once */
+    if (LockMetadata(disk, 1))
+    {
+        free(states);
+        FreeBatch(entries, count);
+        return 10;
+    }
+    
+    result = GetBatchNeeds(disk, entries, count, states, &files, &blocks);
+    if (!result && files > LIMIT_FILES - disk->header.usedFiles)
+    {
+        printf("No free descriptors left for the files from %s\n", list);
+        result = 6;
+    }
+    else if (!result && blocks > LIMIT_BLOCKS - disk->header.usedBlocks)
+    {
+        printf("No enough space for the files from %s\n", list);
+        result = 3;
+    }
+    
+    for (i = 0; i < count && !result; ++i)
+    {
+        result = DiskInsertFile(disk, entries[i].path, entries[i].name);
+        if (result == 0)
+        {
+            states[i] = 2;
+            done++;
+        }
+        else if (states[i] == 1 && result != 4)
+        {
+            printf("The files from %s cannot all be stored in the disk %s, none of them is inserted\n", list, disk->name);
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+    
+    /* the inserted files are deleted within the same transaction, so the disk is written as it was */
+    for (i = count - 1; i >= 0 && result; --i)
+        if (states[i] == 2) DiskDeleteFile(disk, entries[i].name);
+    
+    if (UnlockMetadata(disk) && !result) result = 9;
+    free(states);
+    FreeBatch(entries, count);
+    if (result) return result;
+    
+    printf("Inserted %d of %d files to the disk %s\n", done, count, disk->name);
+    return done == count ? 0 : 1;
+}
+
+/*
+ *  Exports the files listed in the manifest or, if list is a directory,
+ *  every file of the disk into that directory.
+ */
+int DiskExportBatch(struct DiskHandler *disk, const char *list)
+{
+    struct BatchEntry *entries = NULL;
+    
+    int count = 0;
+    int exported = 0;
+    int result;
+    int i;
+    
+    SelectDisk(disk);
+    
+    if (IsDirectory(list))
+    {
+        /* the directories of the disk are recreated under list */
+        if (LockMetadata(disk, 0)) return 10;
+        result = ListTree(disk, -1, list, &entries, &count);
+        UnlockMetadata(disk);
+        
+        if (result)
+        {
+            FreeBatch(entries, count);
+            return result;
+        }
+    }
+    else
+    {
+        count = LoadBatch(list, &entries);
+        if (count < 0) return 2;
+    }
+    
+    for (i = 0; i < count; ++i)
+        if (DiskExportFile(disk, entries[i].path, entries[i].name) == 0) exported++;
+    
+    FreeBatch(entries, count);
+    printf("Exported %d of %d files from the disk %s\n", exported, count, disk->name);
+    return exported == count ? 0 : 1;
+}
+
+int InsertFile(const char *diskName, const char *path, const char *newName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("insert");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskInsertFile(disk, path, newName);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int DisplayMap(const char *diskName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("memory");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDisplayMap(disk);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int DisplayFiles(const char *diskName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("list");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDisplayFiles(disk);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int ExportFile(const char *diskName, const char *fileToExport, const char *newName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("export");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskExportFile(disk, fileToExport, newName);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int DeleteFile(const char *diskName, const char *fileName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("delete");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDeleteFile(disk, fileName);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int MakeDirectory(const char *diskName, const char *path)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("mkdir");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskMakeDirectory(disk, path);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int RemoveDirectory(const char *diskName, const char *path)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("rmdir");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskRemoveDirectory(disk, path);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int RenameFile(const char *diskName, const char *oldPath, const char *newPath)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("rename");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskRenameFile(disk, oldPath, newPath);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int DisplayDirectory(const char *diskName, const char *path)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("list");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDisplayDirectory(disk, path);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int DisplayInfo(const char *diskName)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("info");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDisplayInfo(disk);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int InsertBatch(const char *diskName, const char *list)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("insert-batch");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskInsertBatch(disk, list);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int Defragment(const char *diskName, long long budget, int shrink)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("defrag");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskDefragment(disk, budget, shrink);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int ResizeDisk(const char *diskName, long long diskSize, int filesLimit)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("resize");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskResize(disk, diskSize, filesLimit);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int CheckDisk(const char *diskName, int repair)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("fsck");
+    result = MountDisk(diskName, repair, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskCheck(disk, repair);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int ExportBatch(const char *diskName, const char *list)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("export-batch");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskExportBatch(disk, list);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int ReadFile(const char *diskName, const char *fileName, long long offset, char *buffer, int size, int *got)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("read");
+    result = MountDisk(diskName, 0, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskReadFile(disk, fileName, offset, buffer, size, got);
+    UnmountDisk(disk);
+    return EndOperation(result);
+}
+
+int WriteFile(const char *diskName, const char *fileName, long long offset, const char *data, int size)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("write");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskWriteFile(disk, fileName, offset, data, size);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int AppendFile(const char *diskName, const char *fileName, const char *data, int size)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("append");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskAppendFile(disk, fileName, data, size);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
+
+int TruncateFile(const char *diskName, const char *fileName, long long size)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    BeginOperation("truncate");
+    result = MountDisk(diskName, 1, &disk);
+    if (result) return EndOperation(result);
+    
+    result = DiskTruncateFile(disk, fileName, size);
+    if (UnmountDisk(disk) && !result) result = 9;
+    return EndOperation(result);
+}
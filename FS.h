@@ -19,7 +19,11 @@
 #include <stdlib.h>
 #include <time.h>
 
-int CreateDisk(const char *diskName, int diskSize);
+#define DISK_STDIO  0
+#define DISK_MMAP   1
+
+int CreateDisk(const char *diskName, long long diskSize);
+int CreateCustomDisk(const char *diskName, long long diskSize, int blockSize, int filesLimit, int nameSize);
 void RemoveDisk(const char *diskName);
 int InsertFile(const char *diskName, const char *path, const char *newName);
 int DisplayMap(const char *diskName);
@@ -27,5 +31,219 @@ int DisplayFiles(const char *diskName);
 int ExportFile(const char *diskName, const char *fileToExport, const char *newName);
 int DeleteFile(const char *diskName, const char *fileName);
 int DisplayInfo(const char *diskName);
+int InsertBatch(const char *diskName, const char *list);
+int ExportBatch(const char *diskName, const char *list);
+int Defragment(const char *diskName, long long budget, int shrink);
+int ResizeDisk(const char *diskName, long long diskSize, int filesLimit);
+int CheckDisk(const char *diskName, int repair);
+int ReadFile(const char *diskName, const char *fileName, long long offset, char *buffer, int size, int *got);
+int WriteFile(const char *diskName, const char *fileName, long long offset, const char *data, int size);
+int AppendFile(const char *diskName, const char *fileName, const char *data, int size);
+int TruncateFile(const char *diskName, const char *fileName, long long size);
+int MakeDirectory(const char *diskName, const char *path);
+int RemoveDirectory(const char *diskName, const char *path);
+int RenameFile(const char *diskName, const char *oldPath, const char *newPath);
+int DisplayDirectory(const char *diskName, const char *path);
+
+void SetDiskBackend(int backend);
+void SetCopyThreads(int threads);
+void SetPreallocate(int preallocate);
+void SetDeduplicate(int deduplicate);
+void SetCompression(int compression);
+void SetBlockCache(long long size);
+void SetMetadataCache(long long size);
+void SetCacheReport(int report);
+long long ParseSize(const char *str);
+
+/*
+ *  Session API: the disk is opened once and its header, descriptors,
+ *  name index and map of blocks stay cached in memory until SyncDisk
+ *  or UnmountDisk writes them back. The functions above are thin
+ *  wrappers which mount the disk for a single operation.
+ */
+struct DiskHandler;
+
+int MountDisk(const char *diskName, int writable, struct DiskHandler **disk);
+int SyncDisk(struct DiskHandler *disk);
+int UnmountDisk(struct DiskHandler *disk);
+
+/*
+ *  For tests of the recovery: the process ends at a point of its commit-th
+ *  commit, as if it crashed there - after the transaction is synced to
+ *  the journal and before anything of it is written in place, or when
+ *  only the header of it is written in place; or at its commit-th insert
+ *  of a file, after the blocks are reserved and before the data is copied.
+ */
+#define CRASH_NONE      0
+#define CRASH_JOURNAL   1
+#define CRASH_HEADER    2
+#define CRASH_COPY      3
+
+void SetCrashPoint(int point, int commit);
+
+int DiskInsertFile(struct DiskHandler *disk, const char *path, const char *newName);
+int DiskDisplayMap(struct DiskHandler *disk);
+int DiskDisplayFiles(struct DiskHandler *disk);
+int DiskExportFile(struct DiskHandler *disk, const char *fileToExport, const char *newName);
+int DiskDeleteFile(struct DiskHandler *disk, const char *fileName);
+int DiskDisplayInfo(struct DiskHandler *disk);
+int DiskInsertBatch(struct DiskHandler *disk, const char *list);
+int DiskExportBatch(struct DiskHandler *disk, const char *list);
+int DiskDefragment(struct DiskHandler *disk, long long budget, int shrink);
+
+/*
+ *  Grows a disk in place to diskSize bytes of blocks and filesLimit files
+ *  (0 keeps the number of files). Nothing stored is moved: the records
+ *  added to the tables are kept in a segment taken from the new blocks.
+ */
+int DiskResize(struct DiskHandler *disk, long long diskSize, int filesLimit);
+
+/*
+ *  Checks the consistency of the disk: the blocks used by the files and
+ *  the tables against the map of blocks and the reference counts, the
+ *  extent lists, the free lists, the directory tree, the name index and
+ *  the counters of the header. Problems are printed; with repair they are
+ *  fixed, damaged files are removed and entries which cannot be reached
+ *  go to the root directory. Returns 0 if the disk is consistent (after
+ *  the repair) and 5 if it is not. A disk is repaired only while no other
+ *  process writes it.
+ */
+int DiskCheck(struct DiskHandler *disk, int repair);
+
+/*
+ *  Directories: a name of a file is a path whose components are
+ *  separated with slashes. A directory is removed only when it is empty;
+ *  a file or a directory is renamed (moved) with everything under it.
+ *  Exporting a directory exports everything under it.
+ */
+int DiskMakeDirectory(struct DiskHandler *disk, const char *path);
+int DiskRemoveDirectory(struct DiskHandler *disk, const char *path);
+int DiskRenameFile(struct DiskHandler *disk, const char *oldPath, const char *newPath);
+int DiskDisplayDirectory(struct DiskHandler *disk, const char *path);
+
+/*
+ *  Random access to the contents of a stored file: a range is read or
+ *  written at an offset, data is appended and the file is truncated or
+ *  extended (with zeros) in place, without exporting it.
+ */
+int DiskReadFile(struct DiskHandler *disk, const char *fileName, long long offset, char *buffer, int size, int *got);
+int DiskWriteFile(struct DiskHandler *disk, const char *fileName, long long offset, const char *data, int size);
+int DiskAppendFile(struct DiskHandler *disk, const char *fileName, const char *data, int size);
+int DiskTruncateFile(struct DiskHandler *disk, const char *fileName, long long size);
+
+/*
+ *  Queries for frontends which present the disk as a file system: a file
+ *  or the entries of a directory are described without printing anything,
+ *  and the usage of the disk is given in blocks and descriptors.
+ */
+#define FS_MAX_NAME 1024
+
+struct FileInfo
+{
+    char name[FS_MAX_NAME];
+    long long size;
+    time_t timeAdded;
+    int isDirectory;
+};
+
+struct DiskUsage
+{
+    int blockSize;
+    int blocks;
+    int usedBlocks;
+    int files;
+    int usedFiles;
+    int nameSize;
+};
+
+int DiskStatFile(struct DiskHandler *disk, const char *fileName, struct FileInfo *info);
+int DiskListFiles(struct DiskHandler *disk, const char *path, struct FileInfo **files, int *count);
+int DiskGetUsage(struct DiskHandler *disk, struct DiskUsage *usage);
+
+/*
+ *  Counters of the caches of a mounted disk: blocks of files served from
+ *  the cache and reads of the disk, blocks read ahead, dirty blocks
+ *  written back and blocks evicted, and the same for the pages of the
+ *  metadata tables, for the cache of resolved directories and for the
+ *  cache of extent lists of the files.
+ */
+struct CacheStats
+{
+    long long blockHits;
+    long long blockMisses;
+    long long readAhead;
+    long long writeBacks;
+    long long evictions;
+    int cachedBlocks;
+    
+    long long metadataHits;
+    long long metadataMisses;
+    int metadataPages;
+    
+    long long pathHits;
+    long long pathMisses;
+    
+    long long extentHits;
+    long long extentMisses;
+};
+
+int DiskCacheStats(struct DiskHandler *disk, struct CacheStats *stats);
+
+/*
+ *  Instrumentation of the I/O: the helpers which access the disk count
+ *  the calls reading, writing and seeking (in the image and in the files
+ *  copied to and from it), the bytes they move and how long the calls
+ *  took, and the records of the metadata tables (descriptors, index
+ *  slots, ...) read and written.
+ *
+ *  An operation is timed from BeginOperation to EndOperation, which
+ *  returns the result it is given; nested operations count as a part of
+ *  the outer one. The functions taking a disk name above and the FUSE
+ *  daemon time every call, mounting and unmounting included. Every thread
+ *  times its own operations. The counters are kept for the process, per
+ *  kind of operation and for the last one.
+ *
+ *  With a trace file every call is also written to it as a line
+ *  "OPERATION CALL ADDRESS BYTES MICROSECONDS", and every operation as
+ *  "OPERATION total RESULT - MICROSECONDS".
+ */
+#define STATS_BUCKETS 24
+
+struct IoStats
+{
+    long long reads;            /* fread and pread calls */
+    long long writes;           /* fwrite and pwrite calls */
+    long long readBytes;
+    long long writtenBytes;
+    long long seeks;
+    long long copies;           /* copies made by the kernel */
+    long long copiedBytes;
+    long long mappedReads;      /* copies from and to a mapped disk */
+    long long mappedWrites;
+    long long mappedBytes;
+    long long syncs;
+    long long recordReads;
+    long long recordWrites;
+    long long callLatency[STATS_BUCKETS];   /* calls which took less than 2^i us; the last one counts the rest */
+};
+
+struct OperationStats
+{
+    const char *name;
+    long long count;
+    long long errors;
+    double seconds;
+    double maxSeconds;
+    long long latency[STATS_BUCKETS];   /* like callLatency, for the operations */
+    struct IoStats io;
+};
+
+void BeginOperation(const char *name);
+int EndOperation(int result);
+
+void SetIoTrace(FILE *trace);
+void ResetIoStats(void);
+int GetIoStats(struct IoStats *total, struct OperationStats *last);
+void DisplayIoStats(void);
 
 #endif
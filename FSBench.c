@@ -0,0 +1,404 @@
+/*
+ *  EN: Project for Operating Systems classes at Warsaw University of Technology
+ *      File System
+ *      Using the C89-style to work in Minix 2.0.3
+ *
+ *  PL: Projekt SOI (Systemy Operacyjne) PW WEiTI 18Z
+ *      T6 - System Plikow
+ *
+ *      Copyright (C) Robert Dudzinski 2019
+ *
+ *      File: FSBench.c
+ */
+
+/*
+ *  Benchmark suite: times the operations of the file system over a grid
+ *  of block sizes, file sizes, numbers of files and levels of churn, and
+ *  prints the results as JSON, so runs before and after a change can be
+ *  compared by a script instead of by reading result.txt.
+ *
+ *  Every case creates a disk, inserts the files, churns the disk (deletes
+ *  a part of the files and inserts new ones of other sizes, which leaves
+ *  the free space fragmented), looks the files up, exports and deletes
+ *  them. Inserts, exports and deletes go through the same wrappers as the
+ *  command line tool, so every one of them mounts the disk; lookups go
+ *  through a single mounted session, as in the FUSE daemon.
+ *
+ *  Every file inserted, by the churn too, is written from its own source
+ *  file of random bytes, made before the operation is timed, so the data
+ *  of the files is really copied; deduplication finds nothing to share.
+ *  It is on, as in the command line tool, unless FS_DEDUP=0 is set; the
+ *  JSON says which.
+ *
+ *  For every operation the number of operations, ops/s, MB/s, the 50th
+ *  and 99th percentile of the latency and the I/O the file system made
+ *  (from GetIoStats: reads, writes, seeks and syncs of the image and of
+ *  the files, copies made by the kernel and copies from and to a mapped
+ *  disk) are reported. Messages of the file system are discarded; failed
+ *  operations are counted in "errors".
+ *
+ *  Build and run:
+ *      ./bench.sh suite [quick] > bench.json
+ *  or by hand:
+ *      gcc -Wall -O2 -c FS.c && ar rcs libfs.a FS.o
+ *      gcc -Wall -O2 FSBench.c libfs.a -lpthread -o fsbench
+ *      ./fsbench [quick] > bench.json
+ */
+
+#define _GNU_SOURCE
+
+#include "FS.h"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DIR       "fsbench.tmp"
+#define BENCH_DISK      BENCH_DIR "/disk"
+#define BENCH_OUT       BENCH_DIR "/out"
+#define MAX_CASE_BYTES  (128LL * 1024 * 1024)
+#define CREATE_RUNS     20
+#define LOOKUP_RUNS     4
+
+/*
+ *  Timings of one operation in one case.
+ */
+struct OpStats
+{
+    double *latencies;
+    int count;
+    int capacity;
+    int errors;
+    long long bytes;
+    double seconds;
+    struct IoStats io;      /* counters of the process when the operation started */
+};
+
+FILE *JSON;
+int FIRST_CASE = 1;
+
+double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void StartOp(struct OpStats *stats)
+{
+    memset(stats, 0, sizeof(struct OpStats));
+    GetIoStats(&stats->io, NULL);
+}
+
+/*
+ *  Records one operation which started at start; result is its status.
+ */
+void AddLatency(struct OpStats *stats, double start, int result, long long bytes)
+{
+    double latency = Now() - start;
+    
+    if (stats->count == stats->capacity)
+    {
+        int capacity = stats->capacity ? stats->capacity * 2 : 256;
+        double *latencies = realloc(stats->latencies, capacity * sizeof(double));
+        
+        if (!latencies) return;
+        stats->latencies = latencies;
+        stats->capacity = capacity;
+    }
+    
+    stats->latencies[stats->count++] = latency;
+    stats->seconds += latency;
+    if (result) stats->errors++;
+    else stats->bytes += bytes;
+}
+
+int CompareLatencies(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+double GetPercentile(struct OpStats *stats, int percent)
+{
+    int index;
+    
+    if (stats->count == 0) return 0;
+    index = (int) ((long long) stats->count * percent / 100);
+    if (index >= stats->count) index = stats->count - 1;
+    return stats->latencies[index];
+}
+
+/*
+ *  Prints the statistics of the operation as a member of the "ops"
+ *  object of a case and frees them.
+ */
+void PrintOp(const char *name, struct OpStats *stats, int first)
+{
+    struct IoStats io;
+    double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+    
+    GetIoStats(&io, NULL);
+    qsort(stats->latencies, stats->count, sizeof(double), CompareLatencies);
+    
+    fprintf(JSON, "%s\n        \"%s\": {\"ops\": %d, \"errors\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+            "\"p50_us\": %.1f, \"p99_us\": %.1f, \"reads\": %lld, \"writes\": %lld, \"seeks\": %lld, \"syncs\": %lld, "
+            "\"copies\": %lld, \"mapped_reads\": %lld, \"mapped_writes\": %lld}",
+            first ? "" : ",", name, stats->count, stats->errors, stats->seconds, stats->count / seconds,
+            stats->bytes / seconds / (1024.0 * 1024.0), GetPercentile(stats, 50) * 1e6, GetPercentile(stats, 99) * 1e6,
+            io.reads - stats->io.reads, io.writes - stats->io.writes, io.seeks - stats->io.seeks, io.syncs - stats->io.syncs,
+            io.copies - stats->io.copies, io.mappedReads - stats->io.mappedReads, io.mappedWrites - stats->io.mappedWrites);
+    
+    free(stats->latencies);
+    stats->latencies = NULL;
+}
+
+/*
+ *  Writes a file of size random bytes. Every file inserted gets its own,
+ *  so its blocks are not deduplicated with the ones of other files.
+ */
+int MakeSource(const char *path, long long size)
+{
+    char buffer[4096];
+    FILE *file = fopen(path, "wb");
+    long long done;
+    int i;
+    
+    if (!file) return 1;
+    
+    for (done = 0; done < size; done += sizeof(buffer))
+    {
+        for (i = 0; i < (int) sizeof(buffer); ++i) buffer[i] = (char) rand();
+        fwrite(buffer, 1, size - done < (long long) sizeof(buffer) ? (size_t) (size - done) : sizeof(buffer), file);
+    }
+    return fclose(file) != 0;
+}
+
+void GetSourceName(char *path, const char *kind, int index)
+{
+    sprintf(path, "%s/%s%d", BENCH_DIR, kind, index);
+}
+
+/*
+ *  Makes the sources of the files with chosen[i] set, of sizes[i] bytes,
+ *  or removes them. Returns 0 on success.
+ */
+int MakeSources(const char *kind, long long *sizes, const char *chosen, int count, int remove)
+{
+    char path[64];
+    int i;
+    
+    for (i = 0; i < count; ++i)
+    {
+        if (!chosen[i]) continue;
+        
+        GetSourceName(path, kind, i);
+        if (remove) unlink(path);
+        else if (MakeSource(path, sizes[i])) return 1;
+    }
+    return 0;
+}
+
+/*
+ *  Runs one case: count files of fileSize bytes on a disk with blocks of
+ *  blockSize, churn percent of which are replaced before the lookups.
+ */
+void RunCase(int blockSize, long long fileSize, int count, int churn)
+{
+    struct DiskHandler *disk;
+    struct FileInfo info;
+    struct OpStats stats;
+    
+    char name[64];
+    char source[64];
+    char *all;
+    char *chosen;
+    long long *sizes;
+    long long *churnSizes;
+    long long diskSize;
+    double start;
+    int result;
+    int round;
+    int i;
+    
+    sizes = malloc(count * sizeof(long long));
+    churnSizes = malloc(2 * count * sizeof(long long));
+    all = malloc(count);
+    chosen = calloc(2 * count, 1);
+    if (!sizes || !churnSizes || !all || !chosen)
+    {
+        free(sizes);
+        free(churnSizes);
+        free(all);
+        free(chosen);
+        return;
+    }
+    
+    /* every round of the churn replaces the chosen files, every other one with a file of half and one and a half the size */
+    memset(all, 1, count);
+    for (i = 0; i < count; ++i) sizes[i] = fileSize;
+    for (i = 0; i < 2 * count && churn > 0; ++i)
+    {
+        chosen[i] = rand() % 100 < churn;
+        churnSizes[i] = i % 2 ? fileSize / 2 : fileSize + fileSize / 2;
+    }
+    
+    if (MakeSources("src", sizes, all, count, 0))
+    {
+        MakeSources("src", sizes, all, count, 1);
+        free(sizes);
+        free(churnSizes);
+        free(all);
+        free(chosen);
+        return;
+    }
+    
+    diskSize = (long long) count * ((fileSize + fileSize / 2) / blockSize + 2) * blockSize + 1024 * 1024;
+    
+    fprintf(JSON, "%s\n    {\"block_size\": %d, \"file_size\": %lld, \"files\": %d, \"churn\": %d, \"ops\": {",
+            FIRST_CASE ? "" : ",", blockSize, fileSize, count, churn);
+    FIRST_CASE = 0;
+    
+    StartOp(&stats);
+    for (i = 0; i < CREATE_RUNS; ++i)
+    {
+        start = Now();
+        result = CreateCustomDisk(BENCH_DISK, diskSize, blockSize, count + 16, 64);
+        AddLatency(&stats, start, result, 0);
+    }
+    PrintOp("create", &stats, 1);
+    
+    StartOp(&stats);
+    for (i = 0; i < count; ++i)
+    {
+        sprintf(name, "f%d", i);
+        GetSourceName(source, "src", i);
+        start = Now();
+        result = InsertFile(BENCH_DISK, source, name);
+        AddLatency(&stats, start, result, fileSize);
+    }
+    PrintOp("insert", &stats, 0);
+    MakeSources("src", sizes, all, count, 1);
+    
+    /* a source which cannot be made fails its insert, which is counted as an error */
+    MakeSources("churn", churnSizes, chosen, 2 * count, 0);
+    StartOp(&stats);
+    for (round = 0; round < 2; ++round)
+    {
+        for (i = 0; i < count; ++i)
+        {
+            if (!chosen[round * count + i]) continue;
+            
+            sprintf(name, "f%d", i);
+            GetSourceName(source, "churn", round * count + i);
+            start = Now();
+            result = DeleteFile(BENCH_DISK, name);
+            if (!result) result = InsertFile(BENCH_DISK, source, name);
+            AddLatency(&stats, start, result, churnSizes[round * count + i]);
+            
+            /* a failed churn leaves the old file, or none, so the later byte counts follow what was stored */
+            if (!result) sizes[i] = churnSizes[round * count + i];
+        }
+    }
+    PrintOp("churn", &stats, 0);
+    MakeSources("churn", churnSizes, chosen, 2 * count, 1);
+    
+    if (MountDisk(BENCH_DISK, 0, &disk) == 0)
+    {
+        StartOp(&stats);
+        for (i = 0; i < count * LOOKUP_RUNS; ++i)
+        {
+            sprintf(name, "f%d", rand() % count);
+            start = Now();
+            AddLatency(&stats, start, DiskStatFile(disk, name, &info), 0);
+        }
+        PrintOp("lookup", &stats, 0);
+        
+        StartOp(&stats);
+        for (i = 0; i < count * LOOKUP_RUNS; ++i)
+        {
+            sprintf(name, "missing%d", rand() % count);
+            start = Now();
+            result = DiskStatFile(disk, name, &info);
+            AddLatency(&stats, start, result != 3, 0);
+        }
+        PrintOp("lookup_miss", &stats, 0);
+        
+        UnmountDisk(disk);
+    }
+    
+    StartOp(&stats);
+    for (i = 0; i < count; ++i)
+    {
+        sprintf(name, "f%d", i);
+        start = Now();
+        AddLatency(&stats, start, ExportFile(BENCH_DISK, name, BENCH_OUT), sizes[i]);
+    }
+    PrintOp("export", &stats, 0);
+    
+    StartOp(&stats);
+    for (i = 0; i < count; ++i)
+    {
+        sprintf(name, "f%d", i);
+        start = Now();
+        AddLatency(&stats, start, DeleteFile(BENCH_DISK, name), sizes[i]);
+    }
+    PrintOp("delete", &stats, 0);
+    
+    fprintf(JSON, "\n      }}");
+    fflush(JSON);
+    
+    RemoveDisk(BENCH_DISK);
+    remove(BENCH_OUT);
+    free(sizes);
+    free(churnSizes);
+    free(all);
+    free(chosen);
+}
+
+int main(int argc, char **argv)
+{
+    static const int blockSizes[] = { 512, 4096, 65536 };
+    static const long long fileSizes[] = { 100, 16 * 1024, 1024 * 1024 };
+    static const int counts[] = { 100, 1000 };
+    static const int churns[] = { 0, 50 };
+    
+    int quick = argc > 1 && strcmp(argv[1], "quick") == 0;
+    int dedup = !(getenv("FS_DEDUP") && strcmp(getenv("FS_DEDUP"), "0") == 0);
+    int b;
+    int s;
+    int c;
+    int h;
+    
+    if (getenv("FS_BACKEND") && strcmp(getenv("FS_BACKEND"), "mmap") == 0)
+        SetDiskBackend(DISK_MMAP);
+    SetDeduplicate(dedup);
+    
+    /* the results go to the original output, the messages of the file system nowhere */
+    JSON = fdopen(dup(fileno(stdout)), "w");
+    if (!JSON || !freopen("/dev/null", "w", stdout)) return 1;
+    
+    mkdir(BENCH_DIR, 0755);
+    srand(1);
+    
+    fprintf(JSON, "{\n  \"backend\": \"%s\",\n  \"dedup\": %s,\n  \"quick\": %s,\n  \"cases\": [",
+            getenv("FS_BACKEND") ? getenv("FS_BACKEND") : "stdio", dedup ? "true" : "false", quick ? "true" : "false");
+    
+    for (b = 0; b < 3; ++b)
+        for (s = 0; s < 3; ++s)
+            for (c = 0; c < (quick ? 1 : 2); ++c)
+                for (h = 0; h < 2; ++h)
+                {
+                    int count = quick ? counts[c] / 2 : counts[c];
+                    
+                    if (fileSizes[s] * count > MAX_CASE_BYTES) continue;
+                    if (quick && blockSizes[b] == 512 && fileSizes[s] > 16 * 1024) continue;
+                    RunCase(blockSizes[b], fileSizes[s], count, churns[h]);
+                }
+    
+    fprintf(JSON, "\n  ]\n}\n");
+    fclose(JSON);
+    rmdir(BENCH_DIR);
+    return 0;
+}
@@ -0,0 +1,599 @@
+/*
+ *  EN: Project for Operating Systems classes at Warsaw University of Technology
+ *      File System
+ *      Using the C89-style to work in Minix 2.0.3
+ *
+ *  PL: Projekt SOI (Systemy Operacyjne) PW WEiTI 18Z
+ *      T6 - System Plikow
+ *
+ *      Copyright (C) Robert Dudzinski 2019
+ *
+ *      File: FSFuse.c
+ */
+
+/*
+ *  FUSE frontend: mounts a disk image as a directory, so programs open
+ *  and read its files directly instead of running the command line tool
+ *  for every operation. The image stays mounted through the session API
+ *  for the whole life of the daemon, so its metadata and blocks stay
+ *  cached, and reads are served from the blocks of the file at the
+ *  requested offset without exporting it.
+ *
+ *  Build (libfuse 3), or ./fuse.sh build; ./fuse.sh also checks the
+ *  daemon on a mounted disk:
+ *      gcc -Wall FS.c FSFuse.c `pkg-config fuse3 --cflags --libs` -lpthread -o fsfuse
+ *
+ *  Usage:
+ *      ./fsfuse DISK_NAME MOUNT_POINT [FUSE options, e.g. -f -s -o ro]
+ *      fusermount3 -u MOUNT_POINT
+ *
+ *  FUSE dispatches requests from several threads unless -s is given.
+ *  Every thread mounts the disk for itself when it serves its first
+ *  request and requests run at once: readers share the lock of the
+ *  metadata and a writer holds it alone, as separate processes do (see
+ *  LockRange). Every handle has its own caches (FS_CACHE sets the size
+ *  of the cache of blocks of each one), and a change made through one
+ *  handle drops the cached metadata of the others. Where the locks of
+ *  the disk belong to the process, the requests take turns on a single
+ *  handle instead. The disk must not be resized while it is mounted.
+ *
+ *  Every request is timed as an operation. With FS_STATS=1 the I/O and
+ *  the latency of the requests of the session are printed when the disk
+ *  is unmounted; FS_TRACE=FILE writes every call to FILE as it is made.
+ */
+
+#define FUSE_USE_VERSION 31
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "FS.h"
+
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+ *  DISK is mounted by main and serves its thread; the other threads
+ *  mount their handles on demand. The handles are unmounted when their
+ *  thread ends and the ones left over by FuseDestroy.
+ */
+struct DiskHandler *DISK;
+const char *DISK_NAME;
+int DISK_WRITABLE;
+
+struct DiskHandler **DISKS = NULL;
+int DISK_COUNT = 0;
+pthread_mutex_t DISKS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t DISK_KEY;
+
+#ifndef F_OFD_SETLKW
+pthread_mutex_t DISK_LOCK = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void DropDisk(void *disk)
+{
+    int i;
+    
+    pthread_mutex_lock(&DISKS_LOCK);
+    for (i = 0; i < DISK_COUNT && DISKS[i] != disk; ++i);
+    if (i < DISK_COUNT)
+    {
+        DISKS[i] = DISKS[--DISK_COUNT];
+        UnmountDisk(disk);
+    }
+    pthread_mutex_unlock(&DISKS_LOCK);
+}
+
+/*
+ *  Handle of the disk for the calling thread, mounted on its first call,
+ *  or NULL if it cannot be mounted. It is given back with ReleaseDisk.
+ */
+struct DiskHandler *GetDisk(void)
+{
+#ifdef F_OFD_SETLKW
+    struct DiskHandler **grown;
+    struct DiskHandler *disk;
+    
+    disk = pthread_getspecific(DISK_KEY);
+    if (disk) return disk;
+    
+    if (MountDisk(DISK_NAME, DISK_WRITABLE, &disk) != 0) return NULL;
+    
+    pthread_mutex_lock(&DISKS_LOCK);
+    grown = realloc(DISKS, sizeof(struct DiskHandler *) * (DISK_COUNT + 1));
+    if (grown)
+    {
+        DISKS = grown;
+        DISKS[DISK_COUNT++] = disk;
+    }
+    pthread_mutex_unlock(&DISKS_LOCK);
+    
+    if (!grown || pthread_setspecific(DISK_KEY, disk) != 0)
+    {
+        if (grown) DropDisk(disk);
+        else UnmountDisk(disk);
+        return NULL;
+    }
+    return disk;
+#else
+    pthread_mutex_lock(&DISK_LOCK);
+    return DISK;
+#endif
+}
+
+void ReleaseDisk(void)
+{
+#ifndef F_OFD_SETLKW
+    pthread_mutex_unlock(&DISK_LOCK);
+#endif
+}
+
+/*
+ *  Translates a status of the session API into a negative errno; noSpace
+ *  tells how to read 3, which means a missing file or a full disk.
+ */
+int GetErrno(int result, int noSpace)
+{
+    switch (result)
+    {
+        case 0:  return 0;
+        case 3:  return noSpace ? -ENOSPC : -ENOENT;
+        case 4:  return -EEXIST;
+        case 5:  return -EINVAL;
+        case 6:  return -ENOSPC;
+        case 7:  return -ENOMEM;
+        case 8:  return -EROFS;
+        case 10: return -EAGAIN;
+        default: return -EIO;
+    }
+}
+
+/*
+ *  Paths of the disk are relative to its root directory, so the mount
+ *  path of an entry is its path on the disk behind a slash.
+ */
+const char *GetFileName(const char *path)
+{
+    if (path[0] != '/' || path[1] == '\0') return NULL;
+    return path + 1;
+}
+
+/*
+ *  Tells if ro is one of the -o options of FUSE.
+ */
+int IsReadOnly(int argc, char **argv)
+{
+    const char *option;
+    int i;
+    
+    for (i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "-o") != 0) continue;
+        
+        for (option = argv[i + 1]; option; option = strchr(option, ','))
+        {
+            if (*option == ',') option++;
+            if (strncmp(option, "ro", 2) == 0 && (option[2] == '\0' || option[2] == ',')) return 1;
+        }
+    }
+    return 0;
+}
+
+void FillStat(struct stat *st, struct FileInfo *info)
+{
+    memset(st, 0, sizeof(struct stat));
+    if (info->isDirectory)
+    {
+        st->st_mode = S_IFDIR | (DISK_WRITABLE ? 0755 : 0555);
+        st->st_nlink = 2;
+        st->st_mtime = info->timeAdded;
+        st->st_ctime = info->timeAdded;
+        st->st_atime = info->timeAdded;
+        return;
+    }
+    st->st_mode = S_IFREG | (DISK_WRITABLE ? 0644 : 0444);
+    st->st_nlink = 1;
+    st->st_size = info->size;
+    st->st_blocks = (info->size + 511) / 512;
+    st->st_mtime = info->timeAdded;
+    st->st_ctime = info->timeAdded;
+    st->st_atime = info->timeAdded;
+}
+
+int FuseGetattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    struct FileInfo info;
+    const char *name = GetFileName(path);
+    int result;
+    
+    (void) fi;
+    
+    if (strcmp(path, "/") == 0)
+    {
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = S_IFDIR | (DISK_WRITABLE ? 0755 : 0555);
+        st->st_nlink = 2;
+        return 0;
+    }
+    
+    if (!name) return -ENOENT;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("getattr");
+    result = DiskStatFile(disk, name, &info);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    if (result) return GetErrno(result, 0);
+    
+    FillStat(st, &info);
+    return 0;
+}
+
+int FuseReaddir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset,
+                struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    struct DiskHandler *disk;
+    struct FileInfo *files;
+    struct stat st;
+    int count;
+    int result;
+    int i;
+    
+    (void) offset;
+    (void) fi;
+    (void) flags;
+    
+    /* the root directory is listed with an empty path */
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("readdir");
+    result = DiskListFiles(disk, path + 1, &files, &count);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    if (result) return GetErrno(result, 0);
+    
+    filler(buffer, ".", NULL, 0, 0);
+    filler(buffer, "..", NULL, 0, 0);
+    for (i = 0; i < count; ++i)
+    {
+        FillStat(&st, &files[i]);
+        if (filler(buffer, files[i].name, &st, 0, 0)) break;
+    }
+    
+    free(files);
+    return 0;
+}
+
+int FuseOpen(const char *path, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    struct FileInfo info;
+    const char *name = GetFileName(path);
+    int result;
+    
+    if (!name) return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY && !DISK_WRITABLE) return -EROFS;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("open");
+    result = DiskStatFile(disk, name, &info);
+    if (!result && (fi->flags & O_TRUNC)) result = GetErrno(DiskTruncateFile(disk, name, 0), 1);
+    else result = GetErrno(result, 0);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return result;
+}
+
+int FuseCreate(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    (void) mode;
+    (void) fi;
+    
+    if (!name) return -ENOENT;
+    if (!DISK_WRITABLE) return -EROFS;
+    
+    /* a new file is an empty file inserted into the disk */
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("create");
+    result = DiskInsertFile(disk, "/dev/null", name);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return GetErrno(result, 1);
+}
+
+int FuseRead(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    int got;
+    
+    (void) fi;
+    
+    if (!name) return -ENOENT;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("read");
+    result = DiskReadFile(disk, name, offset, buffer, (int) size, &got);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return result ? GetErrno(result, 0) : got;
+}
+
+int FuseWrite(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    (void) fi;
+    
+    if (!name) return -ENOENT;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("write");
+    result = DiskWriteFile(disk, name, offset, buffer, (int) size);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return result ? GetErrno(result, 1) : (int) size;
+}
+
+int FuseTruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    (void) fi;
+    
+    if (!name) return -ENOENT;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("truncate");
+    result = DiskTruncateFile(disk, name, size);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return GetErrno(result, 1);
+}
+
+int FuseUnlink(const char *path)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    if (!name) return -ENOENT;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("unlink");
+    result = DiskDeleteFile(disk, name);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return GetErrno(result, 0);
+}
+
+int FuseMkdir(const char *path, mode_t mode)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    (void) mode;
+    
+    if (!name) return -EEXIST;
+    if (!DISK_WRITABLE) return -EROFS;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("mkdir");
+    result = DiskMakeDirectory(disk, name);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return GetErrno(result, 1);
+}
+
+int FuseRmdir(const char *path)
+{
+    struct DiskHandler *disk;
+    const char *name = GetFileName(path);
+    int result;
+    
+    if (!name) return -EBUSY;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("rmdir");
+    result = DiskRemoveDirectory(disk, name);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    /* only an empty directory is removed */
+    return result == 5 ? -ENOTEMPTY : GetErrno(result, 0);
+}
+
+int FuseRename(const char *from, const char *to, unsigned int flags)
+{
+    struct DiskHandler *disk;
+    const char *oldName = GetFileName(from);
+    const char *newName = GetFileName(to);
+    int result;
+    
+    if (!oldName || !newName) return -EBUSY;
+    
+    /* an existing target is not replaced, so RENAME_NOREPLACE is what is done anyway */
+    if (flags & ~1u) return -EINVAL;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("rename");
+    result = DiskRenameFile(disk, oldName, newName);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return GetErrno(result, 1);
+}
+
+int FuseStatfs(const char *path, struct statvfs *st)
+{
+    struct DiskHandler *disk;
+    struct DiskUsage usage;
+    int result;
+    
+    (void) path;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("statfs");
+    result = DiskGetUsage(disk, &usage);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    if (result) return GetErrno(result, 0);
+    
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = usage.blockSize;
+    st->f_frsize = usage.blockSize;
+    st->f_blocks = usage.blocks;
+    st->f_bfree = usage.blocks - usage.usedBlocks;
+    st->f_bavail = usage.blocks - usage.usedBlocks;
+    st->f_files = usage.files;
+    st->f_ffree = usage.files - usage.usedFiles;
+    st->f_favail = usage.files - usage.usedFiles;
+    st->f_namemax = usage.nameSize - 1;
+    return 0;
+}
+
+int FuseFlush(const char *path, struct fuse_file_info *fi)
+{
+    struct DiskHandler *disk;
+    int result;
+    
+    (void) path;
+    (void) fi;
+    
+    disk = GetDisk();
+    if (!disk) return -EIO;
+    
+    BeginOperation("flush");
+    result = SyncDisk(disk);
+    EndOperation(result);
+    ReleaseDisk();
+    
+    return result ? -EIO : 0;
+}
+
+void FuseDestroy(void *data)
+{
+    (void) data;
+    
+    pthread_mutex_lock(&DISKS_LOCK);
+    while (DISK_COUNT > 0) UnmountDisk(DISKS[--DISK_COUNT]);
+    pthread_mutex_unlock(&DISKS_LOCK);
+    
+    if (getenv("FS_STATS") && strcmp(getenv("FS_STATS"), "1") == 0) DisplayIoStats();
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_operations operations;
+    
+    if (argc < 3)
+    {
+        printf("Usage: %s DISK_NAME MOUNT_POINT [FUSE options]\n", argv[0]);
+        return 1;
+    }
+    
+    if (getenv("FS_BACKEND") && strcmp(getenv("FS_BACKEND"), "mmap") == 0)
+        SetDiskBackend(DISK_MMAP);
+    
+    if (getenv("FS_CACHE") && ParseSize(getenv("FS_CACHE")) < 0)
+    {
+        printf("Invalid size %s in FS_CACHE\n", getenv("FS_CACHE"));
+        return 1;
+    }
+    if (getenv("FS_CACHE"))
+        SetBlockCache(ParseSize(getenv("FS_CACHE")));
+    
+    if (getenv("FS_TRACE"))
+    {
+        FILE *trace = strcmp(getenv("FS_TRACE"), "-") == 0 ? stderr : fopen(getenv("FS_TRACE"), "a");
+        if (!trace)
+        {
+            printf("Cannot open the trace file %s\n", getenv("FS_TRACE"));
+            return 1;
+        }
+        SetIoTrace(trace);
+    }
+    
+    /* a disk which cannot be written is served read-only */
+    DISK_WRITABLE = !IsReadOnly(argc, argv);
+    
+    if (DISK_WRITABLE && MountDisk(argv[1], 1, &DISK) != 0) DISK_WRITABLE = 0;
+    if (!DISK_WRITABLE && MountDisk(argv[1], 0, &DISK) != 0) return 1;
+    
+    DISK_NAME = argv[1];
+    DISKS = malloc(sizeof(struct DiskHandler *));
+    if (!DISKS || pthread_key_create(&DISK_KEY, DropDisk) != 0 || pthread_setspecific(DISK_KEY, DISK) != 0)
+    {
+        printf("Cannot serve the disk %s\n", argv[1]);
+        UnmountDisk(DISK);
+        return 1;
+    }
+    DISKS[DISK_COUNT++] = DISK;
+    
+    memset(&operations, 0, sizeof(struct fuse_operations));
+    operations.getattr = FuseGetattr;
+    operations.readdir = FuseReaddir;
+    operations.open = FuseOpen;
+    operations.create = FuseCreate;
+    operations.read = FuseRead;
+    operations.write = FuseWrite;
+    operations.truncate = FuseTruncate;
+    operations.unlink = FuseUnlink;
+    operations.mkdir = FuseMkdir;
+    operations.rmdir = FuseRmdir;
+    operations.rename = FuseRename;
+    operations.statfs = FuseStatfs;
+    operations.flush = FuseFlush;
+    operations.destroy = FuseDestroy;
+    
+    /* the disk name is not an option of FUSE */
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &operations, NULL);
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+#   Measures how the throughput of insert and export scales with the
+#   number of copy threads (FS_THREADS). Usage: ./bench.sh [SIZE_MB] [MAX_THREADS]
+#
+#   With "suite" it builds FS.c as a library in a temporary directory,
+#   links FSBench.c against it and prints the results of the benchmark
+#   suite as JSON. Usage: ./bench.sh suite [quick]
+#
+
+if [ "$1" = "suite" ]
+then
+    BUILD=$(mktemp -d) || exit 1
+    gcc -Wall -O2 -c FS.c -o $BUILD/libfs.o && ar rcs $BUILD/libfs.a $BUILD/libfs.o && \
+        gcc -Wall -O2 FSBench.c $BUILD/libfs.a -lpthread -o $BUILD/fsbench || { rm -rf $BUILD; exit 1; }
+    $BUILD/fsbench $2
+    STATUS=$?
+    rm -rf $BUILD
+    exit $STATUS
+fi
+
+SIZE_MB=${1:-256}
+MAX_THREADS=${2:-$(nproc)}
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > bench.bin
+./a.out new bench.disk $(((SIZE_MB + 8) * 1024 * 1024)) > /dev/null
+
+echo "File of ${SIZE_MB}MB, backend ${FS_BACKEND:-stdio}"
+printf "%8s %14s %14s\n" "threads" "insert MB/s" "export MB/s"
+
+THREADS=1
+while [ $THREADS -le $MAX_THREADS ]
+do
+    START=$(date +%s%N)
+    FS_THREADS=$THREADS ./a.out insert bench.disk bench.bin bench > /dev/null
+    MIDDLE=$(date +%s%N)
+    FS_THREADS=$THREADS ./a.out export bench.disk bench bench.out > /dev/null
+    END=$(date +%s%N)
+    ./a.out delete bench.disk bench > /dev/null
+
+    cmp -s bench.bin bench.out || echo "Exported file differs for $THREADS threads"
+
+    printf "%8d %14d %14d\n" $THREADS \
+        $((SIZE_MB * 1000000000 / (MIDDLE - START + 1))) \
+        $((SIZE_MB * 1000000000 / (END - MIDDLE + 1)))
+
+    THREADS=$((THREADS * 2))
+done
+
+./a.out remove bench.disk Y > /dev/null
+rm -f bench.bin bench.out
@@ -0,0 +1,99 @@
+#!/bin/bash
+#
+#   Builds the FUSE daemon (fsfuse) and checks it on a mounted disk: files
+#   are written through the mount point, then read back by several readers
+#   at once while another file is being written. Usage: ./fuse.sh [build]
+#
+#   With "build" it only builds fsfuse. Without libfuse 3, /dev/fuse or
+#   fusermount3 the check is skipped.
+#
+
+if ! pkg-config --exists fuse3
+then
+    echo "libfuse 3 is not installed, skipping"
+    exit 0
+fi
+
+gcc -Wall FS.c FSFuse.c $(pkg-config fuse3 --cflags --libs) -lpthread -o fsfuse || exit 1
+[ "$1" = "build" ] && exit 0
+
+if [ ! -c /dev/fuse ] || ! command -v fusermount3 > /dev/null
+then
+    echo "FUSE cannot be mounted here, skipping"
+    exit 0
+fi
+
+gcc -Wall FS.c main.c -lpthread -o a.out || exit 1
+
+READERS=${READERS:-8}
+STATUS=0
+
+rm -rf fuse.mnt fuse.src
+mkdir -p fuse.mnt fuse.src
+./a.out new fuse.disk $((64 * 1024 * 1024)) > /dev/null
+
+for i in 1 2 3 4
+do
+    head -c $((i * 1234567)) /dev/urandom > fuse.src/file$i
+done
+head -c 100 /dev/urandom > fuse.src/small
+
+./fsfuse fuse.disk fuse.mnt -f &
+DAEMON=$!
+
+# the mount point shows up when the daemon is ready
+for i in $(seq 50)
+do
+    mountpoint -q fuse.mnt && break
+    sleep 0.1
+done
+
+if ! mountpoint -q fuse.mnt
+then
+    echo "Could not mount fuse.disk"
+    kill $DAEMON 2> /dev/null
+    rm -rf fuse.mnt fuse.src fuse.disk
+    exit 1
+fi
+
+mkdir fuse.mnt/dir
+for f in file1 file2 file3 small
+do
+    cp fuse.src/$f fuse.mnt/dir/$f || STATUS=1
+done
+
+# readers run at once, together with a writer of another file
+cp fuse.src/file4 fuse.mnt/file4 &
+PIDS=$!
+for i in $(seq $READERS)
+do
+    (
+        for f in file1 file2 file3 small
+        do
+            cmp -s fuse.src/$f fuse.mnt/dir/$f || { echo "Reader $i: $f differs"; exit 1; }
+        done
+    ) &
+    PIDS="$PIDS $!"
+done
+for PID in $PIDS
+do
+    wait $PID || STATUS=1
+done
+
+cmp -s fuse.src/file4 fuse.mnt/file4 || { echo "file4 differs"; STATUS=1; }
+mv fuse.mnt/file4 fuse.mnt/dir/moved || STATUS=1
+rm fuse.mnt/dir/small || STATUS=1
+
+fusermount3 -u fuse.mnt
+wait $DAEMON
+
+# the disk is consistent and holds what was written
+./a.out fsck fuse.disk | grep -q "No problems found" || { echo "fuse.disk is not consistent"; STATUS=1; }
+./a.out export fuse.disk dir/moved fuse.out > /dev/null
+cmp -s fuse.src/file4 fuse.out || { echo "dir/moved differs after unmounting"; STATUS=1; }
+
+./a.out remove fuse.disk Y > /dev/null
+rm -rf fuse.mnt fuse.src fuse.out
+
+[ $STATUS -eq 0 ] && echo "FUSE OK"
+exit $STATUS
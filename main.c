@@ -25,7 +25,18 @@ int main(int argc, char **argv)
 {
 	char *mode = argv[1];
     char *diskName = argv[2];
-
+    int stats = 0;
+    
+    /* "stats COMMAND ..." runs the command and prints the I/O it made */
+    if (argc > 3 && strcmp(mode, "stats") == 0)
+    {
+        stats = 1;
+        argc--;
+        argv++;
+        mode = argv[1];
+        diskName = argv[2];
+    }
+    
     if (argc <= 2)
     {
         printf("Too few arguments\n");
@@ -34,13 +45,77 @@ int main(int argc, char **argv)
     
     RemoveUpperCase(&mode);
     
+    if (getenv("FS_BACKEND") && strcmp(getenv("FS_BACKEND"), "mmap") == 0)
+        SetDiskBackend(DISK_MMAP);
+    
+    if (getenv("FS_THREADS"))
+        SetCopyThreads(atoi(getenv("FS_THREADS")));
+    
+    if (getenv("FS_PREALLOCATE") && strcmp(getenv("FS_PREALLOCATE"), "1") == 0)
+        SetPreallocate(1);
+    
+    if (getenv("FS_DEDUP") && strcmp(getenv("FS_DEDUP"), "0") == 0)
+        SetDeduplicate(0);
+    
+    if (getenv("FS_COMPRESS") && strcmp(getenv("FS_COMPRESS"), "1") == 0)
+        SetCompression(1);
+    
+    if (getenv("FS_CACHE") && ParseSize(getenv("FS_CACHE")) < 0)
+    {
+        printf("Invalid size %s in FS_CACHE\n", getenv("FS_CACHE"));
+        return 1;
+    }
+    if (getenv("FS_CACHE"))
+        SetBlockCache(ParseSize(getenv("FS_CACHE")));
+    
+    if (getenv("FS_META_CACHE") && ParseSize(getenv("FS_META_CACHE")) < 0)
+    {
+        printf("Invalid size %s in FS_META_CACHE\n", getenv("FS_META_CACHE"));
+        return 1;
+    }
+    if (getenv("FS_META_CACHE"))
+        SetMetadataCache(ParseSize(getenv("FS_META_CACHE")));
+    
+    if (getenv("FS_CACHE_STATS") && strcmp(getenv("FS_CACHE_STATS"), "1") == 0)
+        SetCacheReport(1);
+    
+    /* FS_CRASH=POINT[:COMMIT] ends the process at a point of a commit (or an insert), for tests of the recovery */
+    if (getenv("FS_CRASH"))
+    {
+        const char *point = getenv("FS_CRASH");
+        const char *commit = strchr(point, ':');
+        
+        if (strncmp(point, "journal", 7) == 0) SetCrashPoint(CRASH_JOURNAL, commit ? atoi(commit + 1) : 1);
+        else if (strncmp(point, "header", 6) == 0) SetCrashPoint(CRASH_HEADER, commit ? atoi(commit + 1) : 1);
+        else if (strncmp(point, "copy", 4) == 0) SetCrashPoint(CRASH_COPY, commit ? atoi(commit + 1) : 1);
+        else
+        {
+            printf("Unknown crash point %s\n", point);
+            return 1;
+        }
+    }
+    
+    if (getenv("FS_TRACE"))
+    {
+        FILE *trace = strcmp(getenv("FS_TRACE"), "-") == 0 ? stderr : fopen(getenv("FS_TRACE"), "a");
+        if (trace) SetIoTrace(trace);
+        else printf("Cannot open the trace file %s\n", getenv("FS_TRACE"));
+    }
+    
     if (strcmp(mode, "new") == 0)
     {
-        int desiredSize = 15000000;
+        long long desiredSize = 15000000;
+        int blockSize = 4096;
+        int filesLimit = 512;
+        int nameSize = 256;
         
-        if (argc > 3) desiredSize = atoi(argv[3]);
+        if (argc > 3) desiredSize = ParseSize(argv[3]);
+        if (argc > 4) blockSize = (int) ParseSize(argv[4]);
+        if (argc > 5) filesLimit = atoi(argv[5]);
+        if (argc > 6) nameSize = atoi(argv[6]) + 1;
         
-        if (CreateDisk(diskName, desiredSize))
+        BeginOperation("new");
+        if (EndOperation(CreateCustomDisk(diskName, desiredSize, blockSize, filesLimit, nameSize)))
             printf("Error creating disk\n");
         else
             printf("Created disk %s\n", diskName);
@@ -85,26 +160,156 @@ int main(int argc, char **argv)
             }
             else
             {
-                if (InsertFile(diskName, fileToInsert, fileToInsert))
+                /* the file is inserted into the root directory under its own name */
+                char *newName = strrchr(fileToInsert, '/') ? strrchr(fileToInsert, '/') + 1 : fileToInsert;
+                if (InsertFile(diskName, fileToInsert, newName))
                     printf("Error inserting file\n");
                 else
-                    printf("Inserted %s to the disk %s\n", fileToInsert, fileToInsert);
+                    printf("Inserted %s to the disk %s\n", newName, fileToInsert);
             }
 		}
 		else return 0;
     }
+    else if (strcmp(mode, "insert-batch") == 0)
+    {
+        if (argc > 3)
+        {
+            if (InsertBatch(diskName, argv[3]))
+                printf("Error inserting files from %s\n", argv[3]);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "export-batch") == 0)
+    {
+        if (argc > 3)
+        {
+            if (ExportBatch(diskName, argv[3]))
+                printf("Error exporting files listed in %s\n", argv[3]);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "defrag") == 0)
+    {
+        long long budget = 0;
+        int shrink = 0;
+        int i;
+        
+        for (i = 3; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "shrink") == 0) shrink = 1;
+            else budget = ParseSize(argv[i]);
+        }
+        
+        if (budget < 0)
+        {
+            printf("Invalid budget of the defragmentation\n");
+            return 1;
+        }
+        
+        if (Defragment(diskName, budget, shrink))
+            printf("Error defragmenting disk %s\n", diskName);
+    }
+    else if (strcmp(mode, "resize") == 0)
+    {
+        if (argc > 3)
+        {
+            if (ResizeDisk(diskName, ParseSize(argv[3]), argc > 4 ? atoi(argv[4]) : 0))
+                printf("Error resizing disk %s\n", diskName);
+            else
+                printf("Resized disk %s\n", diskName);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "fsck") == 0)
+    {
+        int repair = argc > 3 && strcmp(argv[3], "repair") == 0;
+        
+        if (CheckDisk(diskName, repair))
+            printf("Disk %s is not consistent\n", diskName);
+    }
+    else if (strcmp(mode, "read") == 0)
+    {
+        if (argc > 5)
+        {
+            int length = (int) ParseSize(argv[5]);
+            int got;
+            char *buffer = malloc(length > 0 ? length : 1);
+            
+            if (!buffer || ReadFile(diskName, argv[3], ParseSize(argv[4]), buffer, length, &got))
+                printf("Error reading file %s from the disk %s\n", argv[3], diskName);
+            else
+                fwrite(buffer, 1, got, stdout);
+            free(buffer);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "write") == 0)
+    {
+        if (argc > 5)
+        {
+            if (WriteFile(diskName, argv[3], ParseSize(argv[4]), argv[5], strlen(argv[5])))
+                printf("Error writing file %s in the disk %s\n", argv[3], diskName);
+            else
+                printf("Wrote %d bytes to the file %s\n", (int) strlen(argv[5]), argv[3]);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "append") == 0)
+    {
+        if (argc > 4)
+        {
+            if (AppendFile(diskName, argv[3], argv[4], strlen(argv[4])))
+                printf("Error appending to file %s in the disk %s\n", argv[3], diskName);
+            else
+                printf("Appended %d bytes to the file %s\n", (int) strlen(argv[4]), argv[3]);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "truncate") == 0)
+    {
+        if (argc > 4)
+        {
+            if (TruncateFile(diskName, argv[3], ParseSize(argv[4])))
+                printf("Error truncating file %s in the disk %s\n", argv[3], diskName);
+            else
+                printf("Resized the file %s to %lldB\n", argv[3], ParseSize(argv[4]));
+        }
+        else return 0;
+    }
     else if (strcmp(mode, "help") == 0)
     {
         printf("\n\n\n SOI T6 File system by Robert Dudzinski\n\n");
         printf("   List of all commands:\n\n");
-        printf("new (DISK_NAME) \n\t- creates a new disk with the name DISK_NAME\n\n");
+        printf("new (DISK_NAME) [SIZE] [BLOCK_SIZE] [FILES] [NAME_LENGTH] \n\t- creates a new disk with the name DISK_NAME holding SIZE bytes in blocks of BLOCK_SIZE (4K by default), at most FILES files (512) with names of at most NAME_LENGTH characters (255); sizes accept K, M and G suffixes, e.g. 'new media.img 64G 1M 4096' or 'new objects.img 8G 4K 2000000 63'\n\n");
         printf("remove (DISK_NAME) \n\t- deletes a new disk with the name DISK_NAME\n\n");
         printf("insert (DISK_NAME) (EXT_FILE) [INTERNAL_NAME] \n\t- copies a file EXT_FILE to the disk DISK_NAME and changes its name to INTERNAL_NAME (or name of EXT_NAME if internal name it's not provided\n\n");
         printf("memory (DISK_NAME) \n\t- displays map of memory in the disk DISK_NAME\n\n");
-        printf("list (DISK_NAME) \n\t- displays list of all files\n\n");
-        printf("export (DISK_NAME) (FILE_NAME) [EXPORT_NAME] \n\t- copies file FILE_NAME from disk DISK_NAME to the folder where disk exists\n\n");
+        printf("list (DISK_NAME) [DIR] \n\t- displays list of all files with their paths, or only the entries of the directory DIR\n\n");
+        printf("mkdir (DISK_NAME) (DIR) \n\t- creates the directory DIR; paths of files and directories separate their components with '/'\n\n");
+        printf("rmdir (DISK_NAME) (DIR) \n\t- removes the empty directory DIR\n\n");
+        printf("rename (DISK_NAME) (OLD_PATH) (NEW_PATH) \n\t- renames or moves a file or a directory with everything under it\n\n");
+        printf("export (DISK_NAME) (FILE_NAME) [EXPORT_NAME] \n\t- copies file FILE_NAME from disk DISK_NAME to the folder where disk exists; a directory is copied with everything under it\n\n");
         printf("delete (DISK_NAME) (FILE_NAME) \n\t- deletes file FILE_NAME from the disk DISK_NAME\n\n");
         printf("info (DISK_NAME) \n\t- displays information about given disk DISK_NAME\n\n");
+        printf("insert-batch (DISK_NAME) (MANIFEST|DIR) \n\t- inserts all files listed in MANIFEST (lines: EXT_FILE [INTERNAL_NAME]) or all files of the directory DIR at once\n\n");
+        printf("export-batch (DISK_NAME) (MANIFEST|DIR) \n\t- exports all files listed in MANIFEST (lines: FILE_NAME [EXPORT_NAME]) or every file of the disk to the directory DIR, recreating the directories of the disk\n\n");
+        printf("resize (DISK_NAME) (SIZE) [FILES] \n\t- grows the disk DISK_NAME in place to SIZE bytes of blocks and FILES files, keeping everything stored in it\n\n");
+        printf("defrag (DISK_NAME) [BUDGET] [shrink] \n\t- moves files of the disk DISK_NAME into contiguous runs at its start, copying at most BUDGET bytes (no limit by default); with shrink the files at the end are moved into the free space below them, split if needed, and the free space at the end is cut off the image\n\n");
+        printf("fsck (DISK_NAME) [repair] \n\t- checks the disk DISK_NAME for leaked and cross-linked blocks, damaged lists of extents, free lists, directories and name index and wrong counters; with repair fixes them, removing damaged files and moving entries which cannot be reached to the root directory (run it only while nothing else writes the disk)\n\n");
+        printf("read (DISK_NAME) (FILE_NAME) (OFFSET) (LENGTH) \n\t- prints LENGTH bytes of the file FILE_NAME from OFFSET\n\n");
+        printf("write (DISK_NAME) (FILE_NAME) (OFFSET) (TEXT) \n\t- writes TEXT into the file FILE_NAME at OFFSET, extending it if needed\n\n");
+        printf("append (DISK_NAME) (FILE_NAME) (TEXT) \n\t- appends TEXT to the file FILE_NAME\n\n");
+        printf("truncate (DISK_NAME) (FILE_NAME) (SIZE) \n\t- cuts the file FILE_NAME to SIZE bytes or extends it with zeros\n\n");
+        printf("stats (COMMAND) (DISK_NAME) ... \n\t- runs COMMAND and prints the reads, writes, seeks and bytes it made, the metadata records it accessed and how long it took, e.g. 'stats insert disk.img photo.jpg'\n\n");
+        printf("Set FS_BACKEND=mmap in the environment to access disks through a memory mapping\n\n");
+        printf("Set FS_THREADS=N in the environment to copy file data, and to walk the lists of extents in fsck, with N threads\n\n");
+        printf("Set FS_DEDUP=0 in the environment to store inserted files without looking for blocks the disk already holds\n\n");
+        printf("Set FS_COMPRESS=1 in the environment to store inserted files compressed when that saves space\n\n");
+        printf("Set FS_PREALLOCATE=1 in the environment to reserve the space of a new disk up front instead of creating a sparse file\n\n");
+        printf("Set FS_CACHE=SIZE in the environment to cache SIZE bytes of file blocks (16M by default, 0 to disable)\n\n");
+        printf("Set FS_META_CACHE=SIZE in the environment to cache up to SIZE bytes of each metadata table (4M by default)\n\n");
+        printf("Set FS_CACHE_STATS=1 in the environment to print the hits and misses of the caches when a disk is unmounted\n\n");
+        printf("Set FS_TRACE=FILE in the environment to append every read, write and sync of the disk to FILE ('-' for the standard error) as lines 'OPERATION CALL ADDRESS BYTES MICROSECONDS'\n\n");
         printf("\n\n\n");
     }
     else if (strcmp(mode, "memory") == 0)
@@ -114,9 +319,42 @@ int main(int argc, char **argv)
     }
     else if (strcmp(mode, "list") == 0)
     {
-        if (DisplayFiles(diskName))
+        if (argc > 3 ? DisplayDirectory(diskName, argv[3]) : DisplayFiles(diskName))
             printf("Error display list of files\n");
     }
+    else if (strcmp(mode, "mkdir") == 0)
+    {
+        if (argc > 3)
+        {
+            if (MakeDirectory(diskName, argv[3]))
+                printf("Error creating directory %s in the disk %s\n", argv[3], diskName);
+            else
+                printf("Created directory %s in the disk %s\n", argv[3], diskName);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "rmdir") == 0)
+    {
+        if (argc > 3)
+        {
+            if (RemoveDirectory(diskName, argv[3]))
+                printf("Error removing directory %s from the disk %s\n", argv[3], diskName);
+            else
+                printf("Removed directory %s from the disk %s\n", argv[3], diskName);
+        }
+        else return 0;
+    }
+    else if (strcmp(mode, "rename") == 0)
+    {
+        if (argc > 4)
+        {
+            if (RenameFile(diskName, argv[3], argv[4]))
+                printf("Error renaming %s in the disk %s\n", argv[3], diskName);
+            else
+                printf("Renamed %s to %s\n", argv[3], argv[4]);
+        }
+        else return 0;
+    }
     else if (strcmp(mode, "export") == 0)
     {
         if (argc > 4)
@@ -153,5 +391,6 @@ int main(int argc, char **argv)
         printf("Could not find command '%s' to execute; use 'help' to display all commands\n", mode);
     }
     
+    if (stats) DisplayIoStats();
     return 0;
 }
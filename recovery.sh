@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+#   Checks the recovery of a disk. Damage of the map of blocks, of its
+#   summary and of the counters of the header is found by fsck and fixed
+#   by 'fsck repair'. An insert killed at a point of its commits (FS_CRASH)
+#   leaves a disk which is consistent once the next writer has replayed
+#   the journal and given back the blocks the insert reserved.
+#   Usage: ./recovery.sh
+#
+
+gcc -Wall FS.c main.c -lpthread -o a.out || exit 1
+
+STATUS=0
+
+head -c 300000 /dev/urandom > recovery.bin
+head -c 1000 /dev/urandom > recovery.small
+
+# Writes the bytes given as \x escapes at an offset of the disk
+Damage()
+{
+    printf "$2" | dd of=recovery.disk bs=1 seek=$1 conv=notrunc status=none
+}
+
+# Reports a problem if fsck does not find the disk consistent
+Consistent()
+{
+    ./a.out fsck recovery.disk | grep -q "No problems found" || { echo "$1: recovery.disk is not consistent"; STATUS=1; }
+}
+
+echo "Damaged map of blocks, summary and counters"
+./a.out new recovery.disk 4M > /dev/null
+./a.out insert recovery.disk recovery.small small > /dev/null
+./a.out insert recovery.disk recovery.bin big > /dev/null
+
+MAP_END=$(./a.out memory recovery.disk | awk '/Map words/ { print $3 }')
+SUMMARY=$(./a.out memory recovery.disk | awk '/Map pages summary/ { print $1 }')
+
+# the last map word marks free blocks used, the summary counts none, the header 7 files and 99 blocks
+Damage $((MAP_END - 3)) '\xff\xff\xff\xff'
+Damage $SUMMARY '\x00\x00\x00\x00'
+Damage 4 '\x07\x00\x00\x00\x63\x00\x00\x00'
+
+./a.out fsck recovery.disk | grep -q "is not consistent" || { echo "The damage was not found"; STATUS=1; }
+./a.out fsck recovery.disk repair > /dev/null
+Consistent "After the repair"
+./a.out export recovery.disk big recovery.out > /dev/null
+cmp -s recovery.bin recovery.out || { echo "big differs after the repair"; STATUS=1; }
+./a.out remove recovery.disk Y > /dev/null
+rm -f recovery.out
+
+# POINT:COMMIT and whether the insert reached the disk; its first commit reserves the blocks, the second one stores the file
+for CASE in journal:1:no header:1:no copy:1:no journal:2:yes header:2:yes
+do
+    POINT=${CASE%:*}
+    STORED=${CASE##*:}
+    echo "Insert killed at $POINT"
+
+    ./a.out new recovery.disk 8M > /dev/null
+    ./a.out insert recovery.disk recovery.small small > /dev/null
+    FS_CRASH=$POINT ./a.out insert recovery.disk recovery.bin big > /dev/null
+    [ $? -eq 3 ] || { echo "$POINT: the insert was not killed"; STATUS=1; }
+
+    # a writer replays the journal, the next insert reclaims the reservation
+    ./a.out mkdir recovery.disk after > /dev/null
+    ./a.out insert recovery.disk recovery.small small2 > /dev/null
+    Consistent "$POINT"
+
+    if [ $STORED = yes ]
+    then
+        ./a.out export recovery.disk big recovery.out > /dev/null
+        cmp -s recovery.bin recovery.out || { echo "$POINT: big differs after the recovery"; STATUS=1; }
+    elif ./a.out list recovery.disk | grep -q " big$"
+    then
+        echo "$POINT: big is stored, but its insert never ended"
+        STATUS=1
+    fi
+
+    ./a.out remove recovery.disk Y > /dev/null
+    rm -f recovery.out
+done
+
+echo "Insert killed while copying, then repaired"
+./a.out new recovery.disk 8M > /dev/null
+FS_CRASH=copy ./a.out insert recovery.disk recovery.bin big > /dev/null
+./a.out fsck recovery.disk repair | grep -q "Reclaimed 1 descriptors" || { echo "The repair did not reclaim the insert"; STATUS=1; }
+Consistent "After the repair"
+./a.out remove recovery.disk Y > /dev/null
+
+rm -f recovery.bin recovery.small
+
+[ $STATUS -eq 0 ] && echo "RECOVERY OK"
+exit $STATUS